@@ -0,0 +1,373 @@
+#ifndef TOOL_SUPPORT_H
+#define TOOL_SUPPORT_H
+
+// Clang Includes
+#include <clang/Basic/DiagnosticOptions.h>
+#include <clang/Basic/VirtualFileSystem.h>
+#include <clang/Frontend/TextDiagnosticPrinter.h>
+#include <clang/Tooling/CompilationDatabase.h>
+#include <clang/Tooling/Tooling.h>
+
+// LLVM Includes
+#include <llvm/ADT/ArrayRef.h>
+#include <llvm/ADT/DenseMapInfo.h>
+#include <llvm/ADT/Hashing.h>
+#include <llvm/ADT/SmallString.h>
+#include <llvm/ADT/StringRef.h>
+#include <llvm/ADT/Twine.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/Format.h>
+#include <llvm/Support/Path.h>
+#include <llvm/Support/ThreadPool.h>
+#include <llvm/Support/raw_ostream.h>
+
+// Standard Includes
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// POSIX Includes
+#include <unistd.h>
+
+/// Helpers shared by the tools that run on many files at once.
+namespace ToolSupport {
+
+/// A hash that, unlike `llvm::hash_value`, is the same in every run and so can
+/// be stored on disk (64-bit FNV-1a), continuing from the given hash.
+inline uint64_t StableHash(llvm::StringRef Data,
+                           uint64_t Hash = 0xcbf29ce484222325ULL) {
+  for (const auto Character : Data) {
+    Hash ^= static_cast<unsigned char>(Character);
+    Hash *= 0x100000001b3ULL;
+  }
+  return Hash;
+}
+
+/// Writes the data to a temporary file next to the path and renames it into
+/// place, so that concurrent readers never see a half-written file.
+///
+/// If the path is a symbolic link, the file it points to is replaced rather
+/// than the link. An existing file keeps its permissions and, where the
+/// process may give files away, its owner.
+inline bool StoreAtomically(const llvm::Twine& Path, llvm::StringRef Data) {
+  llvm::SmallString<256> Target;
+  if (llvm::sys::fs::real_path(Path, Target)) {
+    // The file does not exist yet, so there is no link to follow.
+    Target.clear();
+    Path.toVector(Target);
+  }
+
+  llvm::sys::fs::file_status Status;
+  const bool Exists = !llvm::sys::fs::status(Target, Status);
+
+  int FD;
+  llvm::SmallString<256> Temporary;
+  if (llvm::sys::fs::createUniqueFile(llvm::Twine(Target) + "-%%%%%%",
+                                      FD,
+                                      Temporary)) {
+    return false;
+  }
+
+  if (Exists) {
+    if (llvm::sys::fs::setPermissions(Temporary, Status.permissions())) {
+      ::close(FD);
+      llvm::sys::fs::remove(Temporary);
+      return false;
+    }
+
+    // Only privileged processes may change the owner, so failing is fine.
+    const auto Chowned = ::fchown(FD, Status.getUser(), Status.getGroup());
+    static_cast<void>(Chowned);
+  }
+
+  {
+    llvm::raw_fd_ostream Stream(FD, /*shouldClose=*/true);
+    Stream << Data;
+    if (Stream.has_error()) {
+      Stream.clear_error();
+      llvm::sys::fs::remove(Temporary);
+      return false;
+    }
+  }
+
+  if (llvm::sys::fs::rename(Temporary, Target)) {
+    llvm::sys::fs::remove(Temporary);
+    return false;
+  }
+
+  return true;
+}
+
+/// Writes the string as a JSON string literal (which DOT accepts as well).
+inline void WriteJSONString(llvm::raw_ostream& Stream, llvm::StringRef String) {
+  Stream << '"';
+  for (const auto Character : String) {
+    switch (Character) {
+      case '"': Stream << "\\\""; break;
+      case '\\': Stream << "\\\\"; break;
+      case '\n': Stream << "\\n"; break;
+      case '\t': Stream << "\\t"; break;
+      default:
+        if (static_cast<unsigned char>(Character) < 0x20) {
+          Stream << llvm::format("\\u%04x", Character);
+        } else {
+          Stream << Character;
+        }
+    }
+  }
+  Stream << '"';
+}
+
+/// One value per thread, for workers to add to without sharing a lock.
+///
+/// Each thread gets its own value the first time it asks for one; only that
+/// registration takes the lock. The values are merged by going over `getAll()`
+/// once no thread adds anymore.
+template <typename T>
+class PerThread {
+ public:
+  PerThread() : Instance(NextInstance()) {}
+
+  PerThread(const PerThread&) = delete;
+  PerThread& operator=(const PerThread&) = delete;
+
+  /// Returns the value of the calling thread, creating it on first use.
+  T& getLocal() {
+    // Instances are numbered rather than compared by address, so that a new
+    // instance at the address of a destroyed one does not find its values.
+    thread_local uint64_t Owner = 0;
+    thread_local T* Local = nullptr;
+    if (Owner == Instance) return *Local;
+
+    std::lock_guard<std::mutex> Lock(Mutex);
+    auto& Slot = ByThread[std::this_thread::get_id()];
+    if (!Slot) {
+      Values.push_back(std::make_unique<T>());
+      Slot = Values.back().get();
+    }
+
+    Owner = Instance;
+    Local = Slot;
+    return *Local;
+  }
+
+  /// The values of all threads that asked for one. Must only be used once no
+  /// thread calls `getLocal()` anymore.
+  std::vector<std::unique_ptr<T>>& getAll() noexcept {
+    return Values;
+  }
+
+ private:
+  /// Returns a number no other instance has.
+  static uint64_t NextInstance() {
+    static std::atomic<uint64_t> Counter(0);
+    return ++Counter;
+  }
+
+  /// The number of this instance.
+  const uint64_t Instance;
+
+  /// Guards the values.
+  std::mutex Mutex;
+
+  /// The value of each thread.
+  std::map<std::thread::id, T*> ByThread;
+
+  /// The values of all threads.
+  std::vector<std::unique_ptr<T>> Values;
+};
+
+/// A set that any thread can insert into, split into independently locked
+/// shards so that threads rarely wait on each other.
+///
+/// \tparam Set The set of each shard, like `llvm::StringSet<>` or an
+/// `llvm::DenseSet`.
+template <typename Set>
+class ShardedSet {
+ public:
+  /// Inserts the key.
+  ///
+  /// \returns True if this is the first insertion of the key.
+  template <typename Key>
+  bool insert(const Key& NewKey) {
+    auto& Shard = Shards[getHash(NewKey) % NumberOfShards];
+    std::lock_guard<std::mutex> Lock(Shard.Mutex);
+    return Shard.Keys.insert(NewKey).second;
+  }
+
+ private:
+  /// The number of independently locked parts of the set.
+  static constexpr size_t NumberOfShards = 64;
+
+  /// One independently locked part of the set.
+  struct Shard {
+    std::mutex Mutex;
+    Set Keys;
+  };
+
+  static unsigned getHash(llvm::StringRef Key) {
+    return llvm::hash_value(Key);
+  }
+
+  template <typename Key>
+  static unsigned getHash(const Key& Value) {
+    return llvm::DenseMapInfo<Key>::getHashValue(Value);
+  }
+
+  /// The shards of the set.
+  std::array<Shard, NumberOfShards> Shards;
+};
+
+/// Runs the task for every source file, spreading the files over a pool of
+/// worker threads (one per hardware thread if `Jobs` is zero).
+///
+/// \returns Non-zero if the task failed for any file.
+inline int RunInParallel(llvm::ArrayRef<std::string> Sources,
+                         unsigned Jobs,
+                         const std::function<bool(const std::string&)>& Task) {
+  if (Jobs == 0) Jobs = std::thread::hardware_concurrency();
+
+  std::atomic<int> Status(0);
+  llvm::ThreadPool Pool(std::max(Jobs, 1u));
+  for (const auto& Source : Sources) {
+    Pool.async([&Task, &Status, &Source] {
+      if (!Task(Source)) Status = 1;
+    });
+  }
+  Pool.wait();
+
+  return Status;
+}
+
+/// Resolves the path against the directory if it is relative, without
+/// looking at the process' working directory.
+inline std::string MakeAbsolute(llvm::StringRef Directory,
+                                llvm::StringRef Path) {
+  llvm::SmallString<256> Absolute(Path);
+  if (llvm::sys::path::is_relative(Path)) {
+    Absolute = Directory;
+    llvm::sys::path::append(Absolute, Path);
+  }
+  llvm::sys::path::remove_dots(Absolute, /*remove_dot_dot=*/true);
+  return Absolute.str();
+}
+
+/// What a worker does with the `ClangTool` of one source file.
+///
+/// The source is absolute. The directory is the (absolute) directory of all
+/// compile commands of the source, which the preprocessor resolves relative
+/// paths against; it is empty if the commands disagree.
+///
+/// \returns False if the tool failed.
+using ToolTask = std::function<bool(clang::tooling::ClangTool& Tool,
+                                    const std::string& Source,
+                                    const std::string& Directory)>;
+
+/// Runs a `ClangTool` for every source file, spreading the files over a pool
+/// of worker threads (one per hardware thread if `Jobs` is zero).
+///
+/// `ClangTool::run` changes the working directory of the whole process into
+/// the directory of each compile command. So the sources are grouped by that
+/// directory, the process changes into it before a group starts, and only
+/// the files of one group run at a time; the changes of each worker are then
+/// no-ops. Sources whose commands disagree on the directory run on their own,
+/// after all groups. The working directory is restored at the end.
+///
+/// Each tool reports its diagnostics into a buffer, which is printed to
+/// stderr at once when the tool is done, so that the diagnostics of different
+/// files never interleave.
+///
+/// \returns Non-zero if the task failed for any file.
+inline int
+RunToolsInParallel(const clang::tooling::CompilationDatabase& Compilations,
+                   llvm::ArrayRef<std::string> Sources,
+                   unsigned Jobs,
+                   const ToolTask& Task) {
+  auto FileSystem = clang::vfs::getRealFileSystem();
+  const auto Initial = FileSystem->getCurrentWorkingDirectory();
+  if (!Initial) {
+    llvm::errs() << "Error getting the working directory\n";
+    return 1;
+  }
+
+  // Ordered, so that runs are reproducible.
+  std::map<std::string, std::vector<std::string>> Groups;
+  std::vector<std::string> Mixed;
+  for (const auto& Source : Sources) {
+    auto Absolute = MakeAbsolute(*Initial, Source);
+
+    std::string Directory;
+    bool Shared = true;
+    for (const auto& Command : Compilations.getCompileCommands(Absolute)) {
+      const auto Resolved = MakeAbsolute(*Initial, Command.Directory);
+      if (Directory.empty()) {
+        Directory = Resolved;
+      } else if (Directory != Resolved) {
+        Shared = false;
+      }
+    }
+
+    // Without commands, ClangTool only reports that there are none.
+    if (Directory.empty()) Directory = *Initial;
+
+    if (Shared) {
+      Groups[Directory].push_back(std::move(Absolute));
+    } else {
+      Mixed.push_back(std::move(Absolute));
+    }
+  }
+
+  static std::mutex DiagnosticsMutex;
+  const auto Run = [&Compilations, &Task](const std::string& Source,
+                                          const std::string& Directory) {
+    std::string Buffer;
+    llvm::raw_string_ostream Stream(Buffer);
+    clang::TextDiagnosticPrinter Printer(Stream,
+                                         new clang::DiagnosticOptions());
+
+    clang::tooling::ClangTool Tool(Compilations, Source);
+    Tool.setDiagnosticConsumer(&Printer);
+    const auto Succeeded = Task(Tool, Source, Directory);
+
+    Stream.flush();
+    if (!Buffer.empty()) {
+      std::lock_guard<std::mutex> Lock(DiagnosticsMutex);
+      llvm::errs() << Buffer;
+    }
+    return Succeeded;
+  };
+
+  int Status = 0;
+  for (const auto& Group : Groups) {
+    if (FileSystem->setCurrentWorkingDirectory(Group.first)) {
+      llvm::errs() << "Error changing into: " << Group.first << '\n';
+      Status = 1;
+      continue;
+    }
+
+    const auto& Directory = Group.first;
+    const auto GroupStatus = RunInParallel(
+        Group.second, Jobs, [&Run, &Directory](const std::string& Source) {
+          return Run(Source, Directory);
+        });
+    if (GroupStatus != 0) Status = GroupStatus;
+  }
+
+  for (const auto& Source : Mixed) {
+    if (!Run(Source, std::string())) Status = 1;
+  }
+
+  FileSystem->setCurrentWorkingDirectory(*Initial);
+  return Status;
+}
+}  // namespace ToolSupport
+
+#endif  // TOOL_SUPPORT_H
@@ -1,116 +1,1481 @@
+// Tool includes
+#include "../common/tool-support.h"
+
 // Clang includes
 #include "clang/AST/ASTConsumer.h"
 #include "clang/AST/ASTContext.h"
 #include "clang/AST/Expr.h"
 #include "clang/ASTMatchers/ASTMatchFinder.h"
 #include "clang/ASTMatchers/ASTMatchers.h"
+#include "clang/Basic/CharInfo.h"
 #include "clang/Basic/Diagnostic.h"
+#include "clang/Basic/IdentifierTable.h"
+#include "clang/Basic/LangOptions.h"
 #include "clang/Basic/SourceLocation.h"
+#include "clang/Basic/SourceManager.h"
+#include "clang/Basic/TokenKinds.h"
 #include "clang/Frontend/FrontendAction.h"
+#include "clang/Lex/Lexer.h"
+#include "clang/Lex/Token.h"
 #include "clang/Tooling/CommonOptionsParser.h"
 #include "clang/Tooling/Tooling.h"
 
 // LLVM includes
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/Hashing.h"
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringExtras.h"
 #include "llvm/ADT/StringRef.h"
 #include "llvm/ADT/StringSet.h"
+#include "llvm/ADT/Twine.h"
 #include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/MathExtras.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
 #include "llvm/Support/raw_ostream.h"
 
 // Standard includes
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
 #include <fstream>
+#include <limits>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <tuple>
+#include <vector>
 
 namespace DictionaryCheck {
 
-using Dictionary = llvm::StringSet<>;
+using ToolSupport::StableHash;
+using ToolSupport::StoreAtomically;
+using ToolSupport::WriteJSONString;
+
+/// A set of words that is queried case-insensitively.
+///
+/// A dictionary is compiled from one or more word lists ("layers"), such as a
+/// base language, a project allowlist and a list of abbreviations. Their words
+/// are folded to lowercase, merged and stored in one open-addressing hash
+/// table, so that a lookup is a single probe no matter how many layers there
+/// are, and only has to fold the query into a stack buffer.
+///
+/// The compiled dictionary is cached on disk under a name derived from the
+/// contents of its layers, and memory-mapped by later runs. Its layout is:
+///
+///   Header
+///   uint32_t WordOffsets[NumberOfWords + 1]
+///   uint32_t Slots[NumberOfSlots]  (word index + 1, or 0 if empty)
+///   char Words[WordBytes]          (sorted)
+class Dictionary {
+ public:
+  /// The buffer used to fold a word. Names longer than this spill to the heap.
+  using FoldBuffer = llvm::SmallString<64>;
+
+  /// Loads the dictionary compiled from the layers from the cache directory,
+  /// compiling and caching it first if this combination of layers is new.
+  ///
+  /// \returns The dictionary, or null if a layer could not be read or there are
+  /// no words at all.
+  static std::unique_ptr<Dictionary> load(llvm::ArrayRef<std::string> Layers,
+                                          llvm::StringRef CacheDirectory) {
+    std::vector<std::unique_ptr<llvm::MemoryBuffer>> Contents;
+    uint64_t Key = StableHash({});
+    for (const auto& Layer : Layers) {
+      auto Buffer = llvm::MemoryBuffer::getFile(Layer);
+      if (!Buffer) {
+        llvm::errs() << "Error reading from: " << Layer << '\n';
+        return nullptr;
+      }
+
+      // Combine the hash of each layer, so that editing any of them (or
+      // changing their order) leads to a new compiled dictionary.
+      const uint64_t LayerHash = StableHash((*Buffer)->getBuffer());
+      Key = StableHash({reinterpret_cast<const char*>(&LayerHash),
+                        sizeof(LayerHash)},
+                       Key);
+      Contents.emplace_back(std::move(*Buffer));
+    }
+
+    llvm::SmallString<256> Path(CacheDirectory);
+    llvm::sys::path::append(Path,
+                            "dict-check-" + llvm::utohexstr(Key) + ".dict");
+
+    auto Buffer = llvm::MemoryBuffer::getFile(Path,
+                                              /*FileSize=*/-1,
+                                              /*RequiresNullTerminator=*/false);
+    std::unique_ptr<Dictionary> Words;
+    if (Buffer) Words = create(std::move(*Buffer), Path.str());
+
+    if (!Words || Words->getKey() != Key) {
+      llvm::errs() << "Compiling dictionary " << Path << '\n';
+      const auto Blob = compile(Contents, Key);
+      if (!StoreAtomically(Path, Blob)) {
+        llvm::errs() << "Could not store dictionary " << Path << '\n';
+      }
+      Words = create(llvm::MemoryBuffer::getMemBufferCopy(Blob, Path),
+                     Path.str());
+    }
+
+    if (!Words || Words->size() == 0) {
+      llvm::errs() << "Dictionary must not be empty!\n";
+      return nullptr;
+    }
+
+    llvm::errs() << "Loaded " << Words->size() << " words from "
+                 << Layers.size() << " dictionaries\n";
+
+    return Words;
+  }
+
+  /// Returns true if the dictionary contains the word, ignoring case.
+  bool contains(llvm::StringRef Word) const {
+    FoldBuffer Folded;
+    const auto Query = fold(Word, Folded);
+
+    const uint32_t Mask = getHeader().NumberOfSlots - 1;
+    for (uint32_t Slot = StableHash(Query) & Mask;; Slot = (Slot + 1) & Mask) {
+      if (Slots[Slot] == 0) return false;
+      if (getWord(Slots[Slot] - 1) == Query) return true;
+    }
+  }
+
+  /// The number of distinct (folded) words in the dictionary.
+  size_t size() const noexcept {
+    return getHeader().NumberOfWords;
+  }
+
+  /// The (folded) word with the given index. Words are in alphabetical order.
+  llvm::StringRef getWord(uint32_t Index) const {
+    const auto Begin = WordOffsets[Index];
+    return {Words + Begin, WordOffsets[Index + 1] - Begin};
+  }
+
+  /// A hash of the contents of the layers the dictionary was compiled from.
+  uint64_t getKey() const noexcept {
+    return getHeader().Key;
+  }
+
+  /// The path of the compiled dictionary, next to which derived data (like a
+  /// suggestion index) can be cached.
+  const std::string& getPath() const noexcept {
+    return Path;
+  }
+
+  /// Writes the lowercase version of `Word` into `Buffer`.
+  static llvm::StringRef fold(llvm::StringRef Word, FoldBuffer& Buffer) {
+    Buffer.resize(Word.size());
+    for (size_t Index = 0; Index < Word.size(); ++Index) {
+      Buffer[Index] = clang::toLowercase(Word[Index]);
+    }
+    return Buffer.str();
+  }
+
+ private:
+  /// The header at the start of a compiled dictionary.
+  struct DictionaryHeader {
+    char Magic[8];
+    uint64_t Key;
+    uint32_t NumberOfWords;
+    uint32_t NumberOfSlots;
+    uint32_t WordBytes;
+    uint32_t Reserved;
+  };
+
+  /// Identifies the format. Bump the version when the layout changes.
+  static constexpr char Magic[8] = {'D', 'I', 'C', 'T', 'C', 'H', '0', '1'};
+
+  Dictionary(std::unique_ptr<llvm::MemoryBuffer> Buffer, std::string Path)
+  : Buffer(std::move(Buffer)), Path(std::move(Path)) {}
+
+  /// Wraps the buffer in a dictionary, or returns null if it is not a valid
+  /// compiled dictionary.
+  static std::unique_ptr<Dictionary>
+  create(std::unique_ptr<llvm::MemoryBuffer> Buffer, std::string Path) {
+    const auto Size = Buffer->getBufferSize();
+    if (Size < sizeof(DictionaryHeader)) return nullptr;
+
+    const auto* Start = Buffer->getBufferStart();
+    const auto& Header = *reinterpret_cast<const DictionaryHeader*>(Start);
+    if (std::memcmp(Header.Magic, Magic, sizeof(Magic)) != 0) return nullptr;
+
+    const uint64_t Expected = sizeof(DictionaryHeader) +
+                              sizeof(uint32_t) * (Header.NumberOfWords + 1) +
+                              sizeof(uint32_t) * Header.NumberOfSlots +
+                              Header.WordBytes;
+    if (Size != Expected) return nullptr;
+
+    std::unique_ptr<Dictionary> Compiled(
+        new Dictionary(std::move(Buffer), std::move(Path)));
+
+    const auto* Data = Start + sizeof(DictionaryHeader);
+    Compiled->WordOffsets = reinterpret_cast<const uint32_t*>(Data);
+    Data += sizeof(uint32_t) * (Header.NumberOfWords + 1);
+    Compiled->Slots = reinterpret_cast<const uint32_t*>(Data);
+    Data += sizeof(uint32_t) * Header.NumberOfSlots;
+    Compiled->Words = Data;
+
+    return Compiled;
+  }
+
+  /// Merges the words of all layers (whitespace-separated) into a serialized
+  /// dictionary.
+  static std::string
+  compile(const std::vector<std::unique_ptr<llvm::MemoryBuffer>>& Layers,
+          uint64_t Key) {
+    llvm::StringSet<> Unique;
+    FoldBuffer Folded;
+    for (const auto& Layer : Layers) {
+      llvm::StringRef Rest = Layer->getBuffer();
+      while (!Rest.empty()) {
+        Rest = Rest.ltrim();
+        const auto Word = Rest.take_until(clang::isWhitespace);
+        Rest = Rest.drop_front(Word.size());
+        if (!Word.empty()) Unique.insert(fold(Word, Folded));
+      }
+    }
+
+    std::vector<llvm::StringRef> Sorted;
+    Sorted.reserve(Unique.size());
+    for (const auto& Entry : Unique) Sorted.push_back(Entry.getKey());
+    std::sort(Sorted.begin(), Sorted.end());
+
+    DictionaryHeader Header;
+    std::memcpy(Header.Magic, Magic, sizeof(Magic));
+    Header.Key = Key;
+    Header.NumberOfWords = Sorted.size();
+    // Keep the table at most half full, so that probe sequences stay short.
+    Header.NumberOfSlots = llvm::NextPowerOf2(2 * Sorted.size());
+    Header.WordBytes = 0;
+    Header.Reserved = 0;
+
+    std::vector<uint32_t> WordOffsets;
+    WordOffsets.reserve(Sorted.size() + 1);
+    for (const auto Word : Sorted) {
+      WordOffsets.push_back(Header.WordBytes);
+      Header.WordBytes += Word.size();
+    }
+    WordOffsets.push_back(Header.WordBytes);
+
+    const uint32_t Mask = Header.NumberOfSlots - 1;
+    std::vector<uint32_t> Slots(Header.NumberOfSlots, 0);
+    for (uint32_t Index = 0; Index < Sorted.size(); ++Index) {
+      auto Slot = StableHash(Sorted[Index]) & Mask;
+      while (Slots[Slot] != 0) Slot = (Slot + 1) & Mask;
+      Slots[Slot] = Index + 1;
+    }
+
+    std::string Blob;
+    llvm::raw_string_ostream Stream(Blob);
+    Stream.write(reinterpret_cast<const char*>(&Header), sizeof(Header));
+    Stream.write(reinterpret_cast<const char*>(WordOffsets.data()),
+                 sizeof(uint32_t) * WordOffsets.size());
+    Stream.write(reinterpret_cast<const char*>(Slots.data()),
+                 sizeof(uint32_t) * Slots.size());
+    for (const auto Word : Sorted) Stream << Word;
+
+    return Stream.str();
+  }
+
+  /// The header of the compiled dictionary.
+  const DictionaryHeader& getHeader() const {
+    return *reinterpret_cast<const DictionaryHeader*>(
+        Buffer->getBufferStart());
+  }
+
+  /// The (usually memory-mapped) compiled dictionary.
+  std::unique_ptr<llvm::MemoryBuffer> Buffer;
+
+  /// The path of the compiled dictionary.
+  std::string Path;
+
+  /// The offset of each word in `Words`, plus the end of the last word.
+  const uint32_t* WordOffsets;
+
+  /// The hash table of word indices (plus one; zero marks an empty slot).
+  const uint32_t* Slots;
+
+  /// The concatenated words.
+  const char* Words;
+};
+
+constexpr char Dictionary::Magic[8];
+
+namespace {
+/// Computes the optimal string alignment distance (Levenshtein distance plus
+/// transpositions) from one word to many others.
+///
+/// This is Hyyrö's bit-parallel algorithm: a column of the dynamic programming
+/// table is kept as bit vectors of the differences between adjacent cells, one
+/// bit per character of the word, so each character of the other word costs a
+/// handful of word operations. Words longer than `MaximumLength` are never
+/// considered close.
+class WordDistance {
+ public:
+  /// The longest word whose distances can be computed.
+  static constexpr size_t MaximumLength = 64;
+
+  explicit WordDistance(llvm::StringRef Word) : Length(Word.size()) {
+    if (Length > MaximumLength) return;
+    for (size_t Index = 0; Index < Length; ++Index) {
+      Matches[static_cast<unsigned char>(Word[Index])] |= uint64_t(1) << Index;
+    }
+  }
+
+  /// Computes the distance to the other word, giving up once it must exceed
+  /// `Bound`.
+  ///
+  /// \returns The distance, or `Bound + 1` if it is larger than `Bound`.
+  unsigned to(llvm::StringRef Other, unsigned Bound) const {
+    const unsigned Infinity = Bound + 1;
+    if (Length > MaximumLength || Other.size() > MaximumLength) {
+      return Infinity;
+    }
+
+    const size_t Difference =
+        Length > Other.size() ? Length - Other.size() : Other.size() - Length;
+    if (Difference > Bound) return Infinity;
+    if (Length == 0) return Other.size();
+
+    // Positive and Negative mark the cells of the current column that are one
+    // more or one less than the cell above; Zero the cells that equal the one
+    // to their upper left. The last row holds the distance to the prefix of
+    // the other word seen so far.
+    const uint64_t LastRow = uint64_t(1) << (Length - 1);
+    uint64_t Positive = ~uint64_t(0);
+    uint64_t Negative = 0;
+    uint64_t Zero = 0;
+    uint64_t PreviousMatch = 0;
+    size_t Distance = Length;
+    for (size_t Index = 0; Index < Other.size(); ++Index) {
+      const auto Match = Matches[static_cast<unsigned char>(Other[Index])];
+      const auto Transposed = ((~Zero & Match) << 1) & PreviousMatch;
+      Zero = (((Match & Positive) + Positive) ^ Positive) | Match | Negative |
+             Transposed;
+
+      auto HorizontalPositive = Negative | ~(Zero | Positive);
+      const auto HorizontalNegative = Zero & Positive;
+      if (HorizontalPositive & LastRow) ++Distance;
+      if (HorizontalNegative & LastRow) --Distance;
+
+      // Each remaining character lowers the distance by at most one.
+      if (Distance > Bound + (Other.size() - Index - 1)) return Infinity;
+
+      HorizontalPositive = (HorizontalPositive << 1) | 1;
+      Negative = HorizontalPositive & Zero;
+      Positive = (HorizontalNegative << 1) | ~(HorizontalPositive | Zero);
+      PreviousMatch = Match;
+    }
+
+    return std::min<size_t>(Distance, Infinity);
+  }
+
+ private:
+  /// The number of characters in the word.
+  size_t Length;
+
+  /// For each character, the positions at which it occurs in the word.
+  uint64_t Matches[256] = {};
+};
+}  // namespace
+
+/// Finds the dictionary words closest to a misspelled word.
+///
+/// This is a symmetric delete (SymSpell) index: for every dictionary word, it
+/// stores the hashes of all strings obtained by deleting up to two characters
+/// from the word's prefix. Two words within edit distance `D` share a string
+/// obtained by deleting at most `D` characters from each, so a lookup only
+/// generates the deletes of the query and verifies the few words they lead to,
+/// instead of scanning the dictionary.
+///
+/// Each posting records the length of its word and whether two characters were
+/// deleted (a "far" delete), and the postings of a delete are sorted by word,
+/// the near ones first. A lookup first merges the near postings of the deletes
+/// of up to one character of the query in alphabetical order, and stops as soon
+/// as it has found enough words within distance one. Only if there are not
+/// enough does it go on to all postings of all deletes, which are most of the
+/// index.
+///
+/// The index is built once and stored next to the compiled dictionary, from
+/// where later runs memory-map it. It refers to words by their index in the
+/// dictionary. Its layout is:
+///
+///   Header
+///   uint32_t BucketStarts[NumberOfBuckets + 1]
+///   Posting Postings[NumberOfPostings]  (sorted by bucket, hash and key)
+class SuggestionIndex {
+ public:
+  /// The maximum edit distance of a suggestion.
+  static constexpr unsigned MaximumDistance = 2;
+
+  /// How many leading characters of each word are indexed. Bounds the number
+  /// of deletes per word, at the cost of verifying a few more candidates.
+  static constexpr unsigned PrefixLength = 7;
+
+  /// Memory-maps the index stored next to the compiled dictionary (in the
+  /// cache directory), building and storing it first if it is missing or was
+  /// built for different words.
+  ///
+  /// \returns The index, or null if it could neither be loaded nor built.
+  static std::unique_ptr<SuggestionIndex>
+  loadOrBuild(const Dictionary& Words) {
+    const auto Path = Words.getPath() + ".symspell";
+    const auto Hash = Words.getKey();
+
+    auto Buffer = llvm::MemoryBuffer::getFile(Path,
+                                              /*FileSize=*/-1,
+                                              /*RequiresNullTerminator=*/false);
+    if (Buffer) {
+      auto Index = create(std::move(*Buffer), Words);
+      if (Index && Index->getHeader().DictionaryHash == Hash) return Index;
+    }
+
+    llvm::errs() << "Building suggestion index " << Path << '\n';
+    std::string Blob = build(Words);
+    if (!StoreAtomically(Path, Blob)) {
+      llvm::errs() << "Could not store suggestion index " << Path << '\n';
+    }
+
+    return create(llvm::MemoryBuffer::getMemBufferCopy(Blob, Path), Words);
+  }
+
+  /// Finds up to `Count` dictionary words within `MaximumDistance` of the word
+  /// (ignoring case), closest first and alphabetically among equally close
+  /// ones.
+  void suggest(llvm::StringRef Word,
+               unsigned Count,
+               llvm::SmallVectorImpl<llvm::StringRef>& Suggestions) const {
+    Dictionary::FoldBuffer Folded;
+    const auto Query = Dictionary::fold(Word, Folded);
+    if (Count == 0 || Query.size() > Posting::MaximumLength) return;
+
+    // Words within distance one share a delete of at most one character from
+    // each and differ in length by at most one. Look for those first, and
+    // only if there are not enough of them go on to the words within distance
+    // two, which may share a delete of two characters as well.
+    const WordDistance FromQuery(Query);
+    llvm::SmallVector<uint32_t, 8> Matches;
+
+    llvm::SmallVector<uint32_t, 32> Hashes;
+    collectDeleteHashes(Query, 0, Hashes);
+    collectDeleteHashes(Query, 1, Hashes);
+
+    llvm::SmallVector<llvm::ArrayRef<Posting>, 8> Runs;
+    for (const auto Hash : Hashes) {
+      const auto Run = getPostings(Hash, /*Far=*/false);
+      if (!Run.empty()) Runs.push_back(Run);
+    }
+    mergeClosest(FromQuery, Query.size(), Count, Runs, Matches);
+
+    if (Matches.size() < Count) {
+      collectDeleteHashes(Query, 2, Hashes);
+      sortFarther(FromQuery, Query.size(), Count, Hashes, Matches);
+    }
+
+    for (const auto Match : Matches) {
+      Suggestions.push_back(getWord(Match));
+    }
+  }
+
+ private:
+  /// The header at the start of the index.
+  struct IndexHeader {
+    char Magic[8];
+    uint64_t DictionaryHash;
+    uint32_t PrefixLength;
+    uint32_t NumberOfWords;
+    uint32_t NumberOfBuckets;
+    uint32_t NumberOfPostings;
+  };
+
+  /// A delete of some word's prefix, and that word.
+  struct Posting {
+    /// Word lengths are stored in six bits, so longer words are not indexed.
+    static constexpr uint32_t MaximumLength = 63;
+
+    /// \param Far Whether the delete removed `MaximumDistance` characters.
+    Posting(uint32_t Hash, size_t Length, bool Far, uint32_t Word)
+    : Hash(Hash), Key((uint32_t(Far) << 31) | (Word << 6) | Length) {}
+
+    /// The index of the word.
+    uint32_t getWord() const noexcept {
+      return (Key >> 6) & 0xffffff;
+    }
+
+    /// The length of the word.
+    uint32_t getLength() const noexcept {
+      return Key & MaximumLength;
+    }
+
+    /// Whether the delete removed `MaximumDistance` characters, so that the
+    /// word only matches queries up to that distance.
+    bool isFar() const noexcept {
+      return Key >> 31;
+    }
+
+    /// Whether the length of the word is within `Distance` of `Length`.
+    bool hasLengthWithin(size_t Length, unsigned Distance) const noexcept {
+      const size_t WordLength = getLength();
+      return WordLength + Distance >= Length && WordLength <= Length + Distance;
+    }
+
+    /// Orders postings by hash, then by whether they are far.
+    static bool compareRuns(const Posting& First, const Posting& Second) {
+      return std::make_tuple(First.Hash, First.isFar()) <
+             std::make_tuple(Second.Hash, Second.isFar());
+    }
+
+    /// The hash of the delete.
+    uint32_t Hash;
+
+    /// Whether the delete is far in the upper bit, then the index of the word
+    /// in 24 bits, then its length in the lower six bits.
+    uint32_t Key;
+  };
+
+  /// Identifies the index format. Bump the version when the layout changes.
+  static constexpr char Magic[8] = {'S', 'Y', 'M', 'S', 'P', 'L', '0', '3'};
+
+  SuggestionIndex(std::unique_ptr<llvm::MemoryBuffer> Buffer,
+                  const Dictionary& Words)
+  : Buffer(std::move(Buffer)), Words(Words) {}
+
+  /// Wraps the buffer in an index over the dictionary, or returns null if it
+  /// is not a valid one.
+  static std::unique_ptr<SuggestionIndex>
+  create(std::unique_ptr<llvm::MemoryBuffer> Buffer, const Dictionary& Words) {
+    const auto Size = Buffer->getBufferSize();
+    if (Size < sizeof(IndexHeader)) return nullptr;
+
+    const auto* Start = Buffer->getBufferStart();
+    const auto& Header = *reinterpret_cast<const IndexHeader*>(Start);
+    if (std::memcmp(Header.Magic, Magic, sizeof(Magic)) != 0) return nullptr;
+    if (Header.PrefixLength != PrefixLength) return nullptr;
+    if (Header.NumberOfWords != Words.size()) return nullptr;
+
+    const uint64_t Expected = sizeof(IndexHeader) +
+                              sizeof(uint32_t) * (Header.NumberOfBuckets + 1) +
+                              sizeof(Posting) * Header.NumberOfPostings;
+    if (Size != Expected) return nullptr;
+
+    std::unique_ptr<SuggestionIndex> Index(
+        new SuggestionIndex(std::move(Buffer), Words));
+
+    const auto* Data = Start + sizeof(IndexHeader);
+    Index->BucketStarts = reinterpret_cast<const uint32_t*>(Data);
+    Data += sizeof(uint32_t) * (Header.NumberOfBuckets + 1);
+    Index->Postings = reinterpret_cast<const Posting*>(Data);
+
+    return Index;
+  }
+
+  /// Serializes a new index over the words of the dictionary.
+  ///
+  /// Word indices are stored in 24 bits, which is plenty for any dictionary.
+  static std::string build(const Dictionary& Words) {
+    std::vector<Posting> Postings;
+    Postings.reserve(Words.size() * 16);
+
+    llvm::SmallVector<uint32_t, 32> Hashes;
+    for (uint32_t Word = 0; Word < Words.size(); ++Word) {
+      const auto Text = Words.getWord(Word);
+      if (Text.size() > Posting::MaximumLength) continue;
+
+      for (unsigned Deletes = 0; Deletes <= MaximumDistance; ++Deletes) {
+        Hashes.clear();
+        collectDeleteHashes(Text, Deletes, Hashes);
+        const bool Far = Deletes == MaximumDistance;
+        for (const auto DeleteHash : Hashes) {
+          Postings.emplace_back(DeleteHash, Text.size(), Far, Word);
+        }
+      }
+    }
+
+    IndexHeader Header;
+    std::memcpy(Header.Magic, Magic, sizeof(Magic));
+    Header.DictionaryHash = Words.getKey();
+    Header.PrefixLength = PrefixLength;
+    Header.NumberOfWords = Words.size();
+    Header.NumberOfBuckets = llvm::NextPowerOf2(Postings.size() / 4);
+
+    const uint32_t Mask = Header.NumberOfBuckets - 1;
+    std::sort(Postings.begin(), Postings.end(), [Mask](auto& A, auto& B) {
+      return std::make_tuple(A.Hash & Mask, A.Hash, A.Key) <
+             std::make_tuple(B.Hash & Mask, B.Hash, B.Key);
+    });
+
+    // Deletes of a word whose hashes collide would list it twice in a run.
+    Postings.erase(std::unique(Postings.begin(),
+                               Postings.end(),
+                               [](auto& A, auto& B) {
+                                 return A.Hash == B.Hash && A.Key == B.Key;
+                               }),
+                   Postings.end());
+    Header.NumberOfPostings = Postings.size();
+
+    std::vector<uint32_t> BucketStarts(Header.NumberOfBuckets + 1, 0);
+    for (const auto& Entry : Postings) {
+      ++BucketStarts[(Entry.Hash & Mask) + 1];
+    }
+    for (size_t Bucket = 1; Bucket < BucketStarts.size(); ++Bucket) {
+      BucketStarts[Bucket] += BucketStarts[Bucket - 1];
+    }
+
+    std::string Blob;
+    llvm::raw_string_ostream Stream(Blob);
+    Stream.write(reinterpret_cast<const char*>(&Header), sizeof(Header));
+    Stream.write(reinterpret_cast<const char*>(BucketStarts.data()),
+                 sizeof(uint32_t) * BucketStarts.size());
+    Stream.write(reinterpret_cast<const char*>(Postings.data()),
+                 sizeof(Posting) * Postings.size());
+
+    return Stream.str();
+  }
+
+  /// Appends the hashes of all strings obtained by deleting exactly `Deletes`
+  /// characters from the word's prefix, without duplicates.
+  static void collectDeleteHashes(llvm::StringRef Word,
+                                  unsigned Deletes,
+                                  llvm::SmallVectorImpl<uint32_t>& Hashes) {
+    static_assert(MaximumDistance == 2, "Deletes are generated for two edits");
+
+    // The hash of a delete continues the hash of the characters before each
+    // deleted one, so the deletes are never copied.
+    const auto Prefix = Word.substr(0, PrefixLength);
+    const auto Size = Prefix.size();
+    const auto narrow = [](uint64_t Hash) {
+      return static_cast<uint32_t>(Hash ^ (Hash >> 32));
+    };
+
+    if (Deletes == 0) {
+      Hashes.push_back(narrow(StableHash(Prefix)));
+      return;
+    }
+
+    const auto Start = Hashes.size();
+    for (size_t First = 0; First < Size; ++First) {
+      const auto Before = StableHash(Prefix.substr(0, First));
+      if (Deletes == 1) {
+        Hashes.push_back(narrow(StableHash(Prefix.substr(First + 1), Before)));
+        continue;
+      }
+
+      for (size_t Second = First + 1; Second < Size; ++Second) {
+        const auto Between =
+            StableHash(Prefix.slice(First + 1, Second), Before);
+        const auto After = StableHash(Prefix.substr(Second + 1), Between);
+        Hashes.push_back(narrow(After));
+      }
+    }
+
+    std::sort(Hashes.begin() + Start, Hashes.end());
+    Hashes.erase(std::unique(Hashes.begin() + Start, Hashes.end()),
+                 Hashes.end());
+  }
+
+  /// The postings of the delete hash that are far or not, in alphabetical
+  /// order of their words.
+  llvm::ArrayRef<Posting> getPostings(uint32_t Hash, bool Far) const {
+    const auto Bucket = Hash & (getHeader().NumberOfBuckets - 1);
+    const auto Run = std::equal_range(Postings + BucketStarts[Bucket],
+                                      Postings + BucketStarts[Bucket + 1],
+                                      Posting(Hash, 0, Far, 0),
+                                      Posting::compareRuns);
+    return {Run.first, Run.second};
+  }
+
+  /// Goes through the words of the runs of postings in alphabetical order, and
+  /// adds those at distance one from the query to the matches until there
+  /// are `Count` of them.
+  ///
+  /// The runs are merged rather than collected and sorted, as the matches are
+  /// usually among their first words. There is at most one run per character
+  /// of the prefix (plus one), so the next word is found by going over all of
+  /// them.
+  void mergeClosest(const WordDistance& FromQuery,
+                    size_t Length,
+                    unsigned Count,
+                    llvm::SmallVectorImpl<llvm::ArrayRef<Posting>>& Runs,
+                    llvm::SmallVectorImpl<uint32_t>& Matches) const {
+    while (Matches.size() < Count) {
+      const Posting* Next = nullptr;
+      for (const auto& Run : Runs) {
+        if (Run.empty()) continue;
+        if (!Next || Run.front().getWord() < Next->getWord()) {
+          Next = &Run.front();
+        }
+      }
+      if (!Next) return;
+
+      // A word may be in several runs, but only once in each.
+      const auto Entry = *Next;
+      for (auto& Run : Runs) {
+        if (!Run.empty() && Run.front().getWord() == Entry.getWord()) {
+          Run = Run.drop_front();
+        }
+      }
+
+      if (Entry.hasLengthWithin(Length, 1) &&
+          FromQuery.to(getWord(Entry.getWord()), 1) == 1) {
+        Matches.push_back(Entry.getWord());
+      }
+    }
+  }
+
+  /// Goes through the words of the postings of the delete hashes in
+  /// alphabetical order, and adds those at `MaximumDistance` from the query to
+  /// the matches until there are `Count` of them.
+  ///
+  /// The deletes of two characters lead to many more runs than those of one,
+  /// and most of their words are usually needed, so the words are collected
+  /// and sorted rather than merged.
+  void sortFarther(const WordDistance& FromQuery,
+                   size_t Length,
+                   unsigned Count,
+                   llvm::ArrayRef<uint32_t> Hashes,
+                   llvm::SmallVectorImpl<uint32_t>& Matches) const {
+    llvm::SmallVector<uint32_t, 64> Candidates;
+    for (const auto Hash : Hashes) {
+      for (const auto Far : {false, true}) {
+        for (const auto& Entry : getPostings(Hash, Far)) {
+          if (Entry.hasLengthWithin(Length, MaximumDistance)) {
+            Candidates.push_back(Entry.getWord());
+          }
+        }
+      }
+    }
+
+    std::sort(Candidates.begin(), Candidates.end());
+    Candidates.erase(std::unique(Candidates.begin(), Candidates.end()),
+                     Candidates.end());
+
+    // Words within distance one were all found already.
+    for (const auto Candidate : Candidates) {
+      if (Matches.size() == Count) return;
+      const auto Distance = FromQuery.to(getWord(Candidate), MaximumDistance);
+      if (Distance == MaximumDistance) {
+        Matches.push_back(Candidate);
+      }
+    }
+  }
+
+  /// The header of the index.
+  const IndexHeader& getHeader() const {
+    return *reinterpret_cast<const IndexHeader*>(Buffer->getBufferStart());
+  }
+
+  /// The word with the given index.
+  llvm::StringRef getWord(uint32_t Index) const {
+    return Words.getWord(Index);
+  }
+
+  /// The (usually memory-mapped) index.
+  std::unique_ptr<llvm::MemoryBuffer> Buffer;
+
+  /// The dictionary whose words the index refers to.
+  const Dictionary& Words;
+
+  /// The first posting of each bucket, plus the end of the last bucket.
+  const uint32_t* BucketStarts;
+
+  /// The deletes of all words, sorted by bucket, hash and key.
+  const Posting* Postings;
+};
+
+constexpr char SuggestionIndex::Magic[8];
+constexpr uint32_t SuggestionIndex::Posting::MaximumLength;
+
+
+/// A word inside an identifier, as a range of bytes.
+struct Segment {
+  Segment(unsigned Offset, unsigned Length) : Offset(Offset), Length(Length) {}
+
+  /// The offset of the word from the start of the identifier.
+  unsigned Offset;
+
+  /// The number of characters in the word.
+  unsigned Length;
+};
 
 namespace {
-Dictionary ReadWordsFromFile(const std::string& Filename) {
+/// Splits an identifier into the words it is made of.
+///
+/// Words are separated by underscores and digits (`max_buffer_size`,
+/// `utf8string`), by a lowercase letter followed by an uppercase letter
+/// (`parseHttpHeader`) and at the end of an acronym, where the last capital
+/// letter already starts the next word (`HTTPServer` is `HTTP` and `Server`).
+/// Digits themselves are never checked.
+void SplitIdentifier(llvm::StringRef Identifier,
+                     llvm::SmallVectorImpl<Segment>& Segments) {
+  const size_t Size = Identifier.size();
+  for (size_t Index = 0; Index < Size;) {
+    if (!clang::isLetter(Identifier[Index])) {
+      ++Index;
+      continue;
+    }
+
+    size_t End = Index + 1;
+    if (clang::isUppercase(Identifier[Index])) {
+      while (End < Size && clang::isUppercase(Identifier[End])) ++End;
+      if (End - Index > 1) {
+        // An acronym. If it is followed by a lowercase letter, its last capital
+        // letter belongs to the next word.
+        if (End < Size && clang::isLowercase(Identifier[End])) --End;
+        Segments.emplace_back(Index, End - Index);
+        Index = End;
+        continue;
+      }
+    }
+
+    while (End < Size && clang::isLowercase(Identifier[End])) ++End;
+    Segments.emplace_back(Index, End - Index);
+    Index = End;
+  }
+}
+
+/// Measures the throughput of dictionary lookups on a stream of identifiers.
+///
+/// The stream is a file with one identifier per line, for example dumped from a
+/// real code base, so that the hit rate and word lengths are representative.
+int RunBenchmark(const Dictionary& Words,
+                 const SuggestionIndex* Index,
+                 const std::string& Filename,
+                 unsigned Rounds) {
   std::ifstream Stream(Filename);
   if (!Stream.good()) {
     llvm::errs() << "Error reading from: " << Filename << '\n';
-    return {};
+    return 1;
   }
 
-  // Assume one word per line.
-  Dictionary Words;
-  for (std::string Word; Stream >> Word;) {
-    Words.insert(Word);
+  std::vector<std::string> Identifiers;
+  for (std::string Identifier; Stream >> Identifier;) {
+    Identifiers.emplace_back(std::move(Identifier));
   }
 
-  if (Words.empty()) {
-    llvm::errs() << "Dictionary must not be empty!\n";
-  } else {
-    llvm::errs() << "Read " << Words.size() << " words from " << Filename
-                 << '\n';
+  if (Identifiers.empty()) {
+    llvm::errs() << "Identifier stream must not be empty!\n";
+    return 1;
   }
 
-  return Words;
+  size_t Hits = 0;
+  const auto Start = std::chrono::steady_clock::now();
+  for (unsigned Round = 0; Round < Rounds; ++Round) {
+    for (const auto& Identifier : Identifiers) {
+      Hits += Words.contains(Identifier);
+    }
+  }
+  const auto End = std::chrono::steady_clock::now();
+
+  const std::chrono::duration<double> Seconds = End - Start;
+  const double Lookups = static_cast<double>(Identifiers.size()) * Rounds;
+
+  // clang-format off
+  llvm::outs() << "Performed " << static_cast<size_t>(Lookups)
+               << " lookups in " << Seconds.count() * 1e3 << " ms ("
+               << static_cast<size_t>(Lookups / Seconds.count())
+               << " lookups/s, " << (100.0 * Hits / Lookups) << "% hits)\n";
+  // clang-format on
+
+  if (!Index) return 0;
+
+  // Suggestions are only looked up for the unknown words of an identifier, so
+  // time each of those individually and report the median rather than the
+  // throughput. Each word is timed once per round and its fastest lookup
+  // kept, so that page faults of the first touch and preemption do not count.
+  std::vector<llvm::StringRef> Unknown;
+  llvm::SmallVector<Segment, 8> Segments;
+  for (const auto& Identifier : Identifiers) {
+    Segments.clear();
+    SplitIdentifier(Identifier, Segments);
+    for (const auto& Segment : Segments) {
+      const auto Word =
+          llvm::StringRef(Identifier).substr(Segment.Offset, Segment.Length);
+      if (!Words.contains(Word)) Unknown.push_back(Word);
+    }
+  }
+
+  std::vector<double> Nanoseconds(Unknown.size(),
+                                  std::numeric_limits<double>::infinity());
+  llvm::SmallVector<llvm::StringRef, 8> Suggestions;
+  for (unsigned Round = 0; Round < Rounds; ++Round) {
+    for (size_t Word = 0; Word < Unknown.size(); ++Word) {
+      Suggestions.clear();
+      const auto Before = std::chrono::steady_clock::now();
+      Index->suggest(Unknown[Word], 3, Suggestions);
+      const auto After = std::chrono::steady_clock::now();
+      const std::chrono::duration<double, std::nano> Elapsed = After - Before;
+      Nanoseconds[Word] = std::min(Nanoseconds[Word], Elapsed.count());
+    }
+  }
+
+  if (!Nanoseconds.empty()) {
+    const auto Median = Nanoseconds.begin() + Nanoseconds.size() / 2;
+    std::nth_element(Nanoseconds.begin(), Median, Nanoseconds.end());
+    llvm::outs() << "Looked up suggestions for " << Nanoseconds.size()
+                 << " unknown words (median " << static_cast<size_t>(*Median)
+                 << " ns)\n";
+  }
+
+  return 0;
 }
 }  // namespace
 
+/// A word of an identifier that is not in the dictionary.
+struct Misspelling {
+  explicit Misspelling(const Segment& Word) : Word(Word) {}
+
+  /// Where the word is in the identifier.
+  Segment Word;
+
+  /// The closest dictionary words, closest first. They point into the
+  /// suggestion index, which lives for the whole run.
+  llvm::SmallVector<llvm::StringRef, 3> Suggestions;
+};
+
+/// The words of an identifier that are not in the dictionary. Empty if the
+/// identifier is spelled correctly.
+using Verdict = llvm::SmallVector<Misspelling, 1>;
+
+/// Remembers the verdict for every identifier checked during a run.
+///
+/// The same names (`i`, `size`, `begin`, ...) occur thousands of times across
+/// translation units, so splitting and looking up their words once is enough.
+/// The cache is shared by all worker threads and split into shards, each with
+/// its own lock, so that workers looking up different names rarely contend.
+class VerdictCache {
+ public:
+  /// Constructor.
+  ///
+  /// \param Words The dictionary to compute verdicts with.
+  /// \param Index The index to find suggestions with, or null for none.
+  /// \param SuggestionCount How many suggestions to find per misspelling.
+  VerdictCache(const Dictionary& Words,
+               const SuggestionIndex* Index,
+               unsigned SuggestionCount)
+  : Words(Words), Index(Index), SuggestionCount(SuggestionCount) {}
+
+  /// Returns the verdict for the identifier, computing it on the first call.
+  ///
+  /// The returned reference stays valid for the lifetime of the cache.
+  const Verdict& get(llvm::StringRef Identifier) {
+    auto& Shard = Shards[llvm::hash_value(Identifier) % NumberOfShards];
+
+    {
+      std::lock_guard<std::mutex> Lock(Shard.Mutex);
+      const auto Iterator = Shard.Verdicts.find(Identifier);
+      if (Iterator != Shard.Verdicts.end()) return Iterator->second;
+    }
+
+    // Compute outside the lock. If another thread races us, the first
+    // insertion wins and both verdicts are identical anyway.
+    Verdict Unknown = compute(Identifier);
+
+    std::lock_guard<std::mutex> Lock(Shard.Mutex);
+    return Shard.Verdicts.insert({Identifier, std::move(Unknown)})
+        .first->second;
+  }
+
+ private:
+  /// The number of independently locked parts of the cache.
+  static constexpr size_t NumberOfShards = 64;
+
+  /// One independently locked part of the cache.
+  struct Shard {
+    std::mutex Mutex;
+    llvm::StringMap<Verdict> Verdicts;
+  };
+
+  /// Splits the identifier and checks each of its words.
+  Verdict compute(llvm::StringRef Identifier) const {
+    llvm::SmallVector<Segment, 8> Segments;
+    SplitIdentifier(Identifier, Segments);
+
+    Verdict Unknown;
+    for (const auto& Segment : Segments) {
+      const auto Word = Identifier.substr(Segment.Offset, Segment.Length);
+      if (Words.contains(Word)) continue;
+
+      Unknown.emplace_back(Segment);
+      if (Index && SuggestionCount > 0) {
+        Index->suggest(Word, SuggestionCount, Unknown.back().Suggestions);
+      }
+    }
+
+    return Unknown;
+  }
+
+  /// The dictionary to compute verdicts with.
+  const Dictionary& Words;
+
+  /// The index to find suggestions with, or null.
+  const SuggestionIndex* Index;
+
+  /// How many suggestions to find per misspelling.
+  unsigned SuggestionCount;
+
+  /// The shards of the cache.
+  std::array<Shard, NumberOfShards> Shards;
+};
+
+/// A set of keys that can be claimed exactly once, from any thread.
+class ClaimSet {
+ public:
+  /// Returns true if this is the first call for the key during the run.
+  bool claim(llvm::StringRef Key) {
+    return Keys.insert(Key);
+  }
+
+ private:
+  /// The claimed keys.
+  ToolSupport::ShardedSet<llvm::StringSet<>> Keys;
+};
+
+/// Counts how often each unknown word occurs over a whole run.
+///
+/// Every worker thread counts into its own map, so recording an occurrence
+/// never takes a lock shared with other threads. The maps are merged once all
+/// workers have finished. Words are counted case-insensitively.
+class UnknownWordReport {
+ public:
+  /// How many locations to remember per word.
+  static constexpr size_t MaximumSamples = 3;
+
+  /// What the report knows about one word.
+  struct Entry {
+    /// How often the word occurred.
+    uint64_t Count = 0;
+
+    /// The first few places it occurred at, as `file:line:column`.
+    llvm::SmallVector<std::string, MaximumSamples> Samples;
+
+    /// The suggestions for the word, if any.
+    llvm::SmallVector<llvm::StringRef, 3> Suggestions;
+  };
+
+  /// A word and what we know about it, as handed out by `merge()`.
+  using Row = std::pair<llvm::StringRef, Entry*>;
+
+  /// Counts an occurrence of the word. The sample location is only computed
+  /// while the calling thread still needs samples for the word.
+  void record(llvm::StringRef Word,
+              llvm::ArrayRef<llvm::StringRef> Suggestions,
+              llvm::function_ref<std::string()> Location) {
+    Dictionary::FoldBuffer Folded;
+    auto& Counted = Tallies.getLocal()[Dictionary::fold(Word, Folded)];
+    if (Counted.Count++ == 0) {
+      Counted.Suggestions.assign(Suggestions.begin(), Suggestions.end());
+    }
+    if (Counted.Samples.size() < MaximumSamples) {
+      Counted.Samples.push_back(Location());
+    }
+  }
+
+  /// Merges the counts of all threads and returns the most frequent words,
+  /// most frequent first. Must only be called once no thread is recording
+  /// anymore.
+  ///
+  /// \param Top How many words to return, or zero for all of them.
+  std::vector<Row> merge(size_t Top) {
+    auto& Counts = Tallies.getAll();
+    if (Counts.empty()) return {};
+
+    // Merge into the largest tally so that the fewest entries move.
+    std::sort(Counts.begin(), Counts.end(), [](const auto& A, const auto& B) {
+      return A->size() > B->size();
+    });
+
+    auto& Merged = *Counts.front();
+    for (size_t Index = 1; Index < Counts.size(); ++Index) {
+      for (auto& Counted : *Counts[Index]) {
+        auto& Target = Merged[Counted.getKey()];
+        if (Target.Count == 0) {
+          Target = std::move(Counted.getValue());
+          continue;
+        }
+
+        Target.Count += Counted.getValue().Count;
+        for (auto& Sample : Counted.getValue().Samples) {
+          Target.Samples.push_back(std::move(Sample));
+        }
+      }
+      Counts[Index]->clear();
+    }
+
+    std::vector<Row> Rows;
+    Rows.reserve(Merged.size());
+    for (auto& Counted : Merged) {
+      auto& Samples = Counted.getValue().Samples;
+      std::sort(Samples.begin(), Samples.end());
+      Samples.erase(std::unique(Samples.begin(), Samples.end()),
+                    Samples.end());
+      if (Samples.size() > MaximumSamples) Samples.resize(MaximumSamples);
+      Rows.emplace_back(Counted.getKey(), &Counted.getValue());
+    }
+
+    const auto ByCount = [](const Row& A, const Row& B) {
+      if (A.second->Count != B.second->Count) {
+        return A.second->Count > B.second->Count;
+      }
+      return A.first < B.first;
+    };
+
+    if (Top == 0 || Top >= Rows.size()) {
+      std::sort(Rows.begin(), Rows.end(), ByCount);
+    } else {
+      std::partial_sort(Rows.begin(), Rows.begin() + Top, Rows.end(), ByCount);
+      Rows.resize(Top);
+    }
+
+    return Rows;
+  }
+
+ private:
+  /// The counts of one thread.
+  using Tally = llvm::StringMap<Entry>;
+
+  /// The counts of each thread.
+  ToolSupport::PerThread<Tally> Tallies;
+};
+
+constexpr size_t UnknownWordReport::MaximumSamples;
+
+/// Which declarations to check.
+enum class Scope {
+  /// Only declarations in the main file of each translation unit.
+  Main,
+
+  /// Declarations in the main file and in headers below the project prefix.
+  Project,
+
+  /// Declarations anywhere, including system headers.
+  All,
+};
+
+/// Everything the translation units of a run share.
+struct RunContext {
+  RunContext(VerdictCache& Cache,
+             Scope DeclarationScope,
+             const std::string& ProjectPrefix,
+             bool IncludeFunctions,
+             bool IncludeRecords,
+             UnknownWordReport* Report)
+  : Cache(Cache)
+  , Report(Report)
+  , DeclarationScope(DeclarationScope)
+  , ProjectPrefix(ProjectPrefix)
+  , IncludeFunctions(IncludeFunctions)
+  , IncludeRecords(IncludeRecords) {}
+
+  /// The verdicts computed so far.
+  VerdictCache& Cache;
+
+  /// The report to count unknown words in instead of warning about each
+  /// occurrence, or null.
+  UnknownWordReport* Report;
+
+  /// The headers that some translation unit has already checked.
+  ClaimSet Headers;
+
+  /// The locations that have already been warned about.
+  ClaimSet Warnings;
+
+  /// Which declarations to check.
+  Scope DeclarationScope;
+
+  /// The absolute path below which headers belong to the project.
+  std::string ProjectPrefix;
+
+  /// Whether to check function names.
+  bool IncludeFunctions;
+
+  /// Whether to check class, struct and union names.
+  bool IncludeRecords;
+};
+
+namespace {
+/// Returns the absolute name of the file with the given ID, or an empty string
+/// for buffers that are not files (like the predefines).
+std::string GetAbsoluteFilename(const clang::SourceManager& SourceManager,
+                                clang::FileID FileID) {
+  const auto* Entry = SourceManager.getFileEntryForID(FileID);
+  if (!Entry) return {};
+
+  llvm::SmallString<256> Filename(Entry->getName());
+  llvm::sys::fs::make_absolute(Filename);
+  llvm::sys::path::remove_dots(Filename, /*remove_dot_dot=*/true);
+
+  return Filename.str();
+}
+
+/// Whether the path is the directory or lies below it. Whole components are
+/// compared, so that `/project` does not contain `/project2/file.h`.
+bool IsWithinDirectory(llvm::StringRef Path, llvm::StringRef Directory) {
+  if (!Path.startswith(Directory)) return false;
+  if (Path.size() == Directory.size()) return true;
+  if (!Directory.empty() && llvm::sys::path::is_separator(Directory.back())) {
+    return true;
+  }
+  return llvm::sys::path::is_separator(Path[Directory.size()]);
+}
+}  // namespace
+
+/// Decides, per translation unit, which declarations are in scope.
+///
+/// The main file is always in scope. A header is in scope only if the scope
+/// covers it and this translation unit is the first in the run to claim it, so
+/// that every header is checked exactly once no matter how many translation
+/// units include it. The verdict for each file is memoized by `FileID`.
+class ScopeFilter {
+ public:
+  explicit ScopeFilter(RunContext& Context) : Context(Context) {}
+
+  /// Whether the declaration should be checked.
+  bool contains(const clang::Decl& Decl,
+                const clang::SourceManager& SourceManager) {
+    const auto Location = SourceManager.getExpansionLoc(Decl.getLocation());
+    if (Location.isInvalid()) return false;
+
+    const auto FileID = SourceManager.getFileID(Location);
+    const auto Iterator = Files.find(FileID);
+    if (Iterator != Files.end()) return Iterator->second;
+
+    const bool InScope = computeFileVerdict(FileID, Location, SourceManager);
+    Files.insert({FileID, InScope});
+
+    return InScope;
+  }
+
+ private:
+  /// Decides whether declarations in the given file are in scope.
+  bool computeFileVerdict(clang::FileID FileID,
+                          clang::SourceLocation Location,
+                          const clang::SourceManager& SourceManager) {
+    if (FileID == SourceManager.getMainFileID()) return true;
+    if (Context.DeclarationScope == Scope::Main) return false;
+
+    const auto Filename = GetAbsoluteFilename(SourceManager, FileID);
+    if (Filename.empty()) return false;
+
+    if (Context.DeclarationScope == Scope::Project) {
+      if (SourceManager.isInSystemHeader(Location)) return false;
+      if (!IsWithinDirectory(Filename, Context.ProjectPrefix)) return false;
+    }
+
+    return Context.Headers.claim(Filename);
+  }
+
+  /// The state shared with the rest of the run.
+  RunContext& Context;
+
+  /// The verdict for each file seen in this translation unit.
+  llvm::DenseMap<clang::FileID, bool> Files;
+};
+
+namespace {
+/// Spells a (lowercase) suggestion with the case of the word it replaces:
+/// `Colour` becomes `Color` and `HTPP` becomes `HTTP`.
+std::string MatchCase(llvm::StringRef Suggestion, llvm::StringRef Original) {
+  std::string Result = Suggestion.str();
+  if (Original.empty() || !clang::isUppercase(Original.front())) return Result;
+
+  const bool Acronym = Original.size() > 1 && clang::isUppercase(Original[1]);
+  for (size_t Index = 0; Index < Result.size(); ++Index) {
+    if (Index == 0 || Acronym) {
+      Result[Index] = clang::toUppercase(Result[Index]);
+    }
+  }
+
+  return Result;
+}
+
+/// Joins suggestions into a list like `'a', 'b' or 'c'`.
+std::string JoinSuggestions(llvm::ArrayRef<llvm::StringRef> Suggestions) {
+  std::string Joined;
+  for (size_t Index = 0; Index < Suggestions.size(); ++Index) {
+    if (Index > 0) {
+      Joined += (Index + 1 == Suggestions.size()) ? " or " : ", ";
+    }
+    Joined += '\'';
+    Joined += Suggestions[Index].str();
+    Joined += '\'';
+  }
+  return Joined;
+}
+
+/// Prints the rows of a report as an aligned table.
+void PrintTextReport(llvm::raw_ostream& Stream,
+                     llvm::ArrayRef<UnknownWordReport::Row> Rows) {
+  for (const auto& Row : Rows) {
+    Stream << llvm::format("%10llu  ",
+                           static_cast<unsigned long long>(Row.second->Count))
+           << Row.first;
+    if (!Row.second->Suggestions.empty()) {
+      Stream << " (did you mean " << JoinSuggestions(Row.second->Suggestions)
+             << "?)";
+    }
+    Stream << '\n';
+    for (const auto& Sample : Row.second->Samples) {
+      Stream << "            " << Sample << '\n';
+    }
+  }
+}
+
+/// Prints the rows of a report as a JSON array.
+void PrintJsonReport(llvm::raw_ostream& Stream,
+                     llvm::ArrayRef<UnknownWordReport::Row> Rows) {
+  Stream << "[\n";
+  for (size_t Index = 0; Index < Rows.size(); ++Index) {
+    const auto& Row = Rows[Index];
+    Stream << "  {\"word\": ";
+    WriteJSONString(Stream, Row.first);
+    Stream << ", \"count\": " << Row.second->Count << ", \"suggestions\": [";
+    for (size_t Other = 0; Other < Row.second->Suggestions.size(); ++Other) {
+      if (Other > 0) Stream << ", ";
+      WriteJSONString(Stream, Row.second->Suggestions[Other]);
+    }
+    Stream << "], \"samples\": [";
+    for (size_t Other = 0; Other < Row.second->Samples.size(); ++Other) {
+      if (Other > 0) Stream << ", ";
+      WriteJSONString(Stream, Row.second->Samples[Other]);
+    }
+    Stream << "]}" << (Index + 1 < Rows.size() ? "," : "") << '\n';
+  }
+  Stream << "]\n";
+}
+}  // namespace
+
+/// Matches declarations that the `ScopeFilter` considers in scope.
+AST_MATCHER_P(clang::Decl, isInScope, ScopeFilter*, Filter) {
+  return Filter->contains(Node, Finder->getASTContext().getSourceManager());
+}
+
 class Checker : public clang::ast_matchers::MatchFinder::MatchCallback {
  public:
   using MatchResult = clang::ast_matchers::MatchFinder::MatchResult;
 
-  explicit Checker(const Dictionary&& Words) : Words(std::move(Words)) {
+  explicit Checker(RunContext& Context) : Context(Context) {
   }
 
   void run(const MatchResult& Result) {
     const auto* Target = Result.Nodes.getNodeAs<clang::NamedDecl>("target");
 
-    auto& Diagnostics = Result.Context->getDiagnostics();
-    const auto Name = Target->getName();
+    // Operators, constructors and the like have no identifier to check.
+    if (!Target->getIdentifier()) return;
 
-    if (Words.count(Name.lower())) return;
+    const auto Name = Target->getName();
+    const auto& Unknown = Context.Cache.get(Name);
+    if (Unknown.empty()) return;
 
+    auto& Diagnostics = Result.Context->getDiagnostics();
     const auto ID =
         Diagnostics.getCustomDiagID(clang::DiagnosticsEngine::Warning,
                                     "The word '%0' is not in the dictionary");
+    const auto SuggestionID = Diagnostics.getCustomDiagID(
+        clang::DiagnosticsEngine::Warning,
+        "The word '%0' is not in the dictionary; did you mean %1?");
+
+    for (const auto& Misspelling : Unknown) {
+      const auto& Segment = Misspelling.Word;
+      const auto Start = Target->getLocation().getLocWithOffset(Segment.Offset);
+      if (!isFirstWarning(Start, *Result.SourceManager)) continue;
+
+      const auto Word = Name.substr(Segment.Offset, Segment.Length);
+      if (Context.Report) {
+        Context.Report->record(Word, Misspelling.Suggestions, [&] {
+          return Start.printToString(*Result.SourceManager);
+        });
+        continue;
+      }
 
-    auto Builder = Diagnostics.Report(Target->getLocation(), ID);
-    Builder.AddString(Name);
+      const auto End = Start.getLocWithOffset(Segment.Length);
+      const auto Range = clang::CharSourceRange::getCharRange({Start, End});
 
-    const auto Start = Target->getLocation();
-    const auto End = Start.getLocWithOffset(Name.size());
-    const auto Range = clang::CharSourceRange::getCharRange({Start, End});
-    Builder.AddSourceRange(Range);
+      if (Misspelling.Suggestions.empty()) {
+        auto Builder = Diagnostics.Report(Start, ID);
+        Builder.AddString(Word);
+        Builder.AddSourceRange(Range);
+        continue;
+      }
+
+      auto Builder = Diagnostics.Report(Start, SuggestionID);
+      Builder.AddString(Word);
+      Builder.AddString(JoinSuggestions(Misspelling.Suggestions));
+      Builder.AddSourceRange(Range);
+
+      const auto Replacement = MatchCase(Misspelling.Suggestions.front(), Word);
+      Builder.AddFixItHint(
+          clang::FixItHint::CreateReplacement(Range, Replacement));
+    }
   }
 
  private:
-  Dictionary Words;
+  /// Whether no translation unit has warned about this location yet, such as
+  /// when a file appears more than once in the compilation database.
+  bool isFirstWarning(clang::SourceLocation Location,
+                      const clang::SourceManager& SourceManager) {
+    const auto Decomposed = SourceManager.getDecomposedExpansionLoc(Location);
+    const auto Filename = GetAbsoluteFilename(SourceManager, Decomposed.first);
+    return Context.Warnings.claim(
+        (llvm::Twine(Filename) + ":" + llvm::Twine(Decomposed.second)).str());
+  }
+
+  RunContext& Context;
 };
 
 class Consumer : public clang::ASTConsumer {
  public:
-  Consumer(const Dictionary&& Words, bool IncludeFunctions, bool IncludeRecords)
-  : Checker(std::move(Words)) {
+  explicit Consumer(RunContext& Context) : Filter(Context), Checker(Context) {
     using namespace clang::ast_matchers;
 
+    // The matchers run on each top-level declaration in scope, so they look
+    // for the target there and anywhere below it.
+    const auto inTree = [](const DeclarationMatcher& Target) {
+      return decl(eachOf(Target, forEachDescendant(Target)));
+    };
+
     const auto VariableMatcher =
-        declaratorDecl(unless(functionDecl())).bind("target");
-    MatchFinder.addMatcher(VariableMatcher, &Checker);
+        declaratorDecl(isInScope(&Filter), unless(functionDecl()))
+            .bind("target");
+    MatchFinder.addMatcher(inTree(VariableMatcher), &Checker);
 
-    if (IncludeFunctions) {
-      const auto FunctionMatcher = functionDecl().bind("target");
-      MatchFinder.addMatcher(FunctionMatcher, &Checker);
+    if (Context.IncludeFunctions) {
+      const auto FunctionMatcher =
+          functionDecl(isInScope(&Filter)).bind("target");
+      MatchFinder.addMatcher(inTree(FunctionMatcher), &Checker);
     }
 
-    if (IncludeRecords) {
+    if (Context.IncludeRecords) {
       // Avoid implicit class name.
       const auto RecordMatcher =
-          recordDecl(unless(isImplicit())).bind("target");
-      MatchFinder.addMatcher(RecordMatcher, &Checker);
+          recordDecl(isInScope(&Filter), unless(isImplicit())).bind("target");
+      MatchFinder.addMatcher(inTree(RecordMatcher), &Checker);
     }
   }
 
   void HandleTranslationUnit(clang::ASTContext& Context) override {
-    MatchFinder.matchAST(Context);
+    // Matching the whole AST would traverse every declaration of the standard
+    // library only to have the filter reject it. Instead, only descend into
+    // the top-level declarations of files in scope.
+    const auto& SourceManager = Context.getSourceManager();
+    for (const auto* Decl : Context.getTranslationUnitDecl()->decls()) {
+      if (Filter.contains(*Decl, SourceManager)) {
+        MatchFinder.match(*Decl, Context);
+      }
+    }
   }
 
  private:
   clang::ast_matchers::MatchFinder MatchFinder;
+  ScopeFilter Filter;
   Checker Checker;
 };
 
@@ -118,28 +1483,442 @@ class Action : public clang::ASTFrontendAction {
  public:
   using ASTConsumerPointer = std::unique_ptr<clang::ASTConsumer>;
 
-  Action(const std::string& DictionaryFile,
-         bool IncludeFunctions,
-         bool IncludeRecords)
-  : DictionaryFile(DictionaryFile)
-  , IncludeFunctions(IncludeFunctions)
-  , IncludeRecords(IncludeRecords) {
+  explicit Action(RunContext& Context) : Context(Context) {
   }
 
   ASTConsumerPointer CreateASTConsumer(clang::CompilerInstance& Compiler,
                                        llvm::StringRef Filename) {
-    const auto Words = ReadWordsFromFile(DictionaryFile);
-    if (Words.empty()) return nullptr;
-    return std::make_unique<Consumer>(std::move(Words),
-                                      IncludeFunctions,
-                                      IncludeRecords);
+    return std::make_unique<Consumer>(Context);
   }
 
  private:
-  std::string DictionaryFile;
-  bool IncludeFunctions;
-  bool IncludeRecords;
+  RunContext& Context;
 };
+
+namespace {
+/// Describes a misspelling the way the `Checker` diagnostic does.
+std::string DescribeMisspelling(llvm::StringRef Word,
+                                llvm::ArrayRef<llvm::StringRef> Suggestions) {
+  std::string Description =
+      ("The word '" + Word + "' is not in the dictionary").str();
+  if (!Suggestions.empty()) {
+    Description += "; did you mean " + JoinSuggestions(Suggestions) + "?";
+  }
+  return Description;
+}
+}  // namespace
+
+/// Checks the names declared in a file by raw-lexing it, without running the
+/// preprocessor or parsing anything.
+///
+/// Only the main file is looked at and declarations are recognized by a simple
+/// heuristic: an identifier declares something if the tokens before it, back
+/// to where a statement or an argument starts, look like a type, such as
+/// `int`, `Foo`, `const std::vector<int>&` or `unsigned long`. Followed by
+/// `=`, `;`, `,`, `)`, `[`, `{` or `:` it declares a variable, followed by `(`
+/// a function. A type ending in `*`, `&` or `>` is only trusted within a
+/// parenthesized list if it also contains a builtin type, a `::` or two names
+/// in a row, since `(a && b)` and `(a < b && c > d)` are expressions. An
+/// identifier after `class`, `struct`, `union` or `enum` that is followed by
+/// `{`, `:` or `;` declares a record. This misses declarations hidden behind
+/// macros and occasionally mistakes an expression for a declaration, but it is
+/// orders of magnitude faster than building an AST.
+class LexerChecker {
+ public:
+  explicit LexerChecker(RunContext& Context) : Context(Context) {
+    LanguageOptions.CPlusPlus = true;
+    LanguageOptions.CPlusPlus11 = true;
+    LanguageOptions.CPlusPlus14 = true;
+    LanguageOptions.Bool = true;
+  }
+
+  /// Checks the file, printing a warning for each misspelled word.
+  ///
+  /// \returns False if the file could not be read.
+  bool check(const std::string& Filename) {
+    auto Buffer = llvm::MemoryBuffer::getFile(Filename);
+    if (!Buffer) {
+      llvm::errs() << "Error reading from: " << Filename << '\n';
+      return false;
+    }
+
+    // Warnings are keyed by absolute path, like those of the `Checker`.
+    llvm::SmallString<256> Absolute(Filename);
+    llvm::sys::fs::make_absolute(Absolute);
+    llvm::sys::path::remove_dots(Absolute, /*remove_dot_dot=*/true);
+
+    const auto Source = (*Buffer)->getBuffer();
+    clang::Lexer Lexer(clang::SourceLocation(),
+                       LanguageOptions,
+                       Source.begin(),
+                       Source.begin(),
+                       Source.end());
+
+    // Keywords are only distinguished from other identifiers by looking them
+    // up, since the raw lexer does not know about them.
+    clang::IdentifierTable Identifiers(LanguageOptions);
+
+    std::string Warnings;
+    llvm::raw_string_ostream Stream(Warnings);
+    LineCounter Lines(Source);
+
+    // The type before the candidate is only known to be complete once the
+    // token after the candidate shows that it is declared.
+    TypeChain Current;
+    TypeChain BeforeCandidate;
+    llvm::StringRef Candidate;
+    bool InDirective = false;
+
+    clang::Token Token;
+    do {
+      Lexer.LexFromRawLexer(Token);
+
+      if (Token.isAtStartOfLine()) InDirective = Token.is(clang::tok::hash);
+      if (InDirective) {
+        Candidate = {};
+        Current.restart(/*Statement=*/true);
+        continue;
+      }
+
+      if (Token.is(clang::tok::raw_identifier)) {
+        const auto Name = Token.getRawIdentifier();
+        const auto Keyword = Identifiers.get(Name).getTokenID();
+        Candidate = {};
+        if (Keyword != clang::tok::identifier) {
+          Current.addKeyword(Keyword);
+          continue;
+        }
+
+        if (Current.precedesDeclarator()) {
+          Candidate = Name;
+          BeforeCandidate = Current;
+        }
+        Current.addName();
+        continue;
+      }
+
+      if (!Candidate.empty() &&
+          isDeclaration(BeforeCandidate, Token.getKind())) {
+        checkName(Absolute, Source, Candidate, Lines, Stream);
+      }
+
+      Candidate = {};
+      Current.addPunctuation(Token.getKind());
+    } while (Token.isNot(clang::tok::eof));
+
+    Stream.flush();
+    if (!Warnings.empty()) {
+      std::lock_guard<std::mutex> Lock(OutputMutex);
+      llvm::errs() << Warnings;
+    }
+
+    return true;
+  }
+
+ private:
+  /// Translates offsets into line and column numbers. Offsets must be queried
+  /// in increasing order, so that the file is scanned only once.
+  class LineCounter {
+   public:
+    explicit LineCounter(llvm::StringRef Source) : Source(Source) {}
+
+    /// The (one-based) line and column of the offset.
+    std::pair<unsigned, unsigned> locate(size_t Offset) {
+      for (; Position < Offset; ++Position) {
+        if (Source[Position] == '\n') {
+          ++Line;
+          LineStart = Position + 1;
+        }
+      }
+      return {Line, Offset - LineStart + 1};
+    }
+
+   private:
+    llvm::StringRef Source;
+    size_t Position = 0;
+    size_t LineStart = 0;
+    unsigned Line = 1;
+  };
+
+  /// Follows the tokens since the last place a declaration can start (the
+  /// start of a statement or of an argument) while they could be the type of
+  /// one, like `const std::map<int, Foo*>&`.
+  class TypeChain {
+   public:
+    /// Starts over after a token that a declaration can follow.
+    ///
+    /// \param Statement Whether a statement starts, as after `;` or `{`,
+    /// rather than an argument or parameter, as after `(` or `,`.
+    void restart(bool Statement) {
+      *this = TypeChain();
+      AtStatement = Statement;
+    }
+
+    /// Whether a name that comes next is declared by the type so far, rather
+    /// than being part of it or of an expression.
+    bool precedesDeclarator() const {
+      return TypeLike && Depth == 0 && !Scoped && (Names > 0 || Record);
+    }
+
+    /// Whether the type is a record keyword, as in `struct Foo`.
+    bool isRecord() const noexcept {
+      return Record;
+    }
+
+    /// Whether a name declared by the type may be an operand instead, as `b`
+    /// in `(a * b)` or `(a < b && c > d)`.
+    bool isAmbiguous() const noexcept {
+      return (Indirect || Angled) && !Certain && !AtStatement;
+    }
+
+    /// Adds a name that is not a keyword.
+    void addName() {
+      if (!TypeLike || Depth > 0) return;
+
+      // Two names in a row can only be a type and what it declares.
+      if (Names > 0 && !Indirect && !Scoped) Certain = true;
+      if (Record) Certain = true;
+
+      ++Names;
+      Indirect = Angled = Scoped = Record = false;
+    }
+
+    /// Adds a keyword.
+    void addKeyword(clang::tok::TokenKind Keyword) {
+      if (Depth > 0) return;
+
+      switch (Keyword) {
+        case clang::tok::kw_auto:
+        case clang::tok::kw_bool:
+        case clang::tok::kw_char:
+        case clang::tok::kw_char16_t:
+        case clang::tok::kw_char32_t:
+        case clang::tok::kw_const:
+        case clang::tok::kw_double:
+        case clang::tok::kw_float:
+        case clang::tok::kw_int:
+        case clang::tok::kw_long:
+        case clang::tok::kw_short:
+        case clang::tok::kw_signed:
+        case clang::tok::kw_unsigned:
+        case clang::tok::kw_void:
+        case clang::tok::kw_volatile:
+        case clang::tok::kw_wchar_t:
+          if (TypeLike) {
+            ++Names;
+            Certain = true;
+            Indirect = Angled = Scoped = false;
+          }
+          return;
+        case clang::tok::kw_class:
+        case clang::tok::kw_enum:
+        case clang::tok::kw_struct:
+        case clang::tok::kw_union:
+          restart(/*Statement=*/true);
+          Record = true;
+          return;
+        case clang::tok::kw_constexpr:
+        case clang::tok::kw_explicit:
+        case clang::tok::kw_extern:
+        case clang::tok::kw_friend:
+        case clang::tok::kw_inline:
+        case clang::tok::kw_mutable:
+        case clang::tok::kw_register:
+        case clang::tok::kw_static:
+        case clang::tok::kw_template:
+        case clang::tok::kw_thread_local:
+        case clang::tok::kw_typedef:
+        case clang::tok::kw_typename:
+        case clang::tok::kw_virtual: restart(/*Statement=*/true); return;
+        default: TypeLike = false; return;
+      }
+    }
+
+    /// Adds a punctuation token.
+    void addPunctuation(clang::tok::TokenKind Punctuation) {
+      if (Depth > 0) {
+        skipArgument(Punctuation);
+        return;
+      }
+
+      switch (Punctuation) {
+        case clang::tok::semi:
+        case clang::tok::l_brace:
+        case clang::tok::r_brace:
+        case clang::tok::colon: restart(/*Statement=*/true); return;
+        case clang::tok::l_paren:
+        case clang::tok::comma: restart(/*Statement=*/false); return;
+        case clang::tok::coloncolon:
+          if (TypeLike && !Indirect) {
+            Scoped = true;
+            Certain = true;
+          } else {
+            TypeLike = false;
+          }
+          return;
+        case clang::tok::star:
+        case clang::tok::amp:
+        case clang::tok::ampamp:
+          if (TypeLike && Names > 0 && !Scoped) {
+            Indirect = true;
+          } else {
+            TypeLike = false;
+          }
+          return;
+        case clang::tok::less:
+          if (TypeLike && Names > 0 && !Indirect && !Scoped) {
+            Depth = 1;
+            Parentheses = 0;
+          } else if (TypeLike && Names == 0) {
+            // Template parameters, as in `template <typename T>`.
+            restart(/*Statement=*/false);
+          } else {
+            TypeLike = false;
+          }
+          return;
+        default: TypeLike = false; return;
+      }
+    }
+
+   private:
+    /// Skips a token of template arguments, giving up on the type where they
+    /// turn out to be a comparison, as in `if (a < b)`.
+    void skipArgument(clang::tok::TokenKind Punctuation) {
+      switch (Punctuation) {
+        case clang::tok::less: ++Depth; return;
+        case clang::tok::greater:
+          if (--Depth == 0) Angled = true;
+          return;
+        case clang::tok::greatergreater:
+          if (Depth >= 2) {
+            Depth -= 2;
+            if (Depth == 0) Angled = true;
+          } else {
+            Depth = 0;
+            TypeLike = false;
+          }
+          return;
+        case clang::tok::l_paren: ++Parentheses; return;
+        case clang::tok::r_paren:
+          if (Parentheses > 0) {
+            --Parentheses;
+          } else {
+            Depth = 0;
+            TypeLike = false;
+          }
+          return;
+        case clang::tok::semi:
+        case clang::tok::l_brace:
+        case clang::tok::r_brace: restart(/*Statement=*/true); return;
+        default: return;
+      }
+    }
+
+    /// Whether the tokens so far can be (the start of) a type.
+    bool TypeLike = true;
+
+    /// Whether the chain starts a statement rather than an argument.
+    bool AtStatement = true;
+
+    /// Whether the chain is certainly a type: it has a builtin type, a `::`
+    /// or two names in a row.
+    bool Certain = false;
+
+    /// Whether the last token was `*`, `&` or `&&`.
+    bool Indirect = false;
+
+    /// Whether the last token closed template arguments.
+    bool Angled = false;
+
+    /// Whether the last token was `::`, so that a name continues the type.
+    bool Scoped = false;
+
+    /// Whether the last token was `class`, `struct`, `union` or `enum`.
+    bool Record = false;
+
+    /// The number of names and builtin types in the chain.
+    unsigned Names = 0;
+
+    /// How deep in template arguments the chain is.
+    unsigned Depth = 0;
+
+    /// How deep in parentheses the template arguments are.
+    unsigned Parentheses = 0;
+  };
+
+  /// Whether an identifier preceded by the type and followed by `After`
+  /// declares something we should check.
+  bool isDeclaration(const TypeChain& Before,
+                     clang::tok::TokenKind After) const {
+    if (Before.isRecord()) {
+      switch (After) {
+        case clang::tok::l_brace:
+        case clang::tok::colon:
+        case clang::tok::semi: return Context.IncludeRecords;
+        default: return false;
+      }
+    }
+
+    if (Before.isAmbiguous()) return false;
+
+    switch (After) {
+      case clang::tok::l_paren: return Context.IncludeFunctions;
+      case clang::tok::l_brace:
+      case clang::tok::colon:
+      case clang::tok::semi:
+      case clang::tok::equal:
+      case clang::tok::comma:
+      case clang::tok::r_paren:
+      case clang::tok::l_square: return true;
+      default: return false;
+    }
+  }
+
+  /// Checks a declared name, appending a warning for each misspelled word.
+  void checkName(llvm::StringRef Filename,
+                 llvm::StringRef Source,
+                 llvm::StringRef Name,
+                 LineCounter& Lines,
+                 llvm::raw_ostream& Stream) {
+    const auto& Unknown = Context.Cache.get(Name);
+    if (Unknown.empty()) return;
+
+    const size_t Offset = Name.data() - Source.data();
+    for (const auto& Misspelling : Unknown) {
+      const auto WordOffset = Offset + Misspelling.Word.Offset;
+      const auto Key = (Filename + ":" + llvm::Twine(WordOffset)).str();
+      if (!Context.Warnings.claim(Key)) continue;
+
+      const auto Word =
+          Name.substr(Misspelling.Word.Offset, Misspelling.Word.Length);
+      if (Context.Report) {
+        Context.Report->record(Word, Misspelling.Suggestions, [&] {
+          const auto Location = Lines.locate(WordOffset);
+          return (Filename + ":" + llvm::Twine(Location.first) + ":" +
+                  llvm::Twine(Location.second))
+              .str();
+        });
+        continue;
+      }
+
+      const auto Location = Lines.locate(WordOffset);
+      Stream << Filename << ':' << Location.first << ':' << Location.second
+             << ": warning: "
+             << DescribeMisspelling(Word, Misspelling.Suggestions) << '\n';
+    }
+  }
+
+  /// Serializes the output of all worker threads.
+  static std::mutex OutputMutex;
+
+  /// The state shared with the rest of the run.
+  RunContext& Context;
+
+  /// The language to lex.
+  clang::LangOptions LanguageOptions;
+};
+
+std::mutex LexerChecker::OutputMutex;
 }  // namespace DictionaryCheck
 
 namespace {
@@ -148,19 +1927,31 @@ llvm::cl::OptionCategory DictionaryCheckCategory("DictionaryCheck Options");
 llvm::cl::extrahelp DictionaryCheckCategoryHelp(R"(
   This tool verifies that you use readable names for your variables, functions,
   classes and other entities by performing a case-insensitive dictionary check
-  on each name.
+  on each word of each name. Names are split into words at underscores, digits
+  and case changes, so `parseHttpHeader` and `max_buffer_size` are checked as
+  `parse`, `Http`, `Header` and `max`, `buffer`, `size`.
   )");
 
-llvm::cl::opt<std::string>
-    DictionaryOption("dict",
-                     llvm::cl::Required,
-                     llvm::cl::desc("The dictionary file to load"),
-                     llvm::cl::cat(DictionaryCheckCategory));
+llvm::cl::list<std::string> DictionaryOption(
+    "dict",
+    llvm::cl::OneOrMore,
+    llvm::cl::desc("A dictionary file to load (one word per line). Can be "
+                   "given several times, e.g. for a base language, a project "
+                   "allowlist and abbreviations, whose words are merged"),
+    llvm::cl::cat(DictionaryCheckCategory));
 llvm::cl::alias
     DictionaryShortOption("d",
                           llvm::cl::desc("Alias for the --dict option"),
                           llvm::cl::aliasopt(DictionaryOption));
 
+llvm::cl::opt<std::string> DictionaryCacheOption(
+    "dict-cache",
+    llvm::cl::desc("The directory in which to cache compiled dictionaries "
+                   "and suggestion indices (default: dict-check in "
+                   "$XDG_CACHE_HOME or ~/.cache)"),
+    llvm::cl::value_desc("directory"),
+    llvm::cl::cat(DictionaryCheckCategory));
+
 llvm::cl::opt<bool>
     FunctionsOption("functions",
                     llvm::cl::desc("Include function names in the check"),
@@ -179,23 +1970,200 @@ llvm::cl::alias
                        llvm::cl::desc("Alias for the --records option"),
                        llvm::cl::aliasopt(RecordsOption));
 
+llvm::cl::opt<unsigned> SuggestionsOption(
+    "suggestions",
+    llvm::cl::init(3),
+    llvm::cl::desc("How many spelling suggestions to offer for each unknown "
+                   "word (0 = none)"),
+    llvm::cl::cat(DictionaryCheckCategory));
+
+llvm::cl::opt<DictionaryCheck::Scope> ScopeOption(
+    "scope",
+    llvm::cl::init(DictionaryCheck::Scope::Main),
+    llvm::cl::desc("Which declarations to check"),
+    llvm::cl::values(
+        clEnumValN(DictionaryCheck::Scope::Main,
+                   "main",
+                   "Only the main file of each translation unit (default)"),
+        clEnumValN(DictionaryCheck::Scope::Project,
+                   "project",
+                   "The main file and headers below --project-prefix"),
+        clEnumValN(DictionaryCheck::Scope::All,
+                   "all",
+                   "Everything, including system headers")),
+    llvm::cl::cat(DictionaryCheckCategory));
+
+llvm::cl::opt<std::string> ProjectPrefixOption(
+    "project-prefix",
+    llvm::cl::desc("The directory containing the project's headers, for "
+                   "--scope=project (default: the working directory)"),
+    llvm::cl::value_desc("path"),
+    llvm::cl::cat(DictionaryCheckCategory));
+
+llvm::cl::opt<bool> LexerOnlyOption(
+    "lexer-only",
+    llvm::cl::desc("Find declarations by raw-lexing only the main files, "
+                   "without preprocessing or parsing them. Much faster, but "
+                   "approximate, and --scope is ignored"),
+    llvm::cl::cat(DictionaryCheckCategory));
+
+llvm::cl::opt<unsigned>
+    JobsOption("jobs",
+               llvm::cl::init(0),
+               llvm::cl::desc("The number of files to check in parallel "
+                              "(0 = one per hardware thread)"),
+               llvm::cl::cat(DictionaryCheckCategory));
+llvm::cl::alias JobsShortOption("j",
+                                llvm::cl::desc("Alias for the --jobs option"),
+                                llvm::cl::aliasopt(JobsOption));
+
+llvm::cl::opt<bool> ReportOption(
+    "report",
+    llvm::cl::desc("Instead of warning about each occurrence, count the "
+                   "unknown words over all files and print the most frequent "
+                   "ones"),
+    llvm::cl::cat(DictionaryCheckCategory));
+
+enum class ReportFormat { Text, Json };
+
+llvm::cl::opt<ReportFormat> ReportFormatOption(
+    "report-format",
+    llvm::cl::desc("The format of the -report output"),
+    llvm::cl::init(ReportFormat::Text),
+    llvm::cl::values(clEnumValN(ReportFormat::Text, "text", "A plain table"),
+                     clEnumValN(ReportFormat::Json, "json", "A JSON array")),
+    llvm::cl::cat(DictionaryCheckCategory));
+
+llvm::cl::opt<unsigned>
+    TopOption("top",
+              llvm::cl::init(50),
+              llvm::cl::desc("How many words -report prints (0 for all)"),
+              llvm::cl::cat(DictionaryCheckCategory));
+
+llvm::cl::opt<std::string> BenchmarkOption(
+    "benchmark",
+    llvm::cl::desc("Measure lookups per second on the identifiers in the given "
+                   "file (one per line) instead of checking any sources"),
+    llvm::cl::value_desc("identifiers"),
+    llvm::cl::cat(DictionaryCheckCategory));
+
+llvm::cl::opt<unsigned> BenchmarkRoundsOption(
+    "benchmark-rounds",
+    llvm::cl::init(100),
+    llvm::cl::desc("How often to replay the identifier stream for -benchmark"),
+    llvm::cl::cat(DictionaryCheckCategory));
+
+/// Returns the directory to cache compiled dictionaries in if no --dict-cache
+/// is given, so that nothing is written next to the dictionaries, which may
+/// well be in a source tree. Returns an empty string without a home directory.
+std::string GetDefaultCacheDirectory() {
+  llvm::SmallString<256> Directory;
+  if (const char* CacheHome = std::getenv("XDG_CACHE_HOME")) {
+    Directory = CacheHome;
+  }
+
+  // The XDG specification says to ignore relative paths.
+  if (Directory.empty() || llvm::sys::path::is_relative(Directory)) {
+    Directory.clear();
+    if (!llvm::sys::path::home_directory(Directory)) return {};
+    llvm::sys::path::append(Directory, ".cache");
+  }
+
+  llvm::sys::path::append(Directory, "dict-check");
+  return Directory.str();
+}
 }  // namespace
 
 
 struct ToolFactory : public clang::tooling::FrontendActionFactory {
+  explicit ToolFactory(DictionaryCheck::RunContext& Context)
+  : Context(Context) {}
+
   clang::FrontendAction* create() override {
-    return new DictionaryCheck::Action(DictionaryOption,
-                                       FunctionsOption,
-                                       RecordsOption);
+    return new DictionaryCheck::Action(Context);
   }
+
+  DictionaryCheck::RunContext& Context;
 };
 
 auto main(int argc, const char* argv[]) -> int {
   using namespace clang::tooling;
 
-  CommonOptionsParser OptionsParser(argc, argv, DictionaryCheckCategory);
-  ClangTool Tool(OptionsParser.getCompilations(),
-                 OptionsParser.getSourcePathList());
+  CommonOptionsParser OptionsParser(argc,
+                                    argv,
+                                    DictionaryCheckCategory,
+                                    llvm::cl::ZeroOrMore);
+
+  std::string CacheDirectory = DictionaryCacheOption;
+  if (CacheDirectory.empty()) CacheDirectory = GetDefaultCacheDirectory();
+  if (CacheDirectory.empty()) {
+    llvm::errs() << "No home directory to cache dictionaries in, please "
+                    "pass --dict-cache\n";
+    return 1;
+  }
+
+  if (llvm::sys::fs::create_directories(CacheDirectory)) {
+    llvm::errs() << "Error creating directory: " << CacheDirectory << '\n';
+    return 1;
+  }
+
+  // Load the dictionary once for the whole run.
+  const auto Words =
+      DictionaryCheck::Dictionary::load(DictionaryOption, CacheDirectory);
+  if (!Words) return 1;
+
+  std::unique_ptr<DictionaryCheck::SuggestionIndex> Index;
+  if (SuggestionsOption > 0 || !BenchmarkOption.empty()) {
+    Index = DictionaryCheck::SuggestionIndex::loadOrBuild(*Words);
+  }
+
+  if (!BenchmarkOption.empty()) {
+    return DictionaryCheck::RunBenchmark(*Words,
+                                         Index.get(),
+                                         BenchmarkOption,
+                                         BenchmarkRoundsOption);
+  }
+
+  llvm::SmallString<256> ProjectPrefix(ProjectPrefixOption);
+  llvm::sys::fs::make_absolute(ProjectPrefix);
+  llvm::sys::path::remove_dots(ProjectPrefix, /*remove_dot_dot=*/true);
+
+  DictionaryCheck::VerdictCache Cache(*Words, Index.get(), SuggestionsOption);
+  DictionaryCheck::UnknownWordReport Report;
+  DictionaryCheck::RunContext Context(Cache,
+                                      ScopeOption,
+                                      ProjectPrefix.str(),
+                                      FunctionsOption,
+                                      RecordsOption,
+                                      ReportOption ? &Report : nullptr);
+
+  int Status;
+  if (LexerOnlyOption) {
+    Status = ToolSupport::RunInParallel(
+        OptionsParser.getSourcePathList(),
+        JobsOption,
+        [&Context](const std::string& Source) {
+          return DictionaryCheck::LexerChecker(Context).check(Source);
+        });
+  } else {
+    ToolFactory Factory(Context);
+    Status = ToolSupport::RunToolsInParallel(
+        OptionsParser.getCompilations(),
+        OptionsParser.getSourcePathList(),
+        JobsOption,
+        [&Factory](ClangTool& Tool, const std::string&, const std::string&) {
+          return Tool.run(&Factory) == 0;
+        });
+  }
+
+  if (ReportOption) {
+    const auto Rows = Report.merge(TopOption);
+    if (ReportFormatOption == ReportFormat::Json) {
+      DictionaryCheck::PrintJsonReport(llvm::outs(), Rows);
+    } else {
+      DictionaryCheck::PrintTextReport(llvm::outs(), Rows);
+    }
+  }
 
-  return Tool.run(new ToolFactory());
+  return Status;
 }
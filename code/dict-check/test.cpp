@@ -5,3 +5,16 @@ void foo() {
 struct Apple {
   int ddd;
 };
+
+int scale(int first, int second) {
+  return first * second;
+}
+
+int measure(int widht, int heigth) {
+  // Only the parameters are declared here; none of the operands below may be
+  // mistaken for a declaration.
+  if (widht > heigth) return widht;
+  if (widht && heigth) return heigth;
+  if (widht < heigth && widht > heigth) return 0;
+  return scale(widht * heigth, widht & heigth);
+}
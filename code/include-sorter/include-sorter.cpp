@@ -1,14 +1,25 @@
+// Tool Includes
+#include "../common/tool-support.h"
+
 // Clang Includes
 #include <clang/AST/ASTConsumer.h>
 #include <clang/AST/ASTContext.h>
 #include <clang/AST/Expr.h>
+#include <clang/AST/ExprCXX.h>
+#include <clang/AST/RecursiveASTVisitor.h>
 #include <clang/ASTMatchers/ASTMatchFinder.h>
 #include <clang/ASTMatchers/ASTMatchers.h>
 #include <clang/Basic/Diagnostic.h>
+#include <clang/Basic/DiagnosticOptions.h>
+#include <clang/Basic/FileManager.h>
+#include <clang/Basic/LangOptions.h>
 #include <clang/Basic/SourceLocation.h>
+#include <clang/Basic/SourceManager.h>
 #include <clang/Frontend/CompilerInstance.h>
 #include <clang/Frontend/FrontendAction.h>
 #include <clang/Frontend/FrontendActions.h>
+#include <clang/Lex/Lexer.h>
+#include <clang/Lex/MacroInfo.h>
 #include <clang/Lex/PPCallbacks.h>
 #include <clang/Lex/Preprocessor.h>
 #include <clang/Rewrite/Core/Rewriter.h>
@@ -18,37 +29,67 @@
 
 // LLVM Includes
 #include <llvm/ADT/ArrayRef.h>
+#include <llvm/ADT/DenseMap.h>
+#include <llvm/ADT/DenseSet.h>
+#include <llvm/ADT/Hashing.h>
+#include <llvm/ADT/SmallString.h>
+#include <llvm/ADT/StringMap.h>
 #include <llvm/ADT/StringRef.h>
+#include <llvm/ADT/StringSet.h>
+#include <llvm/ADT/Twine.h>
 #include <llvm/Support/CommandLine.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/Format.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/Path.h>
+#include <llvm/Support/Regex.h>
 #include <llvm/Support/raw_ostream.h>
 
 // Standard Includes
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <limits>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <tuple>
 #include <type_traits>
+#include <utility>
+#include <vector>
 
 namespace IncludeSorter {
 
+using ToolSupport::StoreAtomically;
+
 /// Represents an include in source code.
 struct Include {
-  Include(const std::string& Filename, bool Angled)
-  : Filename(Filename), Angled(Angled) {}
+  Include(const std::string& Filename, bool Angled, int Priority)
+  : Filename(Filename), Angled(Angled), Priority(Priority) {}
 
   /// The name of the included file.
   std::string Filename;
 
   /// Wether the file was included with angle brackets.
   bool Angled;
+
+  /// The priority of the include's category. Lower ones go first.
+  int Priority;
 };
 
 namespace {
 
-/// Takes a vector of includes and sorts them lexicographically, optionally in
-/// reverse order.
+/// Takes a vector of includes and sorts them by the priority of their
+/// category, then lexicographically, optionally in reverse order. Categories
+/// are separated by an empty line.
 std::string
 sortIncludes(llvm::SmallVectorImpl<Include>& Includes, bool Reverse) {
   /// Sort the includes in-place first.
   std::sort(Includes.begin(), Includes.end(), [=](auto& first, auto& second) {
+    if (first.Priority != second.Priority) {
+      return first.Priority < second.Priority;
+    }
     return Reverse ? (first.Filename > second.Filename)
                    : (first.Filename < second.Filename);
   });
@@ -62,41 +103,189 @@ sortIncludes(llvm::SmallVectorImpl<Include>& Includes, bool Reverse) {
     const auto right = Include->Angled ? ">" : "\"";
     JoinedLines +=
         (llvm::Twine("#include ") + left + Include->Filename + right).str();
-    if (++Include != Includes.end()) JoinedLines += '\n';
+    const auto Priority = Include->Priority;
+    if (++Include != Includes.end()) {
+      JoinedLines += '\n';
+      if (Include->Priority != Priority) JoinedLines += '\n';
+    }
   }
 
   return JoinedLines;
 }
 }  // namespace
 
-/// Captures #include directives and sorts them after every block.
+/// Assigns includes to categories by regular expressions, like the
+/// IncludeCategories of clang-format.
+///
+/// Each rule has a priority and a regular expression, which is matched
+/// against the included name as written, with its quotes or brackets. The
+/// first rule that matches wins; includes no rule matches go last. A quoted
+/// include with the same stem and directory as the main file is its main
+/// header, which goes before everything else. Without rules, all includes are
+/// in one category.
+///
+/// The rules are compiled once and tried in order. Since the same headers are
+/// included by thousands of files, the category of every name is remembered,
+/// in a map split into shards so that workers rarely wait on each other.
+class IncludeCategories {
+ public:
+  /// The priority of the main header, which no rule may use.
+  static constexpr int MainHeader = std::numeric_limits<int>::min();
+
+  /// The priority of includes that no rule matches.
+  static constexpr int Unmatched = std::numeric_limits<int>::max();
+
+  /// Adds a rule of the form `<priority>:<regex>`. Must not be called once
+  /// any include was categorized.
+  ///
+  /// \returns False, with the reason in the error, if the rule is invalid.
+  bool add(llvm::StringRef Definition, std::string& Error) {
+    const auto[Number, Pattern] = Definition.split(':');
+
+    int Priority;
+    if (Number.getAsInteger(10, Priority) || Pattern.empty()) {
+      Error = "expected <priority>:<regex>";
+      return false;
+    }
+
+    if (Priority == MainHeader) {
+      Error = "the lowest priority is reserved for the main header";
+      return false;
+    }
+
+    llvm::Regex Regex(Pattern);
+    if (!Regex.isValid(Error)) return false;
+
+    Rules.push_back({Priority, std::move(Regex)});
+    return true;
+  }
+
+  /// Whether there are no rules, so that includes are not categorized.
+  bool empty() const noexcept {
+    return Rules.empty();
+  }
+
+  /// Returns the priority of the include.
+  ///
+  /// \param Filename The included name, without quotes or brackets.
+  /// \param Angled Whether the name was in angle brackets.
+  /// \param MainFile The path of the main file.
+  int getPriority(llvm::StringRef Filename,
+                  bool Angled,
+                  llvm::StringRef MainFile) {
+    if (Rules.empty()) return 0;
+
+    // The main header depends on the main file, so it is not remembered.
+    if (!Angled && isMainHeader(Filename, MainFile)) return MainHeader;
+
+    const auto Spelling =
+        (llvm::Twine(Angled ? "<" : "\"") + Filename + (Angled ? ">" : "\""))
+            .str();
+
+    auto& Shard = Shards[llvm::hash_value(Spelling) % Shards.size()];
+    {
+      std::lock_guard<std::mutex> Lock(Shard.Mutex);
+      const auto Known = Shard.Priorities.find(Spelling);
+      if (Known != Shard.Priorities.end()) return Known->second;
+    }
+
+    // Matching needs no lock; at worst two workers match the same name.
+    const auto Priority = match(Spelling);
+
+    std::lock_guard<std::mutex> Lock(Shard.Mutex);
+    Shard.Priorities.insert({Spelling, Priority});
+    return Priority;
+  }
+
+ private:
+  /// A compiled rule.
+  struct Rule {
+    /// The priority of the includes the rule matches.
+    int Priority;
+
+    /// The regular expression of the rule.
+    llvm::Regex Regex;
+  };
+
+  /// A part of the remembered priorities.
+  struct Shard {
+    /// Guards the priorities.
+    std::mutex Mutex;
+
+    /// The priority of each include, by its spelling.
+    llvm::StringMap<int> Priorities;
+  };
+
+  /// Matches the spelled include against the rules, in order.
+  ///
+  /// The rules are not combined into one alternation: POSIX regular
+  /// expressions prefer the longest match over the first alternative, so it
+  /// could not tell which rule comes first. Since every name is matched only
+  /// once per run, trying the rules in turn costs little.
+  int match(llvm::StringRef Spelling) {
+    for (auto& Candidate : Rules) {
+      if (Candidate.Regex.match(Spelling)) return Candidate.Priority;
+    }
+
+    return Unmatched;
+  }
+
+  /// Whether the include names the header of the main file, as in
+  /// `"bar.h"` or `"foo/bar.h"` included by `foo/bar.cpp`. A header in another
+  /// directory, like `"baz/bar.h"`, merely shares the stem.
+  static bool isMainHeader(llvm::StringRef Filename,
+                           llvm::StringRef MainFile) {
+    const auto Stem = llvm::sys::path::stem(MainFile);
+    if (Stem.empty() || llvm::sys::path::stem(Filename) != Stem) return false;
+
+    // A name without a directory is looked up next to the main file first.
+    const auto Directory = llvm::sys::path::parent_path(Filename);
+    if (Directory.empty()) return true;
+
+    llvm::SmallString<256> MainDirectory(MainFile);
+    llvm::sys::fs::make_absolute(MainDirectory);
+    llvm::sys::path::remove_dots(MainDirectory, /*remove_dot_dot=*/true);
+    llvm::sys::path::remove_filename(MainDirectory);
+
+    return llvm::sys::path::filename(Directory) ==
+           llvm::sys::path::filename(MainDirectory);
+  }
+
+  /// The rules, in the order they are tried.
+  std::vector<Rule> Rules;
+
+  /// The remembered priorities.
+  std::array<Shard, 64> Shards;
+};
+
+/// Collects #include directives and sorts them after every block.
 ///
 /// The algorithm proceeds by collecting all included files into a vector and
 /// whenever the distance between two includes is more than one line, the files
 /// picked up until then are sorted and the source code rewritten.
-class PreprocessorCallback : public clang::PPCallbacks {
+class BlockSorter {
  public:
   /// Constructor.
   ///
   /// \param Rewriter The object to rewrite the source code
   /// \param Reverse Whether to sort includes in reverse.
-  explicit PreprocessorCallback(clang::Rewriter& Rewriter, bool Reverse)
+  /// \param Categories The categories to group includes by.
+  BlockSorter(clang::Rewriter& Rewriter,
+              bool Reverse,
+              IncludeCategories& Categories)
   : SourceManager(Rewriter.getSourceMgr())
   , Rewriter(Rewriter)
-  , Reverse(Reverse) {}
+  , Reverse(Reverse)
+  , Categories(Categories) {}
 
   /// Collects the included file and possibly performs a sorting.
-  void InclusionDirective(clang::SourceLocation HashLocation,
-                          const clang::Token&,
-                          llvm::StringRef Filename,
-                          bool Angled,
-                          clang::CharSourceRange Range,
-                          const clang::FileEntry*,
-                          llvm::StringRef,
-                          llvm::StringRef,
-                          const clang::Module*) override {
-    if (!SourceManager.isInMainFile(HashLocation)) return;
-
+  ///
+  /// \param HashLocation The location of the `#` of the directive.
+  /// \param EndLocation The location just past the file name.
+  void add(clang::SourceLocation HashLocation,
+           clang::SourceLocation EndLocation,
+           llvm::StringRef Filename,
+           bool Angled) {
     // Need to find the line number.
     const auto[FileID, Offset] = SourceManager.getDecomposedLoc(HashLocation);
 
@@ -108,29 +297,35 @@ class PreprocessorCallback : public clang::PPCallbacks {
     // Whenever the distance between lines is more than one, we have a "block",
     // so sort this block.
     if (!Includes.empty() && LineNumber > LastLineNumber + 1) {
-      SortCurrent();
+      finish();
     }
 
     if (Includes.empty()) FirstLocation = HashLocation;
-    Includes.emplace_back(Filename, Angled);
+    const auto Priority =
+        Categories.getPriority(Filename, Angled, getMainFile());
+    Includes.emplace_back(Filename, Angled, Priority);
     LastLineNumber = LineNumber;
-    LastLocation = Range.getEnd();
+    LastLocation = EndLocation;
   }
 
-  /// Sort the final chunk of lines.
-  void EndOfMainFile() override {
-    if (!Includes.empty()) SortCurrent();
-  }
+  /// Sorts the current block, if any.
+  void finish() {
+    if (Includes.empty()) return;
 
- private:
-  /// Sorts the current includes, rewrites the source code and clears the state.
-  void SortCurrent() {
     const std::string JoinedLines = sortIncludes(Includes, Reverse);
     clang::SourceRange Range(FirstLocation, LastLocation);
     Rewriter.ReplaceText(Range, JoinedLines);
     Includes.clear();
   }
 
+ private:
+  /// The path of the main file, to find its main header by.
+  llvm::StringRef getMainFile() const {
+    const auto* Entry =
+        SourceManager.getFileEntryForID(SourceManager.getMainFileID());
+    return Entry ? Entry->getName() : llvm::StringRef();
+  }
+
   /// The current block of includes.
   llvm::SmallVector<Include, 16> Includes;
 
@@ -151,8 +346,427 @@ class PreprocessorCallback : public clang::PPCallbacks {
 
   /// Whether to sort in reverse.
   bool Reverse;
+
+  /// The categories to group includes by.
+  IncludeCategories& Categories;
+};
+
+/// Captures #include directives of the main file while preprocessing it and
+/// sorts them after every block.
+class PreprocessorCallback : public clang::PPCallbacks {
+ public:
+  /// Constructor.
+  ///
+  /// \param Rewriter The object to rewrite the source code
+  /// \param Reverse Whether to sort includes in reverse.
+  /// \param Categories The categories to group includes by.
+  PreprocessorCallback(clang::Rewriter& Rewriter,
+                       bool Reverse,
+                       IncludeCategories& Categories)
+  : SourceManager(Rewriter.getSourceMgr())
+  , Sorter(Rewriter, Reverse, Categories) {}
+
+  /// Collects the included file and possibly performs a sorting.
+  void InclusionDirective(clang::SourceLocation HashLocation,
+                          const clang::Token&,
+                          llvm::StringRef Filename,
+                          bool Angled,
+                          clang::CharSourceRange Range,
+                          const clang::FileEntry*,
+                          llvm::StringRef,
+                          llvm::StringRef,
+                          const clang::Module*) override {
+    if (!SourceManager.isInMainFile(HashLocation)) return;
+    Sorter.add(HashLocation, Range.getEnd(), Filename, Angled);
+  }
+
+  /// Sort the final chunk of lines.
+  void EndOfMainFile() override {
+    Sorter.finish();
+  }
+
+ private:
+  /// The `SourceManager` to find the main file.
+  const clang::SourceManager& SourceManager;
+
+  /// Sorts the collected includes.
+  BlockSorter Sorter;
+};
+
+/// Sorts the #include directives of a file by raw-lexing it, without running
+/// the preprocessor.
+///
+/// Only the main file is read; no header is ever looked up or opened, so this
+/// is bound by I/O rather than by preprocessing. Unlike the preprocessor, the
+/// lexer also sees directives in inactive `#if` branches, and cannot resolve
+/// an `#include` of a macro, which therefore just ends the current block.
+class LexerSorter {
+ public:
+  /// Constructor.
+  ///
+  /// \param Reverse Whether to sort includes in reverse.
+  /// \param Categories The categories to group includes by.
+  LexerSorter(bool Reverse, IncludeCategories& Categories)
+  : Diagnostics(new clang::DiagnosticIDs(),
+                new clang::DiagnosticOptions(),
+                new clang::IgnoringDiagConsumer())
+  , Files(clang::FileSystemOptions())
+  , SourceManager(Diagnostics, Files)
+  , Reverse(Reverse)
+  , Categories(Categories) {
+    LanguageOptions.CPlusPlus = true;
+    LanguageOptions.CPlusPlus11 = true;
+    LanguageOptions.CPlusPlus14 = true;
+    LanguageOptions.LineComment = true;
+    Rewriter.setSourceMgr(SourceManager, LanguageOptions);
+  }
+
+  /// Reads the file and sorts its includes. Must only be called once per
+  /// sorter.
+  ///
+  /// \returns False if the file could not be read.
+  bool sort(llvm::StringRef Filename) {
+    const auto* Entry = Files.getFile(Filename);
+    if (!Entry) {
+      llvm::errs() << "Error reading from: " << Filename << '\n';
+      return false;
+    }
+
+    MainFileID = SourceManager.createFileID(
+        Entry, clang::SourceLocation(), clang::SrcMgr::C_User);
+    SourceManager.setMainFileID(MainFileID);
+
+    bool Invalid = false;
+    const auto Source = SourceManager.getBufferData(MainFileID, &Invalid);
+    if (Invalid) {
+      llvm::errs() << "Error reading from: " << Filename << '\n';
+      return false;
+    }
+
+    BlockSorter Sorter(Rewriter, Reverse, Categories);
+    clang::Lexer Lexer(MainFileID,
+                       SourceManager.getBuffer(MainFileID),
+                       SourceManager,
+                       LanguageOptions);
+
+    clang::Token Token;
+    Lexer.LexFromRawLexer(Token);
+    while (Token.isNot(clang::tok::eof)) {
+      if (!Token.isAtStartOfLine() || Token.isNot(clang::tok::hash)) {
+        Lexer.LexFromRawLexer(Token);
+        continue;
+      }
+
+      const auto HashLocation = Token.getLocation();
+      Lexer.LexFromRawLexer(Token);
+      if (!Token.isAtStartOfLine() && Token.is(clang::tok::raw_identifier) &&
+          isInclude(Token.getRawIdentifier())) {
+        const auto Offset = SourceManager.getFileOffset(Token.getEndLoc());
+        addInclude(Sorter, HashLocation, Source, Offset);
+      }
+
+      // Skip the rest of the directive.
+      while (Token.isNot(clang::tok::eof) && !Token.isAtStartOfLine()) {
+        Lexer.LexFromRawLexer(Token);
+      }
+    }
+
+    Sorter.finish();
+    return true;
+  }
+
+  /// The rewriter holding the sorted file.
+  clang::Rewriter& getRewriter() noexcept {
+    return Rewriter;
+  }
+
+  /// The file sorted last.
+  clang::FileID getMainFileID() const noexcept {
+    return MainFileID;
+  }
+
+ private:
+  /// Whether the directive (after the `#`) includes a file.
+  static bool isInclude(llvm::StringRef Directive) {
+    return Directive == "include" || Directive == "import" ||
+           Directive == "include_next";
+  }
+
+  /// Reads the `<file>` or `"file"` that follows the name of an include
+  /// directive, which ends at the offset.
+  void addInclude(BlockSorter& Sorter,
+                  clang::SourceLocation HashLocation,
+                  llvm::StringRef Source,
+                  size_t Offset) {
+    auto Rest = Source.substr(Offset);
+    Rest = Rest.substr(0, Rest.find('\n'));
+    const auto Name = Rest.ltrim(" \t");
+    const auto Start = Offset + (Rest.size() - Name.size());
+
+    const char Close =
+        Name.startswith("<") ? '>' : (Name.startswith("\"") ? '"' : '\0');
+    const auto End = Close ? Name.find(Close, 1) : llvm::StringRef::npos;
+
+    // Something like `#include MACRO`, which only the preprocessor can
+    // resolve. Its neighbors must not be sorted across it.
+    if (End == llvm::StringRef::npos) {
+      Sorter.finish();
+      return;
+    }
+
+    const auto Begin = SourceManager.getLocForStartOfFile(MainFileID);
+    Sorter.add(HashLocation,
+               Begin.getLocWithOffset(Start + End + 1),
+               Name.substr(1, End - 1),
+               Close == '>');
+  }
+
+  /// Swallows any diagnostics about the file.
+  clang::DiagnosticsEngine Diagnostics;
+
+  /// Looks up the file.
+  clang::FileManager Files;
+
+  /// Holds the file's buffer.
+  clang::SourceManager SourceManager;
+
+  /// The language to lex the file as.
+  clang::LangOptions LanguageOptions;
+
+  /// The rewriter to rewrite source code.
+  clang::Rewriter Rewriter;
+
+  /// The file sorted last.
+  clang::FileID MainFileID;
+
+  /// Whether to sort in reverse order.
+  bool Reverse;
+
+  /// The categories to group includes by.
+  IncludeCategories& Categories;
+};
+
+/// What to do with a sorted file.
+enum class OutputMode {
+  /// Print it to stdout.
+  Print,
+
+  /// Replace the file with it, unless nothing changed.
+  InPlace,
+
+  /// Print the file's name if anything changed.
+  Check,
+
+  /// Print a unified diff if anything changed.
+  Diff
 };
 
+namespace {
+/// Guards stdout while checking or diffing files on several threads.
+std::mutex OutputMutex;
+
+/// Splits the text into lines, each with its newline (if any).
+std::vector<llvm::StringRef> SplitLines(llvm::StringRef Text) {
+  std::vector<llvm::StringRef> Lines;
+  while (!Text.empty()) {
+    const auto End = std::min(Text.find('\n'), Text.size() - 1) + 1;
+    Lines.push_back(Text.substr(0, End));
+    Text = Text.substr(End);
+  }
+  return Lines;
+}
+
+/// A line of a diff: ' ' if both sides have it, '-' if only the old one
+/// does and '+' if only the new one does.
+using DiffLine = std::pair<char, llvm::StringRef>;
+
+/// Computes the shortest edit script between the lines with Myers' algorithm,
+/// which takes time proportional to the number of lines times the number of
+/// differing lines. Sorting only moves a few lines, so this is about linear.
+std::vector<DiffLine> DiffLines(llvm::ArrayRef<llvm::StringRef> Old,
+                                llvm::ArrayRef<llvm::StringRef> New) {
+  const int N = Old.size();
+  const int M = New.size();
+  const int Max = N + M;
+
+  // The furthest x reached on each diagonal k = x - y, offset by Max. Each
+  // step remembers the diagonals it started from, to walk back the path.
+  std::vector<int> Furthest(2 * Max + 3, 0);
+  std::vector<std::vector<int>> Trace;
+
+  int Steps = 0;
+  for (bool Done = false; !Done; ++Steps) {
+    const auto D = Steps;
+    Trace.emplace_back(Furthest.begin() + Max + 1 - (D + 1),
+                       Furthest.begin() + Max + 1 + (D + 2));
+    for (int K = -D; K <= D && !Done; K += 2) {
+      const auto Index = Max + 1 + K;
+      const auto Down =
+          K == -D || (K != D && Furthest[Index - 1] < Furthest[Index + 1]);
+      auto X = Down ? Furthest[Index + 1] : Furthest[Index - 1] + 1;
+      auto Y = X - K;
+      while (X < N && Y < M && Old[X] == New[Y]) ++X, ++Y;
+      Furthest[Index] = X;
+      Done = X >= N && Y >= M;
+    }
+  }
+
+  std::vector<DiffLine> Script;
+  int X = N;
+  int Y = M;
+  for (int D = Steps - 1; D > 0; --D) {
+    // The slice of step D holds the diagonals -(D + 1) to D + 1.
+    const auto& Previous = Trace[D];
+    const auto At = [&](int K) { return Previous[K + D + 1]; };
+
+    const auto K = X - Y;
+    const auto Down = K == -D || (K != D && At(K - 1) < At(K + 1));
+    const auto PreviousK = Down ? K + 1 : K - 1;
+    const auto PreviousX = At(PreviousK);
+    const auto PreviousY = PreviousX - PreviousK;
+
+    while (X > PreviousX && Y > PreviousY) {
+      Script.emplace_back(' ', Old[--X]);
+      --Y;
+    }
+    if (Down) {
+      Script.emplace_back('+', New[--Y]);
+    } else {
+      Script.emplace_back('-', Old[--X]);
+    }
+  }
+  while (X > 0 && Y > 0) {
+    Script.emplace_back(' ', Old[--X]);
+    --Y;
+  }
+
+  std::reverse(Script.begin(), Script.end());
+  return Script;
+}
+
+/// Writes a line of a diff, marking a missing newline at the end of the file.
+void WriteDiffLine(llvm::raw_ostream& Stream, const DiffLine& Line) {
+  Stream << Line.first << Line.second;
+  if (!Line.second.endswith("\n")) {
+    Stream << "\n\\ No newline at end of file\n";
+  }
+}
+
+/// Writes a unified diff with three lines of context between the old and the
+/// new text of the file.
+void WriteDiff(llvm::raw_ostream& Stream,
+               llvm::StringRef Path,
+               llvm::StringRef Old,
+               llvm::StringRef New) {
+  const auto OldLines = SplitLines(Old);
+  const auto NewLines = SplitLines(New);
+  const auto Script = DiffLines(OldLines, NewLines);
+  const size_t Context = 3;
+
+  Stream << "--- " << Path << "\n+++ " << Path << '\n';
+
+  // The lines of each side before the current position in the script.
+  size_t OldLine = 0;
+  size_t NewLine = 0;
+  for (size_t Index = 0; Index < Script.size();) {
+    if (Script[Index].first == ' ') {
+      ++OldLine, ++NewLine, ++Index;
+      continue;
+    }
+
+    // Extend the hunk until the next change is further than twice the
+    // context away, so that hunks never overlap.
+    auto Last = Index;
+    for (auto Line = Index; Line < Script.size(); ++Line) {
+      if (Script[Line].first != ' ') {
+        Last = Line;
+      } else if (Line - Last > 2 * Context) {
+        break;
+      }
+    }
+
+    const auto Begin = Index - std::min(Index, Context);
+    const auto End = std::min(Last + 1 + Context, Script.size());
+
+    size_t OldCount = 0;
+    size_t NewCount = 0;
+    for (auto Line = Begin; Line < End; ++Line) {
+      OldCount += Script[Line].first != '+';
+      NewCount += Script[Line].first != '-';
+    }
+
+    // Lines before the hunk, and where an empty side starts.
+    const auto OldStart = OldLine - (Index - Begin);
+    const auto NewStart = NewLine - (Index - Begin);
+    Stream << "@@ -" << (OldCount ? OldStart + 1 : OldStart) << ','
+           << OldCount << " +" << (NewCount ? NewStart + 1 : NewStart) << ','
+           << NewCount << " @@\n";
+    for (auto Line = Begin; Line < End; ++Line) {
+      WriteDiffLine(Stream, Script[Line]);
+    }
+
+    for (; Index < End; ++Index) {
+      OldLine += Script[Index].first != '+';
+      NewLine += Script[Index].first != '-';
+    }
+  }
+}
+}  // namespace
+
+/// Writes out the sorted file.
+///
+/// Except when printing, a file whose includes were already sorted is not
+/// written at all. In place, its modification time (and thus any build
+/// depending on it) is left alone. When checking or diffing, nothing is
+/// printed for it, and the output of each other file is printed at once, so
+/// that files can be processed on several threads.
+///
+/// \returns False if the file could not be written, or when checking, if its
+/// includes were not sorted.
+bool WriteSorted(clang::Rewriter& Rewriter,
+                 clang::FileID FileID,
+                 OutputMode Mode) {
+  if (Mode == OutputMode::Print) {
+    Rewriter.getEditBuffer(FileID).write(llvm::outs());
+    return true;
+  }
+
+  const auto& SourceManager = Rewriter.getSourceMgr();
+  const auto Original = SourceManager.getBufferData(FileID);
+
+  // Without edits, the file is sorted already.
+  if (!Rewriter.getRewriteBufferFor(FileID)) return true;
+
+  std::string Sorted;
+  llvm::raw_string_ostream Stream(Sorted);
+  Rewriter.getEditBuffer(FileID).write(Stream);
+  if (Stream.str() == Original) return true;
+
+  const auto* Entry = SourceManager.getFileEntryForID(FileID);
+  if (Mode == OutputMode::Check) {
+    std::lock_guard<std::mutex> Lock(OutputMutex);
+    llvm::outs() << Entry->getName() << '\n';
+    return false;
+  }
+
+  if (Mode == OutputMode::Diff) {
+    std::string Diff;
+    llvm::raw_string_ostream DiffStream(Diff);
+    WriteDiff(DiffStream, Entry->getName(), Original, Sorted);
+
+    std::lock_guard<std::mutex> Lock(OutputMutex);
+    llvm::outs() << DiffStream.str();
+    return true;
+  }
+
+  if (!StoreAtomically(Entry->getName(), Sorted)) {
+    llvm::errs() << "Error writing to: " << Entry->getName() << '\n';
+    return false;
+  }
+
+  return true;
+}
+
 /// The action that registers the preprocessor callbacks.
 ///
 /// Note that we can skip the consumer in this case.
@@ -161,7 +775,14 @@ class Action : public clang::PreprocessOnlyAction {
   /// Constructor.
   ///
   /// \param Reverse Whether to sort in reverse
-  explicit Action(bool Reverse) : Reverse(Reverse) {}
+  /// \param Categories The categories to group includes by.
+  /// \param Mode What to do with the sorted file.
+  /// \param Failed Set if the sorted file could not be written.
+  Action(bool Reverse,
+         IncludeCategories& Categories,
+         OutputMode Mode,
+         std::atomic<bool>& Failed)
+  : Reverse(Reverse), Categories(Categories), Mode(Mode), Failed(Failed) {}
 
   /// Called before any file is even touched. Allows us to register a rewriter.
   bool BeginInvocation(clang::CompilerInstance& Compiler) override {
@@ -172,7 +793,8 @@ class Action : public clang::PreprocessOnlyAction {
   /// Adds our preprocessor callback to the compiler instance.
   bool BeginSourceFileAction(clang::CompilerInstance& Compiler,
                              llvm::StringRef Filename) override {
-    auto hooks = std::make_unique<PreprocessorCallback>(Rewriter, Reverse);
+    auto hooks = std::make_unique<PreprocessorCallback>(
+        Rewriter, Reverse, Categories);
     Compiler.getPreprocessor().addPPCallbacks(std::move(hooks));
     return true;
   }
@@ -180,7 +802,7 @@ class Action : public clang::PreprocessOnlyAction {
   /// Writes the rewritten source code back out to disk.
   void EndSourceFileAction() override {
     const auto FileID = Rewriter.getSourceMgr().getMainFileID();
-    Rewriter.getEditBuffer(FileID).write(llvm::outs());
+    if (!WriteSorted(Rewriter, FileID, Mode)) Failed = true;
   }
 
  private:
@@ -189,38 +811,1838 @@ class Action : public clang::PreprocessOnlyAction {
 
   /// Whether to sort in reverse order. Forwarded to the callback.
   bool Reverse;
-};
-}  // namespace IncludeSorter
 
-namespace {
-llvm::cl::OptionCategory includeSorterCategory("minus-tool options");
-llvm::cl::extrahelp includeSorterCategoryHelp(R"(
-  Sorts your Includes alphabetically.
-)");
+  /// The categories to group includes by. Forwarded to the callback.
+  IncludeCategories& Categories;
 
-llvm::cl::opt<bool> ReverseOption("reverse",
-                                  llvm::cl::desc("Sort in reversed order"),
-                                  llvm::cl::cat(includeSorterCategory));
-llvm::cl::alias
-    ReverseShortOption("r",
-                       llvm::cl::desc("Alias for the -reverse option"),
-                       llvm::cl::aliasopt(ReverseOption));
-}  // namespace
+  /// What to do with the sorted file.
+  OutputMode Mode;
 
-/// A custom `FrontendActionFactory` so that we can pass the options
-/// to the constructor of the tool.
-struct ToolFactory : public clang::tooling::FrontendActionFactory {
-  clang::FrontendAction* create() override {
-    return new IncludeSorter::Action(ReverseOption);
-  }
+  /// Set if the sorted file could not be written.
+  std::atomic<bool>& Failed;
 };
 
-auto main(int argc, const char* argv[]) -> int {
-  using namespace clang::tooling;
+/// The include graph of a whole run, merged over all translation units.
+///
+/// Each translation unit records its own graph (see `GraphCallback`) and
+/// merges it in once preprocessing is done, so workers only contend once per
+/// file. Files are identified by their absolute path. Since a header can
+/// include different files depending on the macros of each translation unit,
+/// the merged graph is the union of what every translation unit saw.
+class IncludeGraph {
+ public:
+  /// What one translation unit saw of a file.
+  struct Record {
+    /// How an include directive named the file, with quotes or brackets.
+    std::string Spelling;
+
+    /// The time spent preprocessing the file, including what it includes.
+    std::chrono::nanoseconds Time{0};
+
+    /// The time spent preprocessing the file itself, without what it
+    /// includes.
+    std::chrono::nanoseconds Exclusive{0};
+
+    /// The files it included directly.
+    llvm::SmallVector<const clang::FileEntry*, 8> Includes;
+  };
+
+  /// The graph of one translation unit.
+  using Records = llvm::DenseMap<const clang::FileEntry*, Record>;
+
+  /// A file seen by any translation unit.
+  struct Node {
+    /// The absolute path of the file.
+    std::string Path;
+
+    /// How the first include directive seen named the file, if any.
+    std::string Spelling;
+
+    /// The size of the file in bytes.
+    uint64_t Size = 0;
+
+    /// The number of tokens in the file, as counted by `analyze()`.
+    uint64_t Tokens = 0;
+
+    /// The files it includes directly.
+    llvm::DenseSet<unsigned> Includes;
+
+    /// The files that include it directly.
+    llvm::DenseSet<unsigned> Includers;
+
+    /// How many translation units include it, directly or not.
+    unsigned Inclusions = 0;
+
+    /// How many translation units it is the main file of.
+    unsigned MainFile = 0;
+
+    /// How many translation units preprocessed it, rather than skipping it
+    /// for its include guard.
+    unsigned Entered = 0;
+
+    /// The time spent preprocessing it (including what it includes), summed
+    /// over all translation units.
+    std::chrono::nanoseconds Time{0};
+
+    /// The time spent preprocessing it without what it includes, summed
+    /// over all translation units.
+    std::chrono::nanoseconds Exclusive{0};
+  };
+
+  /// The cost of a header, as computed by `analyze()`.
+  struct Cost {
+    /// The index of the header's node.
+    unsigned Node;
+
+    /// The size of the header and every file it includes, directly or not.
+    uint64_t TransitiveBytes = 0;
+
+    /// The tokens in the header and every file it includes, directly or not.
+    uint64_t TransitiveTokens = 0;
+
+    /// The transitive bytes times the number of inclusions, which is what
+    /// the header costs the whole project.
+    uint64_t TotalBytes = 0;
+
+    /// The transitive tokens times the number of inclusions.
+    uint64_t TotalTokens = 0;
+  };
+
+  /// Merges in the graph of one translation unit, whose relative names are
+  /// relative to the directory (see `GetPath`).
+  void merge(const Records& Files,
+             const clang::FileEntry* Main,
+             llvm::StringRef Directory) {
+    // Resolve the paths before taking the lock.
+    llvm::DenseMap<const clang::FileEntry*, std::string> Paths;
+    for (const auto& Entry : Files) {
+      Paths[Entry.first] = GetPath(*Entry.first, Directory);
+    }
+
+    std::lock_guard<std::mutex> Lock(Mutex);
+    TranslationUnits += 1;
 
-  CommonOptionsParser OptionsParser(argc, argv, includeSorterCategory);
-  ClangTool Tool(OptionsParser.getCompilations(),
-                 OptionsParser.getSourcePathList());
+    llvm::DenseMap<const clang::FileEntry*, unsigned> Local;
+    for (const auto& Entry : Files) {
+      const auto Index = getIndex(Paths[Entry.first]);
+      Local[Entry.first] = Index;
+
+      auto& Merged = Nodes[Index];
+      if (Merged.Spelling.empty()) Merged.Spelling = Entry.second.Spelling;
+      Merged.Size = Entry.first->getSize();
+      Merged.Time += Entry.second.Time;
+      Merged.Exclusive += Entry.second.Exclusive;
+      if (Entry.second.Time.count() > 0) Merged.Entered += 1;
+      if (Entry.first == Main) {
+        Merged.MainFile += 1;
+      } else {
+        Merged.Inclusions += 1;
+      }
+    }
+
+    for (const auto& Entry : Files) {
+      const auto From = Local[Entry.first];
+      for (const auto* Included : Entry.second.Includes) {
+        const auto To = Local[Included];
+        Nodes[From].Includes.insert(To);
+        Nodes[To].Includers.insert(From);
+      }
+    }
+  }
+
+  /// Counts the tokens of every file and computes the cost of every header,
+  /// sorted by total cost. Must only be called once no thread is merging
+  /// anymore.
+  std::vector<Cost> analyze() {
+    for (auto& Merged : Nodes) Merged.Tokens = CountTokens(Merged.Path);
+
+    // Each traversal marks the nodes it reached with its own stamp, so the
+    // marks never need to be cleared.
+    std::vector<unsigned> Reached(Nodes.size(), 0);
+    std::vector<unsigned> Stack;
+
+    std::vector<Cost> Costs;
+    for (unsigned Index = 0; Index < Nodes.size(); ++Index) {
+      if (Nodes[Index].Inclusions == 0) continue;
+
+      Cost Header;
+      Header.Node = Index;
+
+      const auto Stamp = Index + 1;
+      Reached[Index] = Stamp;
+      Stack.push_back(Index);
+      while (!Stack.empty()) {
+        const auto& Current = Nodes[Stack.back()];
+        Stack.pop_back();
+
+        Header.TransitiveBytes += Current.Size;
+        Header.TransitiveTokens += Current.Tokens;
+        for (const auto Included : Current.Includes) {
+          if (Reached[Included] == Stamp) continue;
+          Reached[Included] = Stamp;
+          Stack.push_back(Included);
+        }
+      }
+
+      Header.TotalBytes = Header.TransitiveBytes * Nodes[Index].Inclusions;
+      Header.TotalTokens = Header.TransitiveTokens * Nodes[Index].Inclusions;
+      Costs.push_back(Header);
+    }
+
+    std::sort(Costs.begin(), Costs.end(), [](const Cost& A, const Cost& B) {
+      return A.TotalBytes > B.TotalBytes;
+    });
+
+    return Costs;
+  }
+
+  /// The files of the graph.
+  llvm::ArrayRef<Node> getNodes() const noexcept {
+    return Nodes;
+  }
+
+  /// The number of translation units merged in.
+  unsigned getTranslationUnits() const noexcept {
+    return TranslationUnits;
+  }
+
+  /// The absolute path the graph knows the file by.
+  ///
+  /// \param Directory The directory of the compile command, which relative
+  /// names of the preprocessor are relative to. If it is empty, the commands
+  /// disagreed and the file ran on its own in the working directory that
+  /// `ClangTool` changed into.
+  static std::string GetPath(const clang::FileEntry& File,
+                             llvm::StringRef Directory) {
+    if (!Directory.empty()) {
+      return ToolSupport::MakeAbsolute(Directory, File.getName());
+    }
+
+    llvm::SmallString<256> Path(File.getName());
+    llvm::sys::fs::make_absolute(Path);
+    llvm::sys::path::remove_dots(Path, /*remove_dot_dot=*/true);
+    return Path.str();
+  }
+
+ private:
+  /// Returns the index of the node for the path, creating it if needed.
+  unsigned getIndex(llvm::StringRef Path) {
+    const auto Inserted = Indices.insert({Path, Nodes.size()});
+    if (Inserted.second) {
+      Nodes.emplace_back();
+      Nodes.back().Path = Path;
+    }
+    return Inserted.first->second;
+  }
+
+  /// Counts the tokens of the file with the raw lexer, which skips comments
+  /// but does not expand macros.
+  static uint64_t CountTokens(llvm::StringRef Path) {
+    auto Buffer = llvm::MemoryBuffer::getFile(Path);
+    if (!Buffer) return 0;
+
+    clang::LangOptions LanguageOptions;
+    LanguageOptions.CPlusPlus = true;
+    LanguageOptions.CPlusPlus11 = true;
+    LanguageOptions.LineComment = true;
+
+    const auto Source = (*Buffer)->getBuffer();
+    clang::Lexer Lexer(clang::SourceLocation(),
+                       LanguageOptions,
+                       Source.begin(),
+                       Source.begin(),
+                       Source.end());
+
+    uint64_t Tokens = 0;
+    clang::Token Token;
+    for (Lexer.LexFromRawLexer(Token); Token.isNot(clang::tok::eof);
+         Lexer.LexFromRawLexer(Token)) {
+      Tokens += 1;
+    }
+
+    return Tokens;
+  }
+
+  /// Guards everything.
+  std::mutex Mutex;
+
+  /// The files seen by any translation unit.
+  std::vector<Node> Nodes;
+
+  /// The index of each file's node, by path.
+  llvm::StringMap<unsigned> Indices;
+
+  /// The number of translation units merged in.
+  unsigned TranslationUnits = 0;
+};
+
+/// Records the include graph of a translation unit, with the time spent
+/// preprocessing each file, and merges it into the graph of the run.
+///
+/// A file's clock runs from entering to leaving it, which is its inclusive
+/// time. Its exclusive time is that minus the inclusive time of the files it
+/// includes. Headers skipped by their include guard are never entered, so
+/// they cost nothing.
+class GraphCallback : public clang::PPCallbacks {
+ public:
+  using Clock = std::chrono::steady_clock;
+
+  /// Constructor.
+  ///
+  /// \param SourceManager The `SourceManager` of the translation unit.
+  /// \param Graph The graph of the whole run.
+  /// \param Directory The directory of the compile command.
+  GraphCallback(const clang::SourceManager& SourceManager,
+                IncludeGraph& Graph,
+                llvm::StringRef Directory)
+  : SourceManager(SourceManager), Graph(Graph), Directory(Directory) {}
+
+  /// Starts or stops the clock of a file.
+  void FileChanged(clang::SourceLocation Location,
+                   FileChangeReason Reason,
+                   clang::SrcMgr::CharacteristicKind,
+                   clang::FileID) override {
+    if (Reason == EnterFile) {
+      const auto FileID = SourceManager.getFileID(Location);
+      Stack.push_back({SourceManager.getFileEntryForID(FileID), Clock::now()});
+    } else if (Reason == ExitFile && !Stack.empty()) {
+      stop();
+    }
+  }
+
+  /// Adds an edge from the including to the included file.
+  void InclusionDirective(clang::SourceLocation HashLocation,
+                          const clang::Token&,
+                          llvm::StringRef Filename,
+                          bool Angled,
+                          clang::CharSourceRange,
+                          const clang::FileEntry* File,
+                          llvm::StringRef,
+                          llvm::StringRef,
+                          const clang::Module*) override {
+    if (!File) return;
+
+    const auto FileID = SourceManager.getFileID(HashLocation);
+    const auto* Includer = SourceManager.getFileEntryForID(FileID);
+    if (!Includer) return;
+
+    // The included file gets a node even if its include guard skipped it.
+    Files[Includer].Includes.push_back(File);
+
+    // A quoted name may be relative to the including file, so it is only
+    // kept if it is bracketed.
+    auto& Included = Files[File];
+    if (Included.Spelling.empty() && Angled) {
+      Included.Spelling = ("<" + Filename + ">").str();
+    }
+  }
+
+  /// Stops the clock of the main file and merges the graph into the run's.
+  void EndOfMainFile() override {
+    while (!Stack.empty()) stop();
+
+    const auto* Main =
+        SourceManager.getFileEntryForID(SourceManager.getMainFileID());
+    if (Main) Files[Main];
+    Graph.merge(Files, Main, Directory);
+  }
+
+ private:
+  /// A file being preprocessed.
+  struct Frame {
+    /// The file, if the buffer has one.
+    const clang::FileEntry* Entry;
+
+    /// When the file was entered.
+    Clock::time_point Start;
+
+    /// The inclusive time of the files it included so far.
+    std::chrono::nanoseconds Children{0};
+  };
+
+  /// Stops the clock of the innermost file.
+  void stop() {
+    const auto& Innermost = Stack.back();
+    const auto Elapsed = Clock::now() - Innermost.Start;
+    if (Innermost.Entry) {
+      auto& File = Files[Innermost.Entry];
+      File.Time += Elapsed;
+      File.Exclusive += Elapsed - Innermost.Children;
+    }
+
+    Stack.pop_back();
+    if (!Stack.empty()) Stack.back().Children += Elapsed;
+  }
+
+  /// The `SourceManager` to map locations to files.
+  const clang::SourceManager& SourceManager;
+
+  /// The graph of the whole run.
+  IncludeGraph& Graph;
+
+  /// The directory of the compile command.
+  std::string Directory;
+
+  /// The graph of this translation unit.
+  IncludeGraph::Records Files;
+
+  /// The files being preprocessed, innermost last. Buffers without a file
+  /// (like the predefines) have no entry.
+  std::vector<Frame> Stack;
+};
+
+/// The action that records the include graph.
+class GraphAction : public clang::PreprocessOnlyAction {
+ public:
+  GraphAction(IncludeGraph& Graph, llvm::StringRef Directory)
+  : Graph(Graph), Directory(Directory) {}
+
+  /// Adds our preprocessor callback to the compiler instance.
+  bool BeginSourceFileAction(clang::CompilerInstance& Compiler,
+                             llvm::StringRef Filename) override {
+    auto Hooks = std::make_unique<GraphCallback>(
+        Compiler.getSourceManager(), Graph, Directory);
+    Compiler.getPreprocessor().addPPCallbacks(std::move(Hooks));
+    return true;
+  }
+
+ private:
+  /// The graph of the whole run.
+  IncludeGraph& Graph;
+
+  /// The directory of the compile command.
+  std::string Directory;
+};
+
+/// The formats the include graph can be written in.
+enum class GraphFormat { JSON, DOT };
+
+using ToolSupport::WriteJSONString;
+
+/// Writes the merged include graph, with the cost of every header.
+void WriteGraph(llvm::raw_ostream& Stream,
+                const IncludeGraph& Graph,
+                llvm::ArrayRef<IncludeGraph::Cost> Costs,
+                GraphFormat Format) {
+  using Milliseconds = std::chrono::duration<double, std::milli>;
+  const auto Nodes = Graph.getNodes();
+
+  if (Format == GraphFormat::DOT) {
+    Stream << "digraph includes {\n";
+    Stream << "  node [shape=box];\n";
+    for (const auto& Header : Costs) {
+      const auto& Entry = Nodes[Header.Node];
+      Stream << "  " << Header.Node << " [label=";
+      WriteJSONString(Stream,
+                      (llvm::sys::path::filename(Entry.Path) + "\nfan-in " +
+                       llvm::Twine(Entry.Includers.size()) + ", " +
+                       llvm::Twine(Header.TransitiveBytes) + " bytes, " +
+                       llvm::Twine(Header.TransitiveTokens) + " tokens")
+                          .str());
+      Stream << ", tooltip=";
+      WriteJSONString(Stream, Entry.Path);
+      Stream << "];\n";
+    }
+    for (unsigned Index = 0; Index < Nodes.size(); ++Index) {
+      if (Nodes[Index].MainFile == 0) continue;
+      Stream << "  " << Index << " [shape=ellipse, label=";
+      WriteJSONString(Stream, llvm::sys::path::filename(Nodes[Index].Path));
+      Stream << "];\n";
+    }
+    for (unsigned Index = 0; Index < Nodes.size(); ++Index) {
+      for (const auto Included : Nodes[Index].Includes) {
+        Stream << "  " << Index << " -> " << Included << ";\n";
+      }
+    }
+    Stream << "}\n";
+    return;
+  }
+
+  Stream << "{\n  \"translation_units\": " << Graph.getTranslationUnits()
+         << ",\n  \"headers\": [";
+  for (size_t Index = 0; Index < Costs.size(); ++Index) {
+    const auto& Header = Costs[Index];
+    const auto& Entry = Nodes[Header.Node];
+    Stream << (Index ? ",\n    {" : "\n    {") << "\"file\": ";
+    WriteJSONString(Stream, Entry.Path);
+    Stream << ", \"bytes\": " << Entry.Size << ", \"tokens\": " << Entry.Tokens
+           << ", \"fan_in\": " << Entry.Includers.size()
+           << ", \"inclusions\": " << Entry.Inclusions
+           << ", \"transitive_bytes\": " << Header.TransitiveBytes
+           << ", \"transitive_tokens\": " << Header.TransitiveTokens
+           << ", \"total_bytes\": " << Header.TotalBytes
+           << ", \"total_tokens\": " << Header.TotalTokens
+           << ", \"time_ms\": "
+           << llvm::format("%.3f", Milliseconds(Entry.Time).count())
+           << ", \"exclusive_time_ms\": "
+           << llvm::format("%.3f", Milliseconds(Entry.Exclusive).count())
+           << ", \"includes\": [";
+
+    bool First = true;
+    for (const auto Included : Entry.Includes) {
+      if (!First) Stream << ", ";
+      WriteJSONString(Stream, Nodes[Included].Path);
+      First = false;
+    }
+    Stream << "]}";
+  }
+  Stream << "\n  ]\n}\n";
+}
+
+/// Picks the headers to precompile: those included by at least the given
+/// share of translation units that take at least the given time to
+/// preprocess on average. A header that another chosen header already
+/// includes, directly or not, is left out, since it comes along anyway.
+///
+/// \returns The indices of the chosen nodes, in the order they were first
+/// seen.
+std::vector<unsigned>
+ChoosePrecompiled(const IncludeGraph& Graph,
+                  double Share,
+                  std::chrono::nanoseconds MinimumTime) {
+  const auto Nodes = Graph.getNodes();
+  const auto Required = Share * Graph.getTranslationUnits();
+
+  std::vector<bool> Candidate(Nodes.size(), false);
+  for (unsigned Index = 0; Index < Nodes.size(); ++Index) {
+    const auto& Entry = Nodes[Index];
+    if (Entry.Inclusions == 0 || Entry.Inclusions < Required) continue;
+    if (Entry.Time / Entry.Inclusions < MinimumTime) continue;
+    Candidate[Index] = true;
+  }
+
+  std::vector<bool> Covered(Nodes.size(), false);
+  std::vector<bool> Reached(Nodes.size(), false);
+  std::vector<unsigned> Stack;
+  for (unsigned Index = 0; Index < Nodes.size(); ++Index) {
+    // What a covered header includes comes along with the one covering it.
+    if (!Candidate[Index] || Covered[Index]) continue;
+
+    std::fill(Reached.begin(), Reached.end(), false);
+    Stack.assign(Nodes[Index].Includes.begin(), Nodes[Index].Includes.end());
+    while (!Stack.empty()) {
+      const auto Current = Stack.back();
+      Stack.pop_back();
+      if (Reached[Current] || Current == Index) continue;
+
+      Reached[Current] = true;
+      if (Candidate[Current]) Covered[Current] = true;
+      Stack.insert(Stack.end(),
+                   Nodes[Current].Includes.begin(),
+                   Nodes[Current].Includes.end());
+    }
+  }
+
+  std::vector<unsigned> Chosen;
+  for (unsigned Index = 0; Index < Nodes.size(); ++Index) {
+    if (Candidate[Index] && !Covered[Index]) Chosen.push_back(Index);
+  }
+
+  return Chosen;
+}
+
+/// Spells the absolute path relative to the absolute directory, going up
+/// with `..` where needed. Returns an empty string if they share no root.
+std::string MakeRelative(llvm::StringRef Path, llvm::StringRef Directory) {
+  if (llvm::sys::path::root_path(Path) !=
+      llvm::sys::path::root_path(Directory)) {
+    return {};
+  }
+
+  auto From = llvm::sys::path::begin(Directory);
+  const auto FromEnd = llvm::sys::path::end(Directory);
+  auto To = llvm::sys::path::begin(Path);
+  const auto ToEnd = llvm::sys::path::end(Path);
+  while (From != FromEnd && To != ToEnd && *From == *To) {
+    ++From;
+    ++To;
+  }
+
+  llvm::SmallString<256> Relative;
+  for (; From != FromEnd; ++From) llvm::sys::path::append(Relative, "..");
+  for (; To != ToEnd; ++To) llvm::sys::path::append(Relative, *To);
+
+  return Relative.str();
+}
+
+/// Writes a header that includes all chosen headers, to be precompiled.
+///
+/// Headers that were only ever included with quotes are named relative to
+/// the directory the header is written to, where quoted includes are looked
+/// up first, so that the header works on other machines and checkouts.
+///
+/// \param Directory The absolute directory the header is written to.
+void WritePrecompiledHeader(llvm::raw_ostream& Stream,
+                            const IncludeGraph& Graph,
+                            llvm::ArrayRef<unsigned> Chosen,
+                            llvm::StringRef Directory) {
+  const auto Nodes = Graph.getNodes();
+  Stream << "// Generated by include-sorter from "
+         << Graph.getTranslationUnits() << " translation units.\n";
+  Stream << "#pragma once\n\n";
+  for (const auto Index : Chosen) {
+    const auto& Entry = Nodes[Index];
+    if (!Entry.Spelling.empty()) {
+      Stream << "#include " << Entry.Spelling << '\n';
+      continue;
+    }
+
+    const auto Relative = MakeRelative(Entry.Path, Directory);
+    if (Relative.empty()) {
+      Stream << "// Skipped " << Entry.Path
+             << ", which has no path relative to this header.\n";
+    } else {
+      Stream << "#include \"" << Relative << "\"\n";
+    }
+  }
+}
+
+/// Prints what precompiling the chosen headers would save, assuming each
+/// translation unit that includes one would no longer preprocess it.
+///
+/// Two chosen headers that share an include both count its time, so the
+/// estimate is an upper bound.
+void PrintPrecompiledSavings(llvm::raw_ostream& Stream,
+                             const IncludeGraph& Graph,
+                             llvm::ArrayRef<unsigned> Chosen) {
+  using Milliseconds = std::chrono::duration<double, std::milli>;
+  const auto Nodes = Graph.getNodes();
+
+  std::chrono::nanoseconds Total{0};
+  for (const auto& Entry : Nodes) {
+    if (Entry.MainFile > 0) Total += Entry.Time;
+  }
+
+  Stream << "Inclusions   Average ms     Saved ms  Header\n";
+  std::chrono::nanoseconds Saved{0};
+  for (const auto Index : Chosen) {
+    const auto& Entry = Nodes[Index];
+    Saved += Entry.Time;
+    Stream << llvm::format("%10u %12.3f %12.3f  ",
+                           Entry.Inclusions,
+                           Milliseconds(Entry.Time).count() / Entry.Inclusions,
+                           Milliseconds(Entry.Time).count())
+           << Entry.Path << '\n';
+  }
+
+  const auto Percent =
+      Total.count() > 0 ? 100.0 * Saved.count() / Total.count() : 0.0;
+  Stream << "Precompiling " << Chosen.size()
+         << " headers would save an estimated "
+         << llvm::format("%.3f", Milliseconds(Saved).count()) << " of "
+         << llvm::format("%.3f", Milliseconds(Total).count())
+         << " ms of preprocessing ("
+         << llvm::format("%.1f", Percent) << "%)\n";
+}
+
+/// Prints the headers that took the longest to preprocess, summed over all
+/// translation units, with the time spent in each header itself.
+///
+/// The inclusive time is roughly what dropping every include of a header
+/// would save, while the exclusive time points at the headers worth slimming
+/// down themselves.
+///
+/// \param Top How many headers to print, or zero for all.
+void PrintHeaderProfile(llvm::raw_ostream& Stream,
+                        const IncludeGraph& Graph,
+                        unsigned Top) {
+  using Milliseconds = std::chrono::duration<double, std::milli>;
+  const auto Nodes = Graph.getNodes();
+
+  std::chrono::nanoseconds Total{0};
+  std::vector<unsigned> Headers;
+  for (unsigned Index = 0; Index < Nodes.size(); ++Index) {
+    if (Nodes[Index].MainFile > 0) Total += Nodes[Index].Time;
+    if (Nodes[Index].Inclusions > 0) Headers.push_back(Index);
+  }
+
+  std::sort(Headers.begin(), Headers.end(), [&](unsigned A, unsigned B) {
+    return Nodes[A].Time > Nodes[B].Time;
+  });
+  if (Top > 0 && Headers.size() > Top) Headers.resize(Top);
+
+  Stream << "Preprocessing " << Graph.getTranslationUnits()
+         << " translation units took "
+         << llvm::format("%.3f", Milliseconds(Total).count()) << " ms\n";
+  Stream << "Inclusions Inclusive ms Exclusive ms   Average ms  Header\n";
+  for (const auto Index : Headers) {
+    const auto& Entry = Nodes[Index];
+    Stream << llvm::format("%10u %12.3f %12.3f %12.3f  ",
+                           Entry.Inclusions,
+                           Milliseconds(Entry.Time).count(),
+                           Milliseconds(Entry.Exclusive).count(),
+                           Milliseconds(Entry.Time).count() / Entry.Inclusions)
+           << Entry.Path << '\n';
+  }
+}
+
+/// What the unused-include analysis learns about a translation unit.
+///
+/// Uses are recorded by the file they are written in (the user): the main
+/// file, and the project (non-system) headers if those are analyzed too.
+struct IncludeUsage {
+  using FileSet = llvm::DenseSet<const clang::FileEntry*>;
+
+  /// An include directive of a user.
+  struct Directive {
+    /// The location of the `#`.
+    clang::SourceLocation HashLocation;
+
+    /// The included file.
+    const clang::FileEntry* File;
+
+    /// The file name as written.
+    std::string Filename;
+
+    /// The whole line of the directive, with its newline.
+    clang::CharSourceRange Line;
+
+    /// Whether an `IWYU pragma: keep` comment asks to keep it anyway.
+    bool Keep;
+  };
+
+  /// The records a user only names through pointers and references, which a
+  /// forward declaration would do for, by the file defining them.
+  using DeclaredRecords =
+      llvm::DenseMap<const clang::FileEntry*,
+                     llvm::SmallVector<const clang::RecordDecl*, 4>>;
+
+  /// Whether project headers are users, besides the main file.
+  bool Headers = false;
+
+  /// The include directives of each user.
+  llvm::DenseMap<const clang::FileEntry*, std::vector<Directive>> Directives;
+
+  /// The files each file includes directly.
+  llvm::DenseMap<const clang::FileEntry*,
+                 llvm::SmallVector<const clang::FileEntry*, 8>>
+      Includes;
+
+  /// The files that declare or define something each user uses.
+  llvm::DenseMap<const clang::FileEntry*, FileSet> Used;
+
+  /// The names users look up in dependent types (like `T::value` or
+  /// `t.size()`), which only an instantiation resolves, with those users.
+  llvm::DenseMap<clang::DeclarationName,
+                 llvm::SmallVector<const clang::FileEntry*, 2>>
+      DependentNames;
+
+  /// The records each user only needs declared.
+  llvm::DenseMap<const clang::FileEntry*, DeclaredRecords> Declared;
+};
+
+namespace {
+/// Returns the user whose uses the location counts for, or null if the file
+/// it is in is not analyzed.
+const clang::FileEntry* GetUser(const clang::SourceManager& SourceManager,
+                                clang::SourceLocation Location,
+                                const IncludeUsage& Usage) {
+  if (Location.isInvalid()) return nullptr;
+
+  const auto Expansion = SourceManager.getExpansionLoc(Location);
+  if (!SourceManager.isInMainFile(Expansion) &&
+      (!Usage.Headers || SourceManager.isInSystemHeader(Expansion))) {
+    return nullptr;
+  }
+  return SourceManager.getFileEntryForID(SourceManager.getFileID(Expansion));
+}
+
+/// Marks the file that contains the location as used by the user, unless it
+/// is the user itself.
+void MarkUsed(const clang::SourceManager& SourceManager,
+              const clang::FileEntry* User,
+              clang::SourceLocation Location,
+              IncludeUsage& Usage) {
+  if (Location.isInvalid()) return;
+
+  const auto FileID = SourceManager.getFileID(
+      SourceManager.getExpansionLoc(Location));
+  const auto* Entry = SourceManager.getFileEntryForID(FileID);
+  if (Entry && Entry != User) Usage.Used[User].insert(Entry);
+}
+
+/// Marks the files that declare anything by one of the dependent names as
+/// used by the users of the name, in the context or any namespace or class
+/// within it. Which of them an instantiation finds is unknown, so all are
+/// kept.
+void MarkDependentNames(const clang::SourceManager& SourceManager,
+                        const clang::DeclContext& Context,
+                        IncludeUsage& Usage) {
+  for (const auto* Declaration : Context.decls()) {
+    const auto* Named = llvm::dyn_cast<clang::NamedDecl>(Declaration);
+    if (Named) {
+      const auto Users = Usage.DependentNames.find(Named->getDeclName());
+      if (Users != Usage.DependentNames.end()) {
+        for (const auto* User : Users->second) {
+          MarkUsed(SourceManager, User, Named->getLocation(), Usage);
+        }
+      }
+    }
+
+    if (const auto* Template =
+            llvm::dyn_cast<clang::ClassTemplateDecl>(Declaration)) {
+      Declaration = Template->getTemplatedDecl();
+    }
+
+    // Function bodies only hold local names.
+    if (llvm::isa<clang::NamespaceDecl>(Declaration) ||
+        llvm::isa<clang::LinkageSpecDecl>(Declaration) ||
+        llvm::isa<clang::RecordDecl>(Declaration) ||
+        llvm::isa<clang::EnumDecl>(Declaration)) {
+      MarkDependentNames(SourceManager,
+                         *llvm::cast<clang::DeclContext>(Declaration),
+                         Usage);
+    }
+  }
+}
+}  // namespace
+
+/// Records the include directives of a translation unit and the macros its
+/// main file uses.
+class UsageCallback : public clang::PPCallbacks {
+ public:
+  UsageCallback(const clang::SourceManager& SourceManager, IncludeUsage& Usage)
+  : SourceManager(SourceManager), Usage(Usage) {}
+
+  /// Records the edge and, for a user, the directive.
+  void InclusionDirective(clang::SourceLocation HashLocation,
+                          const clang::Token&,
+                          llvm::StringRef Filename,
+                          bool,
+                          clang::CharSourceRange Range,
+                          const clang::FileEntry* File,
+                          llvm::StringRef,
+                          llvm::StringRef,
+                          const clang::Module*) override {
+    if (!File) return;
+
+    const auto[FileID, Offset] = SourceManager.getDecomposedLoc(HashLocation);
+    if (const auto* Includer = SourceManager.getFileEntryForID(FileID)) {
+      Usage.Includes[Includer].push_back(File);
+    }
+
+    const auto* User = GetUser(SourceManager, HashLocation, Usage);
+    if (!User) return;
+
+    bool Invalid = false;
+    const auto Buffer = SourceManager.getBufferData(FileID, &Invalid);
+    if (Invalid) return;
+
+    const auto Start = Buffer.rfind('\n', Offset);
+    const auto Begin = (Start == llvm::StringRef::npos) ? 0 : Start + 1;
+    const auto NameEnd = SourceManager.getFileOffset(Range.getEnd());
+    const auto Newline = Buffer.find('\n', NameEnd);
+    const auto End =
+        (Newline == llvm::StringRef::npos) ? Buffer.size() : Newline + 1;
+
+    const auto FileStart = SourceManager.getLocForStartOfFile(FileID);
+    IncludeUsage::Directive Directive;
+    Directive.HashLocation = HashLocation;
+    Directive.File = File;
+    Directive.Filename = Filename;
+    Directive.Line =
+        clang::CharSourceRange::getCharRange(FileStart.getLocWithOffset(Begin),
+                                             FileStart.getLocWithOffset(End));
+    Directive.Keep = Buffer.slice(NameEnd, End).find("IWYU pragma: keep") !=
+                     llvm::StringRef::npos;
+    Usage.Directives[User].push_back(std::move(Directive));
+  }
+
+  void MacroExpands(const clang::Token&,
+                    const clang::MacroDefinition& Definition,
+                    clang::SourceRange Range,
+                    const clang::MacroArgs*) override {
+    useMacro(Range.getBegin(), Definition);
+  }
+
+  void Defined(const clang::Token& Name,
+               const clang::MacroDefinition& Definition,
+               clang::SourceRange) override {
+    useMacro(Name.getLocation(), Definition);
+  }
+
+  void Ifdef(clang::SourceLocation Location,
+             const clang::Token&,
+             const clang::MacroDefinition& Definition) override {
+    useMacro(Location, Definition);
+  }
+
+  void Ifndef(clang::SourceLocation Location,
+              const clang::Token&,
+              const clang::MacroDefinition& Definition) override {
+    useMacro(Location, Definition);
+  }
+
+ private:
+  /// Marks the file defining the macro as used, if a user uses it.
+  void useMacro(clang::SourceLocation Location,
+                const clang::MacroDefinition& Definition) {
+    const auto* Macro = Definition.getMacroInfo();
+    if (!Macro) return;
+    if (const auto* User = GetUser(SourceManager, Location, Usage)) {
+      MarkUsed(SourceManager, User, Macro->getDefinitionLoc(), Usage);
+    }
+  }
+
+  /// The `SourceManager` to map locations to files.
+  const clang::SourceManager& SourceManager;
+
+  /// Where to record what we find.
+  IncludeUsage& Usage;
+};
+
+/// Finds the declarations the code of a user refers to, and marks the files
+/// they are in as used by it.
+///
+/// Besides names, the types of all expressions count, so that a header that
+/// only completes a type (say, for a member access through a pointer) is
+/// kept. A record that is only named as the pointee of a pointer or reference
+/// type is recorded apart, since a forward declaration would do for it. Each
+/// declaration is only looked up once per user.
+class UsageVisitor : public clang::RecursiveASTVisitor<UsageVisitor> {
+ public:
+  using Base = clang::RecursiveASTVisitor<UsageVisitor>;
+
+  UsageVisitor(const clang::SourceManager& SourceManager, IncludeUsage& Usage)
+  : SourceManager(SourceManager), Usage(Usage) {}
+
+  /// Sets the user that the declarations traversed next are written in.
+  void setUser(const clang::FileEntry* NewUser) noexcept {
+    User = NewUser;
+  }
+
+  bool VisitDeclRefExpr(clang::DeclRefExpr* Reference) {
+    use(Reference->getDecl());
+    use(Reference->getFoundDecl());
+    return true;
+  }
+
+  bool VisitMemberExpr(clang::MemberExpr* Member) {
+    use(Member->getMemberDecl());
+    return true;
+  }
+
+  bool VisitCXXConstructExpr(clang::CXXConstructExpr* Construction) {
+    use(Construction->getConstructor());
+    return true;
+  }
+
+  /// A name whose overload only an instantiation resolves (like `swap(a, b)`
+  /// with dependent arguments, or `t.f()` in a template) uses every
+  /// candidate, since any of them may be the one called.
+  bool VisitOverloadExpr(clang::OverloadExpr* Overloads) {
+    for (const auto* Candidate : Overloads->decls()) {
+      use(Candidate);
+      use(Candidate->getUnderlyingDecl());
+    }
+    return true;
+  }
+
+  bool VisitDependentScopeDeclRefExpr(
+      clang::DependentScopeDeclRefExpr* Reference) {
+    useDependent(Reference->getDeclName());
+    return true;
+  }
+
+  bool VisitCXXDependentScopeMemberExpr(
+      clang::CXXDependentScopeMemberExpr* Member) {
+    useDependent(Member->getMember());
+    return true;
+  }
+
+  bool VisitExpr(clang::Expr* Expression) {
+    useType(Expression->getType());
+    return true;
+  }
+
+  bool VisitTypeLoc(clang::TypeLoc Location) {
+    useType(Location.getType());
+    if (const auto Specialization =
+            Location.getAs<clang::TemplateSpecializationTypeLoc>()) {
+      const auto Name = Specialization.getTypePtr()->getTemplateName();
+      use(Name.getAsTemplateDecl());
+    }
+    return true;
+  }
+
+  bool TraversePointerTypeLoc(clang::PointerTypeLoc Location) {
+    if (declare(Location.getPointeeLoc())) return true;
+    return Base::TraversePointerTypeLoc(Location);
+  }
+
+  bool TraverseLValueReferenceTypeLoc(
+      clang::LValueReferenceTypeLoc Location) {
+    if (declare(Location.getPointeeLoc())) return true;
+    return Base::TraverseLValueReferenceTypeLoc(Location);
+  }
+
+  bool TraverseRValueReferenceTypeLoc(
+      clang::RValueReferenceTypeLoc Location) {
+    if (declare(Location.getPointeeLoc())) return true;
+    return Base::TraverseRValueReferenceTypeLoc(Location);
+  }
+
+  bool VisitUsingDecl(clang::UsingDecl* Using) {
+    for (const auto* Shadow : Using->shadows()) use(Shadow->getTargetDecl());
+    return true;
+  }
+
+  /// A definition in the main file uses the header that declared it.
+  bool VisitDecl(clang::Decl* Declaration) {
+    use(Declaration->getPreviousDecl());
+    return true;
+  }
+
+ private:
+  /// Marks the file of the type's declaration as used. Tags count where they
+  /// are defined, since that is what completes them.
+  void useType(clang::QualType Type) {
+    if (Type.isNull()) return;
+    if (const auto* Typedef = Type->getAs<clang::TypedefType>()) {
+      use(Typedef->getDecl());
+    }
+    if (const auto* Tag = Type->getAsTagDecl()) {
+      use(Tag->getDefinition() ? Tag->getDefinition() : Tag);
+    }
+  }
+
+  /// Records the pointee as only needing a declaration, if it is a record
+  /// that can be forward declared.
+  ///
+  /// \returns False if the pointee must be traversed as a regular use.
+  bool declare(clang::TypeLoc Pointee) {
+    Pointee = Pointee.getUnqualifiedLoc();
+    if (const auto Elaborated = Pointee.getAs<clang::ElaboratedTypeLoc>()) {
+      Pointee = Elaborated.getNamedTypeLoc();
+    }
+
+    const auto Record = Pointee.getAs<clang::RecordTypeLoc>();
+    if (!Record || !CanForwardDeclare(*Record.getDecl())) return false;
+
+    const auto* Declaration = Record.getDecl();
+    const auto* Definition = Declaration->getDefinition();
+    if (!Definition) Definition = Declaration;
+    if (!Declared.insert({User, Definition}).second) return true;
+
+    const auto Location =
+        SourceManager.getExpansionLoc(Definition->getLocation());
+    const auto* Entry =
+        SourceManager.getFileEntryForID(SourceManager.getFileID(Location));
+    if (Entry && Entry != User) {
+      Usage.Declared[User][Entry].push_back(Definition);
+    }
+    return true;
+  }
+
+  /// Records that the user looks up the name in a dependent type.
+  void useDependent(clang::DeclarationName Name) {
+    auto& Users = Usage.DependentNames[Name];
+    if (std::find(Users.begin(), Users.end(), User) == Users.end()) {
+      Users.push_back(User);
+    }
+  }
+
+  /// Whether a forward declaration of the record at namespace scope would be
+  /// as good as its definition.
+  static bool CanForwardDeclare(const clang::RecordDecl& Record) {
+    if (!Record.getIdentifier()) return false;
+    if (!Record.getDeclContext()->isFileContext()) return false;
+    if (Record.isInAnonymousNamespace() || Record.isInStdNamespace()) {
+      return false;
+    }
+
+    // Templates would need their parameters spelled out.
+    if (const auto* Class = llvm::dyn_cast<clang::CXXRecordDecl>(&Record)) {
+      if (Class->getDescribedClassTemplate() ||
+          llvm::isa<clang::ClassTemplateSpecializationDecl>(Class)) {
+        return false;
+      }
+    }
+
+    return true;
+  }
+
+  /// Marks the file of the declaration as used.
+  void use(const clang::Decl* Declaration) {
+    if (!Declaration || !Seen.insert({User, Declaration}).second) return;
+
+    // Namespaces are reopened by many headers, so they say nothing.
+    if (llvm::isa<clang::NamespaceDecl>(Declaration)) return;
+
+    if (const auto* Specialization =
+            llvm::dyn_cast<clang::ClassTemplateSpecializationDecl>(
+                Declaration)) {
+      use(Specialization->getSpecializedTemplate());
+    }
+
+    MarkUsed(SourceManager, User, Declaration->getLocation(), Usage);
+  }
+
+  /// The `SourceManager` to map locations to files.
+  const clang::SourceManager& SourceManager;
+
+  /// Where to record what we find.
+  IncludeUsage& Usage;
+
+  /// The user the declarations being traversed are written in.
+  const clang::FileEntry* User = nullptr;
+
+  /// The declarations looked up so far, by user.
+  llvm::DenseSet<std::pair<const clang::FileEntry*, const clang::Decl*>> Seen;
+
+  /// The records recorded as only needing a declaration so far, by user.
+  llvm::DenseSet<std::pair<const clang::FileEntry*, const clang::RecordDecl*>>
+      Declared;
+};
+
+/// A forward declaration that could replace an include.
+struct ForwardDeclaration {
+  /// The absolute path of the file with the include.
+  std::string File;
+
+  /// The absolute path of the included file.
+  std::string Included;
+
+  /// The include directive, as written.
+  std::string Directive;
+
+  /// The forward declarations, one per line.
+  std::string Replacement;
+};
+
+/// Collects the forward declarations suggested by all translation units,
+/// along with their include graph to rank the suggestions by.
+class ForwardDeclarations {
+ public:
+  /// Adds the suggestion, unless one for the same include was added already
+  /// (as it is for a header by every translation unit including it).
+  void add(ForwardDeclaration Suggestion) {
+    const auto Key = Suggestion.File + '\0' + Suggestion.Included;
+    std::lock_guard<std::mutex> Lock(Mutex);
+    if (!Added.insert(Key).second) return;
+    Suggestions.push_back(std::move(Suggestion));
+  }
+
+  /// Prints the suggestions, ranked by the preprocessing time they would save
+  /// the run: the time the included file took on average, times the number
+  /// of translation units that include the file with the include. The tokens
+  /// the include brings in, times the same number, break ties. Must only be
+  /// called once no thread is adding anymore.
+  ///
+  /// The saving is an upper bound, since another include may still bring in
+  /// some of the same files.
+  void print(llvm::raw_ostream& Stream) {
+    using Milliseconds = std::chrono::duration<double, std::milli>;
+
+    llvm::StringMap<uint64_t> Tokens;
+    for (const auto& Header : Graph.analyze()) {
+      Tokens[Graph.getNodes()[Header.Node].Path] = Header.TransitiveTokens;
+    }
+
+    llvm::StringMap<const IncludeGraph::Node*> Nodes;
+    for (const auto& Entry : Graph.getNodes()) Nodes[Entry.Path] = &Entry;
+
+    struct Saving {
+      double Time;
+      uint64_t Tokens;
+      const ForwardDeclaration* Suggestion;
+    };
+
+    std::vector<Saving> Ranked;
+    for (const auto& Suggestion : Suggestions) {
+      const auto* File = Nodes.lookup(Suggestion.File);
+      const auto* Included = Nodes.lookup(Suggestion.Included);
+      const auto Dependents =
+          File ? std::max(File->Inclusions + File->MainFile, 1u) : 1u;
+
+      double Time = 0;
+      if (Included && Included->Entered > 0) {
+        Time = Milliseconds(Included->Time).count() / Included->Entered;
+      }
+
+      Ranked.push_back({Time * Dependents,
+                        Tokens.lookup(Suggestion.Included) * Dependents,
+                        &Suggestion});
+    }
+    std::sort(Ranked.begin(), Ranked.end(), [](const auto& A, const auto& B) {
+      return std::tie(B.Time, B.Tokens, A.Suggestion->File) <
+             std::tie(A.Time, A.Tokens, B.Suggestion->File);
+    });
+
+    for (const auto& Entry : Ranked) {
+      const auto* Suggestion = Entry.Suggestion;
+      Stream << llvm::format("%.3f", Entry.Time) << " ms, " << Entry.Tokens
+             << " tokens: " << Suggestion->File << ": replace "
+             << Suggestion->Directive << " with\n"
+             << Suggestion->Replacement;
+    }
+  }
+
+  /// The include graph of the run, which translation units record into.
+  IncludeGraph& getGraph() noexcept {
+    return Graph;
+  }
+
+ private:
+  /// The include graph of the run.
+  IncludeGraph Graph;
+
+  /// Guards the suggestions.
+  std::mutex Mutex;
+
+  /// The file and included file of each suggestion.
+  llvm::StringSet<> Added;
+
+  /// The suggestions of all translation units.
+  std::vector<ForwardDeclaration> Suggestions;
+};
+
+namespace {
+/// Spells out a forward declaration of the record, inside its namespaces.
+std::string GetForwardDeclaration(const clang::RecordDecl& Record) {
+  llvm::SmallVector<const clang::NamespaceDecl*, 4> Namespaces;
+  for (const auto* Context = Record.getDeclContext(); Context;
+       Context = Context->getParent()) {
+    if (const auto* Namespace = llvm::dyn_cast<clang::NamespaceDecl>(Context)) {
+      Namespaces.push_back(Namespace);
+    }
+  }
+
+  std::string Declaration;
+  for (auto Namespace = Namespaces.rbegin(); Namespace != Namespaces.rend();
+       ++Namespace) {
+    Declaration += "namespace " + (*Namespace)->getName().str() + " { ";
+  }
+  Declaration += Record.getKindName().str() + " " + Record.getName().str();
+  Declaration += ";";
+  for (size_t Index = 0; Index < Namespaces.size(); ++Index) {
+    Declaration += " }";
+  }
+
+  return Declaration;
+}
+}  // namespace
+
+/// Warns about every include of the main file that nothing in it uses, with a
+/// FixIt that removes it, and about every include that the main file only
+/// needs declarations of records from, with a FixIt that replaces it with
+/// forward declarations.
+///
+/// An include counts as used if the user uses anything from the header or
+/// from any file the header includes, directly or not. A file brought in by
+/// several includes thus keeps all of them, which errs on the side of keeping
+/// includes the build needs.
+///
+/// With suggestions, the includes of project headers are analyzed as well.
+/// Those are only suggested, since every translation unit including the
+/// header would warn about them. An include of a header is also kept if any
+/// other user needs the included file without including it itself, since it
+/// may get the file through the header.
+class UsageConsumer : public clang::ASTConsumer {
+ public:
+  /// Constructor.
+  ///
+  /// \param Compiler The compiler instance of the translation unit.
+  /// \param Usage What the callback and the visitor learn about it.
+  /// \param Unused Whether to warn about unused includes.
+  /// \param Suggestions Where to add forward declarations, if wanted.
+  /// \param Rewriter The rewriter to apply the FixIts with, if wanted.
+  /// \param Directory The directory of the compile command.
+  UsageConsumer(clang::CompilerInstance& Compiler,
+                IncludeUsage& Usage,
+                bool Unused,
+                ForwardDeclarations* Suggestions,
+                clang::Rewriter* Rewriter,
+                llvm::StringRef Directory)
+  : Compiler(Compiler)
+  , Usage(Usage)
+  , Unused(Unused)
+  , Suggestions(Suggestions)
+  , Rewriter(Rewriter)
+  , Directory(Directory) {}
+
+  void HandleTranslationUnit(clang::ASTContext& Context) override {
+    const auto& SourceManager = Context.getSourceManager();
+    const auto* Main =
+        SourceManager.getFileEntryForID(SourceManager.getMainFileID());
+    if (!Main) return;
+
+    UsageVisitor Visitor(SourceManager, Usage);
+    for (auto* Declaration : Context.getTranslationUnitDecl()->decls()) {
+      const auto* User =
+          GetUser(SourceManager, Declaration->getLocation(), Usage);
+      if (!User) continue;
+
+      Visitor.setUser(User);
+      Visitor.TraverseDecl(Declaration);
+    }
+
+    if (!Usage.DependentNames.empty()) {
+      MarkDependentNames(
+          SourceManager, *Context.getTranslationUnitDecl(), Usage);
+    }
+
+    for (const auto& Entry : Usage.Directives) {
+      const auto* User = Entry.first;
+
+      // Which includes reach a file is memoized, since headers share
+      // includes. Nothing is added to the maps from here on.
+      Memo ReachesUsed;
+      Memo ReachesDeclared;
+      const auto& Used = Usage.Used[User];
+      const auto& Declared = Usage.Declared[User];
+      for (const auto& Directive : Entry.second) {
+        if (Directive.Keep) continue;
+        if (reaches(Directive.File, Used, ReachesUsed)) continue;
+
+        // Other files may rely on what a header includes, so only unused
+        // includes of the main file are reported.
+        if (!reaches(Directive.File, Declared, ReachesDeclared)) {
+          if (Unused && User == Main) removeUnused(Directive);
+        } else if (Suggestions && (User == Main ||
+                                   !isNeededElsewhere(User, Directive.File))) {
+          forwardDeclare(User, Main, Declared, Directive);
+        }
+      }
+    }
+  }
+
+ private:
+  using Memo = llvm::DenseMap<const clang::FileEntry*, bool>;
+
+  /// Whether any user but the header uses the included file (or any file it
+  /// includes), without including it directly.
+  bool isNeededElsewhere(const clang::FileEntry* Header,
+                         const clang::FileEntry* Included) {
+    for (const auto& Entry : Usage.Used) {
+      if (Entry.first == Header) continue;
+
+      const auto Direct = Usage.Includes.find(Entry.first);
+      if (Direct != Usage.Includes.end() &&
+          std::find(Direct->second.begin(), Direct->second.end(), Included) !=
+              Direct->second.end()) {
+        continue;
+      }
+
+      if (reaches(Included, Entry.second, ReachesUsedBy[Entry.first])) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  /// Warns about the include and removes it if asked to.
+  void removeUnused(const IncludeUsage::Directive& Directive) {
+    auto& Diagnostics = Compiler.getDiagnostics();
+    const auto ID = Diagnostics.getCustomDiagID(
+        clang::DiagnosticsEngine::Warning, "'%0' is included but not used");
+
+    Diagnostics.Report(Directive.HashLocation, ID)
+        << Directive.Filename
+        << clang::FixItHint::CreateRemoval(Directive.Line);
+    if (Rewriter) Rewriter->RemoveText(Directive.Line);
+  }
+
+  /// Suggests replacing the include with forward declarations of the records
+  /// it brings in that the user only needs declared. For the main file, also
+  /// warns and does so if asked to.
+  void forwardDeclare(const clang::FileEntry* User,
+                      const clang::FileEntry* Main,
+                      const IncludeUsage::DeclaredRecords& Declared,
+                      const IncludeUsage::Directive& Directive) {
+    llvm::DenseSet<const clang::FileEntry*> Visited;
+    std::vector<std::string> Declarations;
+    collect(Directive.File, Declared, Visited, Declarations);
+    std::sort(Declarations.begin(), Declarations.end());
+    Declarations.erase(std::unique(Declarations.begin(), Declarations.end()),
+                       Declarations.end());
+
+    std::string Replacement;
+    for (const auto& Declaration : Declarations) {
+      Replacement += Declaration + "\n";
+    }
+
+    if (User == Main) {
+      auto& Diagnostics = Compiler.getDiagnostics();
+      const auto ID = Diagnostics.getCustomDiagID(
+          clang::DiagnosticsEngine::Warning,
+          "'%0' is only needed for pointers and references; forward declare "
+          "instead");
+      Diagnostics.Report(Directive.HashLocation, ID)
+          << Directive.Filename
+          << clang::FixItHint::CreateReplacement(Directive.Line, Replacement);
+      if (Rewriter) Rewriter->ReplaceText(Directive.Line, Replacement);
+    }
+
+    ForwardDeclaration Suggestion;
+    Suggestion.File = IncludeGraph::GetPath(*User, Directory);
+    Suggestion.Included = IncludeGraph::GetPath(*Directive.File, Directory);
+    Suggestion.Directive = Directive.Filename;
+    Suggestion.Replacement = std::move(Replacement);
+    Suggestions->add(std::move(Suggestion));
+  }
+
+  /// Adds the forward declarations of the records that the file, or any file
+  /// it includes, declares and the user only needs declared.
+  void collect(const clang::FileEntry* File,
+               const IncludeUsage::DeclaredRecords& Declared,
+               llvm::DenseSet<const clang::FileEntry*>& Visited,
+               std::vector<std::string>& Declarations) {
+    if (!Visited.insert(File).second) return;
+
+    for (const auto* Record : Declared.lookup(File)) {
+      Declarations.push_back(GetForwardDeclaration(*Record));
+    }
+    for (const auto* Included : Usage.Includes.lookup(File)) {
+      collect(Included, Declared, Visited, Declarations);
+    }
+  }
+
+  /// Whether the file or any file it includes, directly or not, is one of the
+  /// targets.
+  template <typename Targets>
+  bool reaches(const clang::FileEntry* File,
+               const Targets& Files,
+               Memo& Reaches) {
+    const auto Known = Reaches.find(File);
+    if (Known != Reaches.end()) return Known->second;
+
+    // Assume no while visiting, which also ends include cycles.
+    Reaches[File] = false;
+
+    bool Result = Files.count(File) > 0;
+    if (!Result) {
+      for (const auto* Included : Usage.Includes.lookup(File)) {
+        if (reaches(Included, Files, Reaches)) {
+          Result = true;
+          break;
+        }
+      }
+    }
+
+    Reaches[File] = Result;
+    return Result;
+  }
+
+  clang::CompilerInstance& Compiler;
+  IncludeUsage& Usage;
+  bool Unused;
+  ForwardDeclarations* Suggestions;
+  clang::Rewriter* Rewriter;
+  std::string Directory;
+
+  /// Which files reach something each user uses.
+  llvm::DenseMap<const clang::FileEntry*, Memo> ReachesUsedBy;
+};
+
+/// The action that finds unused includes and includes that forward
+/// declarations would do for, and fixes them in place if asked to.
+class UsageAction : public clang::ASTFrontendAction {
+ public:
+  using ASTConsumerPointer = std::unique_ptr<clang::ASTConsumer>;
+
+  /// Constructor.
+  ///
+  /// \param Mode Whether to fix the includes in place.
+  /// \param Unused Whether to warn about unused includes.
+  /// \param Suggestions Where to add forward declarations, if wanted.
+  /// \param Failed Set if the file could not be written.
+  /// \param Directory The directory of the compile command.
+  UsageAction(OutputMode Mode,
+              bool Unused,
+              ForwardDeclarations* Suggestions,
+              std::atomic<bool>& Failed,
+              llvm::StringRef Directory)
+  : Mode(Mode)
+  , Unused(Unused)
+  , Suggestions(Suggestions)
+  , Failed(Failed)
+  , Directory(Directory) {}
+
+  ASTConsumerPointer CreateASTConsumer(clang::CompilerInstance& Compiler,
+                                       llvm::StringRef) override {
+    auto& SourceManager = Compiler.getSourceManager();
+    Rewriter.setSourceMgr(SourceManager, Compiler.getLangOpts());
+
+    Usage.Headers = Suggestions != nullptr;
+    auto Hooks = std::make_unique<UsageCallback>(SourceManager, Usage);
+    Compiler.getPreprocessor().addPPCallbacks(std::move(Hooks));
+
+    // The graph ranks the suggestions by what they save.
+    if (Suggestions) {
+      Compiler.getPreprocessor().addPPCallbacks(
+          std::make_unique<GraphCallback>(
+              SourceManager, Suggestions->getGraph(), Directory));
+    }
+
+    const auto InPlace = Mode == OutputMode::InPlace;
+    return std::make_unique<UsageConsumer>(Compiler,
+                                           Usage,
+                                           Unused,
+                                           Suggestions,
+                                           InPlace ? &Rewriter : nullptr,
+                                           Directory);
+  }
+
+  /// Writes the file with its includes fixed, if any were.
+  void EndSourceFileAction() override {
+    if (Mode != OutputMode::InPlace) return;
+
+    const auto FileID = Rewriter.getSourceMgr().getMainFileID();
+    if (!Rewriter.getRewriteBufferFor(FileID)) return;
+    if (!WriteSorted(Rewriter, FileID, Mode)) Failed = true;
+  }
+
+ private:
+  /// What we learn about the translation unit.
+  IncludeUsage Usage;
+
+  /// The rewriter to remove includes with.
+  clang::Rewriter Rewriter;
+
+  /// Whether to fix includes in place.
+  OutputMode Mode;
+
+  /// Whether to warn about unused includes.
+  bool Unused;
+
+  /// Where to add forward declarations, if wanted.
+  ForwardDeclarations* Suggestions;
+
+  /// Set if the file could not be written.
+  std::atomic<bool>& Failed;
+
+  /// The directory of the compile command.
+  std::string Directory;
+};
+}  // namespace IncludeSorter
+
+namespace {
+llvm::cl::OptionCategory includeSorterCategory("minus-tool options");
+llvm::cl::extrahelp includeSorterCategoryHelp(R"(
+  Sorts your Includes alphabetically. With -graph, records the include graph
+  instead and reports what each header costs the build; -profile-headers
+  prints where preprocessing spends its time. With -unused or
+  -forward-declarations, finds the includes a file could do without.
+)");
+
+llvm::cl::opt<bool> ReverseOption("reverse",
+                                  llvm::cl::desc("Sort in reversed order"),
+                                  llvm::cl::cat(includeSorterCategory));
+llvm::cl::alias
+    ReverseShortOption("r",
+                       llvm::cl::desc("Alias for the -reverse option"),
+                       llvm::cl::aliasopt(ReverseOption));
+
+llvm::cl::list<std::string> CategoryOption(
+    "category",
+    llvm::cl::desc("Groups the includes a regular expression matches, with "
+                   "their quotes or brackets, under a priority: lower "
+                   "priorities go first, separated by an empty line. The first "
+                   "category that matches wins, includes none matches go last, "
+                   "and the main header goes first. May be repeated"),
+    llvm::cl::value_desc("priority:regex"),
+    llvm::cl::cat(includeSorterCategory));
+
+llvm::cl::opt<bool> LexerOnlyOption(
+    "lexer-only",
+    llvm::cl::desc("Find the includes by raw-lexing only the main files, "
+                   "without preprocessing them or opening any header. Much "
+                   "faster, and the compile flags do not matter"),
+    llvm::cl::cat(includeSorterCategory));
+
+llvm::cl::opt<bool> InPlaceOption(
+    "in-place",
+    llvm::cl::desc("Rewrite the files in place instead of printing them. "
+                   "Files whose includes are already sorted are left "
+                   "untouched"),
+    llvm::cl::cat(includeSorterCategory));
+llvm::cl::alias
+    InPlaceShortOption("i",
+                       llvm::cl::desc("Alias for the -in-place option"),
+                       llvm::cl::aliasopt(InPlaceOption));
+
+llvm::cl::opt<bool> CheckOption(
+    "check",
+    llvm::cl::desc("Instead of printing the files, print the name of every "
+                   "file whose includes are not sorted, and exit with a "
+                   "non-zero status if there is any. Implies -lexer-only"),
+    llvm::cl::cat(includeSorterCategory));
+
+llvm::cl::opt<bool> DiffOption(
+    "diff",
+    llvm::cl::desc("Instead of printing the files, print a unified diff of "
+                   "every file whose includes are not sorted. Implies "
+                   "-lexer-only"),
+    llvm::cl::cat(includeSorterCategory));
+
+llvm::cl::opt<std::string> GraphOption(
+    "graph",
+    llvm::cl::desc("Instead of sorting, record the include graph of every "
+                   "translation unit and write the merged graph to the file, "
+                   "with the fan-in, transitive size and preprocessing time of "
+                   "every header"),
+    llvm::cl::value_desc("filename"),
+    llvm::cl::cat(includeSorterCategory));
+
+llvm::cl::opt<IncludeSorter::GraphFormat> GraphFormatOption(
+    "graph-format",
+    llvm::cl::desc("The format of the -graph"),
+    llvm::cl::init(IncludeSorter::GraphFormat::JSON),
+    llvm::cl::values(clEnumValN(IncludeSorter::GraphFormat::JSON,
+                                "json",
+                                "Every header with its costs, most costly "
+                                "first"),
+                     clEnumValN(IncludeSorter::GraphFormat::DOT,
+                                "dot",
+                                "A graph for Graphviz")),
+    llvm::cl::cat(includeSorterCategory));
+
+llvm::cl::opt<std::string> PrecompiledOption(
+    "pch",
+    llvm::cl::desc("Instead of sorting, record the include graph and write a "
+                   "header to precompile to the file, with the headers most "
+                   "translation units spend much time on, and print the "
+                   "estimated savings"),
+    llvm::cl::value_desc("filename"),
+    llvm::cl::cat(includeSorterCategory));
+
+llvm::cl::opt<unsigned> PrecompiledShareOption(
+    "pch-share",
+    llvm::cl::init(50),
+    llvm::cl::desc("The percentage of translation units that must include a "
+                   "header for -pch to pick it"),
+    llvm::cl::cat(includeSorterCategory));
+
+llvm::cl::opt<unsigned> PrecompiledTimeOption(
+    "pch-min-time",
+    llvm::cl::init(5),
+    llvm::cl::desc("The average time in milliseconds a header (with what it "
+                   "includes) must take to preprocess for -pch to pick it"),
+    llvm::cl::cat(includeSorterCategory));
+
+llvm::cl::opt<bool> ProfileHeadersOption(
+    "profile-headers",
+    llvm::cl::desc("Instead of sorting, preprocess every translation unit "
+                   "and print the headers that took the longest, with the "
+                   "time spent in each header with and without what it "
+                   "includes, summed over all translation units"),
+    llvm::cl::cat(includeSorterCategory));
+
+llvm::cl::opt<unsigned> ProfileTopOption(
+    "profile-top",
+    llvm::cl::init(20),
+    llvm::cl::desc("The number of headers -profile-headers prints (0 for "
+                   "all)"),
+    llvm::cl::cat(includeSorterCategory));
+
+llvm::cl::opt<bool> UnusedOption(
+    "unused",
+    llvm::cl::desc("Instead of sorting, parse every file and warn about the "
+                   "includes it does not use anything from, with FixIts that "
+                   "remove them. With -i, the includes are removed"),
+    llvm::cl::cat(includeSorterCategory));
+
+llvm::cl::opt<bool> ForwardDeclarationsOption(
+    "forward-declarations",
+    llvm::cl::desc("Instead of sorting, parse every file and warn about the "
+                   "includes it only needs for pointers and references, with "
+                   "FixIts that replace them with forward declarations, then "
+                   "print the replacements for it and its project headers, "
+                   "ranked by the preprocessing time they would save the "
+                   "whole run. With -i, the includes of the files are "
+                   "replaced"),
+    llvm::cl::cat(includeSorterCategory));
+
+llvm::cl::opt<unsigned>
+    JobsOption("jobs",
+               llvm::cl::init(0),
+               llvm::cl::desc("The number of files to process in parallel "
+                              "with -i, -check, -diff, -graph, -pch, "
+                              "-profile-headers, -unused or "
+                              "-forward-declarations (0 for one per hardware "
+                              "thread)"),
+               llvm::cl::cat(includeSorterCategory));
+llvm::cl::alias JobsShortOption("j",
+                                llvm::cl::desc("Alias for the -jobs option"),
+                                llvm::cl::aliasopt(JobsOption));
+}  // namespace
+
+/// A custom `FrontendActionFactory` so that we can pass the options
+/// to the constructor of the tool.
+struct ToolFactory : public clang::tooling::FrontendActionFactory {
+  ToolFactory(IncludeSorter::IncludeCategories& Categories,
+              IncludeSorter::OutputMode Mode)
+  : Categories(Categories), Mode(Mode) {}
+
+  clang::FrontendAction* create() override {
+    return new IncludeSorter::Action(ReverseOption, Categories, Mode, Failed);
+  }
+
+  IncludeSorter::IncludeCategories& Categories;
+  IncludeSorter::OutputMode Mode;
+  std::atomic<bool> Failed{false};
+};
+
+/// Creates the actions that find unused includes and includes that forward
+/// declarations would do for.
+struct UsageFactory : public clang::tooling::FrontendActionFactory {
+  UsageFactory(IncludeSorter::OutputMode Mode,
+               IncludeSorter::ForwardDeclarations* Suggestions,
+               llvm::StringRef Directory)
+  : Mode(Mode), Suggestions(Suggestions), Directory(Directory) {}
+
+  clang::FrontendAction* create() override {
+    return new IncludeSorter::UsageAction(
+        Mode, UnusedOption, Suggestions, Failed, Directory);
+  }
+
+  IncludeSorter::OutputMode Mode;
+  IncludeSorter::ForwardDeclarations* Suggestions;
+  std::string Directory;
+  std::atomic<bool> Failed{false};
+};
+
+/// Creates the actions that record the include graph.
+struct GraphFactory : public clang::tooling::FrontendActionFactory {
+  GraphFactory(IncludeSorter::IncludeGraph& Graph, llvm::StringRef Directory)
+  : Graph(Graph), Directory(Directory) {}
+
+  clang::FrontendAction* create() override {
+    return new IncludeSorter::GraphAction(Graph, Directory);
+  }
+
+  IncludeSorter::IncludeGraph& Graph;
+  std::string Directory;
+};
+
+auto main(int argc, const char* argv[]) -> int {
+  using namespace clang::tooling;
+
+  CommonOptionsParser OptionsParser(
+      argc, argv, includeSorterCategory, llvm::cl::ZeroOrMore);
+
+  // Without any files, sort all of the compilation database.
+  const auto& Compilations = OptionsParser.getCompilations();
+  auto Sources = OptionsParser.getSourcePathList();
+  if (Sources.empty()) Sources = Compilations.getAllFiles();
+
+  if (!GraphOption.empty() || !PrecompiledOption.empty() ||
+      ProfileHeadersOption) {
+    IncludeSorter::IncludeGraph Graph;
+    const auto Status = ToolSupport::RunToolsInParallel(
+        Compilations,
+        Sources,
+        JobsOption,
+        [&Graph](ClangTool& Tool,
+                 const std::string&,
+                 const std::string& Directory) {
+          GraphFactory Factory(Graph, Directory);
+          return Tool.run(&Factory) == 0;
+        });
+
+    if (!GraphOption.empty()) {
+      std::error_code Error;
+      llvm::raw_fd_ostream Stream(GraphOption, Error, llvm::sys::fs::F_Text);
+      if (Error) {
+        llvm::errs() << "Error writing to: " << GraphOption << '\n';
+        return 1;
+      }
+
+      const auto Costs = Graph.analyze();
+      IncludeSorter::WriteGraph(Stream, Graph, Costs, GraphFormatOption);
+    }
+
+    if (!PrecompiledOption.empty()) {
+      std::error_code Error;
+      llvm::raw_fd_ostream Stream(
+          PrecompiledOption, Error, llvm::sys::fs::F_Text);
+      if (Error) {
+        llvm::errs() << "Error writing to: " << PrecompiledOption << '\n';
+        return 1;
+      }
+
+      llvm::SmallString<256> Directory(PrecompiledOption);
+      llvm::sys::fs::make_absolute(Directory);
+      llvm::sys::path::remove_dots(Directory, /*remove_dot_dot=*/true);
+      llvm::sys::path::remove_filename(Directory);
+
+      const auto Chosen = IncludeSorter::ChoosePrecompiled(
+          Graph,
+          PrecompiledShareOption / 100.0,
+          std::chrono::milliseconds(PrecompiledTimeOption));
+      IncludeSorter::WritePrecompiledHeader(Stream, Graph, Chosen, Directory);
+      IncludeSorter::PrintPrecompiledSavings(llvm::outs(), Graph, Chosen);
+    }
+
+    if (ProfileHeadersOption) {
+      IncludeSorter::PrintHeaderProfile(llvm::outs(), Graph, ProfileTopOption);
+    }
+
+    return Status;
+  }
+
+  if (InPlaceOption + CheckOption + DiffOption > 1) {
+    llvm::errs() << "Only one of -in-place, -check and -diff may be given\n";
+    return 1;
+  }
+
+  auto Mode = IncludeSorter::OutputMode::Print;
+  if (InPlaceOption) Mode = IncludeSorter::OutputMode::InPlace;
+  if (CheckOption) Mode = IncludeSorter::OutputMode::Check;
+  if (DiffOption) Mode = IncludeSorter::OutputMode::Diff;
+
+  if (UnusedOption || ForwardDeclarationsOption) {
+    IncludeSorter::ForwardDeclarations Suggestions;
+    auto* Wanted = ForwardDeclarationsOption ? &Suggestions : nullptr;
+    const auto Status = ToolSupport::RunToolsInParallel(
+        Compilations,
+        Sources,
+        JobsOption,
+        [Mode, Wanted](ClangTool& Tool,
+                       const std::string&,
+                       const std::string& Directory) {
+          UsageFactory Factory(Mode, Wanted, Directory);
+          return Tool.run(&Factory) == 0 && !Factory.Failed;
+        });
+
+    if (Wanted) Suggestions.print(llvm::outs());
+    return Status;
+  }
+
+  IncludeSorter::IncludeCategories Categories;
+  for (const auto& Rule : CategoryOption) {
+    std::string Error;
+    if (!Categories.add(Rule, Error)) {
+      llvm::errs() << "Invalid category '" << Rule << "': " << Error << '\n';
+      return 1;
+    }
+  }
+
+  // Printed files must not interleave, but checked or diffed ones are each
+  // printed at once.
+  const unsigned Jobs =
+      Mode == IncludeSorter::OutputMode::Print ? 1 : JobsOption;
+
+  // Checking and diffing are meant for whole code bases, so they take the
+  // fast path.
+  if (LexerOnlyOption || CheckOption || DiffOption) {
+    return ToolSupport::RunInParallel(
+        Sources, Jobs, [&Categories, Mode](const std::string& Source) {
+          IncludeSorter::LexerSorter Sorter(ReverseOption, Categories);
+          if (!Sorter.sort(Source)) return false;
+          return IncludeSorter::WriteSorted(
+              Sorter.getRewriter(), Sorter.getMainFileID(), Mode);
+        });
+  }
 
-  return Tool.run(new ToolFactory());
+  return ToolSupport::RunToolsInParallel(
+      Compilations,
+      Sources,
+      Jobs,
+      [&Categories, Mode](
+          ClangTool& Tool, const std::string&, const std::string&) {
+        ToolFactory Factory(Categories, Mode);
+        return Tool.run(&Factory) == 0 && !Factory.Failed;
+      });
 }
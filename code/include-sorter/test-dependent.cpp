@@ -0,0 +1,38 @@
+// Run with -unused: only <cmath> is unused. The others are only used by
+// templates, through names that an instantiation resolves.
+#include <cmath>
+#include <iterator>
+#include <string>
+#include <utility>
+#include <vector>
+
+template <class T>
+void Exchange(T& A, T& B) {
+  // Overload resolution waits for the instantiation (UnresolvedLookupExpr).
+  std::swap(A, B);
+}
+
+template <class T>
+typename T::size_type Length(const T& Container) {
+  // A member of a dependent type (CXXDependentScopeMemberExpr).
+  return Container.size();
+}
+
+template <class T>
+auto Position(const T& Container) {
+  // A name in a dependent scope (DependentScopeDeclRefExpr).
+  return std::distance(Container.begin(), Container.end()) + T::npos;
+}
+
+template <class T>
+struct Holder {
+  T Value;
+
+  // An unresolved member call (UnresolvedMemberExpr).
+  auto first() const { return Value.front(); }
+};
+
+int main() {
+  std::vector<int> Numbers;
+  return static_cast<int>(Holder<std::vector<int>>{Numbers}.Value.empty());
+}
@@ -1,70 +1,1945 @@
+// Tool includes
+#include "../common/tool-support.h"
+
 // Clang includes
 #include <clang/AST/ASTConsumer.h>
 #include <clang/AST/ASTContext.h>
+#include <clang/AST/ParentMap.h>
+#include <clang/AST/RecursiveASTVisitor.h>
 #include <clang/ASTMatchers/ASTMatchFinder.h>
 #include <clang/ASTMatchers/ASTMatchers.h>
 #include <clang/Analysis/CFG.h>
 #include <clang/Basic/Diagnostic.h>
 #include <clang/Basic/LangOptions.h>
+#include <clang/Basic/SourceManager.h>
+#include <clang/Basic/TokenKinds.h>
+#include <clang/Basic/Version.h>
 #include <clang/Frontend/CompilerInstance.h>
 #include <clang/Frontend/FrontendAction.h>
+#include <clang/Index/USRGeneration.h>
+#include <clang/Lex/Lexer.h>
+#include <clang/Lex/Token.h>
 #include <clang/Tooling/CommonOptionsParser.h>
 #include <clang/Tooling/Tooling.h>
 
-// LLVM includes
-#include <llvm/ADT/StringRef.h>
-#include <llvm/Support/CommandLine.h>
-#include <llvm/Support/raw_ostream.h>
+// LLVM includes
+#include <llvm/ADT/DenseSet.h>
+#include <llvm/ADT/ArrayRef.h>
+#include <llvm/ADT/DenseMap.h>
+#include <llvm/ADT/Optional.h>
+#include <llvm/ADT/STLExtras.h>
+#include <llvm/ADT/SmallString.h>
+#include <llvm/ADT/SmallVector.h>
+#include <llvm/ADT/StringExtras.h>
+#include <llvm/ADT/StringMap.h>
+#include <llvm/ADT/StringRef.h>
+#include <llvm/ADT/Twine.h>
+#include <llvm/Support/CommandLine.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/Format.h>
+#include <llvm/Support/MathExtras.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/Path.h>
+#include <llvm/Support/SourceMgr.h>
+#include <llvm/Support/YAMLParser.h>
+#include <llvm/Support/raw_ostream.h>
+
+// Standard includes
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <system_error>
+#include <tuple>
+#include <vector>
+
+namespace McCabe {
+
+/// The ways to compute the cyclomatic complexity of a function.
+enum class Engine {
+  /// Count the nodes and edges of the function's control flow graph.
+  CFG,
+
+  /// Count the decision points in a single walk over the function's AST.
+  AST,
+
+  /// Use both engines, warn where they disagree and time each of them.
+  Both,
+};
+
+/// Counts the decision points of a function body, which is one less than its
+/// cyclomatic complexity.
+///
+/// Every `if`, loop, `case`, `&&`, `||`, `?:` and `catch` adds one path through
+/// the function. Lambdas, blocks and local classes are skipped, since the CFG
+/// of the enclosing function does not contain their bodies either.
+class DecisionCounter : public clang::RecursiveASTVisitor<DecisionCounter> {
+ public:
+  using Base = clang::RecursiveASTVisitor<DecisionCounter>;
+
+  unsigned getDecisions() const noexcept {
+    return Decisions;
+  }
+
+  bool VisitIfStmt(clang::IfStmt*) {
+    return count();
+  }
+
+  bool VisitForStmt(clang::ForStmt*) {
+    return count();
+  }
+
+  bool VisitCXXForRangeStmt(clang::CXXForRangeStmt*) {
+    return count();
+  }
+
+  bool VisitWhileStmt(clang::WhileStmt*) {
+    return count();
+  }
+
+  bool VisitDoStmt(clang::DoStmt*) {
+    return count();
+  }
+
+  bool VisitCaseStmt(clang::CaseStmt*) {
+    return count();
+  }
+
+  bool VisitCXXCatchStmt(clang::CXXCatchStmt* Handler) {
+    // Like `default` in a switch, `catch (...)` adds no path of its own.
+    if (Handler->getExceptionDecl()) count();
+    return true;
+  }
+
+  bool VisitAbstractConditionalOperator(clang::AbstractConditionalOperator*) {
+    return count();
+  }
+
+  bool VisitBinaryOperator(clang::BinaryOperator* Operator) {
+    if (Operator->isLogicalOp()) count();
+    return true;
+  }
+
+  bool TraverseLambdaExpr(clang::LambdaExpr*) {
+    return true;
+  }
+
+  bool TraverseBlockExpr(clang::BlockExpr*) {
+    return true;
+  }
+
+  bool TraverseDecl(clang::Decl* Declaration) {
+    if (Declaration && llvm::isa<clang::TagDecl>(Declaration)) return true;
+    return Base::TraverseDecl(Declaration);
+  }
+
+ private:
+  bool count() {
+    ++Decisions;
+    return true;
+  }
+
+  unsigned Decisions = 0;
+};
+
+/// Everything we measure about a function.
+struct Metrics {
+  /// The McCabe (cyclomatic) complexity.
+  unsigned Cyclomatic = 0;
+
+  /// The number of acyclic paths from entry to exit, saturating.
+  uint64_t NPath = 0;
+
+  /// The depth of the most deeply nested control structure.
+  unsigned MaximumNesting = 0;
+
+  /// The cognitive complexity, as defined by SonarSource.
+  unsigned Cognitive = 0;
+
+  /// The number of basic blocks, without entry and exit.
+  unsigned Blocks = 0;
+
+  /// The number of statements in all basic blocks.
+  unsigned Statements = 0;
+};
+
+/// The values above which we warn about a function. Zero disables a metric,
+/// except for the cyclomatic complexity.
+struct Thresholds {
+  unsigned Cyclomatic = 0;
+  uint64_t NPath = 0;
+  unsigned MaximumNesting = 0;
+  unsigned Cognitive = 0;
+  unsigned Blocks = 0;
+  unsigned Statements = 0;
+
+  /// Whether any metric other than the cyclomatic complexity is checked.
+  bool needCFG() const noexcept {
+    return NPath || MaximumNesting || Cognitive || Blocks || Statements;
+  }
+};
+
+/// What we report about one function.
+struct Row {
+  /// The qualified name of the function.
+  std::string Name;
+
+  /// The absolute path of the file the function is defined in.
+  std::string File;
+
+  /// The line the function's name is on.
+  unsigned Line = 0;
+
+  /// The number of lines the body spans.
+  unsigned BodyLines = 0;
+
+  /// The metrics. Only the cyclomatic complexity is set by the AST engine.
+  Metrics Measured;
+
+  /// The Unified Symbol Resolution of the function, which identifies it
+  /// across runs.
+  std::string USR;
+
+  /// The absolute path of the main file of the translation unit that
+  /// analyzed the function.
+  std::string Unit;
+};
+
+/// What a translation unit was computed from, to tell whether it changed.
+struct Unit {
+  /// The absolute path of the main file.
+  std::string File;
+
+  /// A hash of the compile commands of the main file.
+  uint64_t Command = 0;
+
+  /// The absolute path and content hash of each file the preprocessor read.
+  std::vector<std::pair<std::string, uint64_t>> Inputs;
+};
+
+/// Collects a row per function from all worker threads.
+///
+/// Each thread appends to its own buffer, so adding a row never contends with
+/// other threads. The buffers are merged once all workers have finished.
+class RowCollector {
+ public:
+  void add(Row NewRow) {
+    Buffers.getLocal().push_back(std::move(NewRow));
+  }
+
+  /// Records a translation unit. Happens once per file, so a lock is fine.
+  void addUnit(Unit NewUnit) {
+    std::lock_guard<std::mutex> Lock(Mutex);
+    Units.push_back(std::move(NewUnit));
+  }
+
+  /// Returns the translation units, sorted by file. Must only be called once
+  /// no thread is adding units anymore.
+  std::vector<Unit> takeUnits() {
+    std::sort(Units.begin(), Units.end(), [](const Unit& A, const Unit& B) {
+      return A.File < B.File;
+    });
+    return std::move(Units);
+  }
+
+  /// Merges the rows of all threads, sorted by file, line and name. Functions
+  /// analyzed by more than one translation unit (like inline functions in
+  /// headers, or files compiled more than once) appear only once. Must only be
+  /// called once no thread is adding rows anymore.
+  std::vector<Row> merge() {
+    size_t Total = 0;
+    for (const auto& Buffer : Buffers.getAll()) Total += Buffer->size();
+
+    std::vector<Row> Merged;
+    Merged.reserve(Total);
+    for (auto& Buffer : Buffers.getAll()) {
+      std::move(Buffer->begin(), Buffer->end(), std::back_inserter(Merged));
+      Buffer->clear();
+    }
+
+    const auto Key = [](const Row& Entry) {
+      return std::tie(Entry.File, Entry.Line, Entry.Name);
+    };
+    std::sort(Merged.begin(), Merged.end(), [&Key](const Row& A, const Row& B) {
+      return Key(A) < Key(B);
+    });
+    Merged.erase(std::unique(Merged.begin(),
+                             Merged.end(),
+                             [&Key](const Row& A, const Row& B) {
+                               return Key(A) == Key(B);
+                             }),
+                 Merged.end());
+
+    return Merged;
+  }
+
+ private:
+  /// Guards the units.
+  std::mutex Mutex;
+
+  /// The rows of each thread.
+  ToolSupport::PerThread<std::vector<Row>> Buffers;
+
+  /// The translation units the rows came from.
+  std::vector<Unit> Units;
+};
+
+using ToolSupport::StableHash;
+using ToolSupport::StoreAtomically;
+using ToolSupport::WriteJSONString;
+
+/// Remembers the metrics of function bodies across runs.
+///
+/// Functions are keyed by a hash of the tokens of their body (see
+/// `hashBody`), so that a function is only analyzed again once its code
+/// changes, no matter where it moves. The cache is a text file with one line
+/// per body, which is read once at startup. Lookups only read the loaded map,
+/// and new entries and hits go into per-thread buffers, so workers never
+/// contend. The file is rewritten at the end of the run, without the entries
+/// no run has used for `MaximumAge` runs, so that it does not keep growing
+/// with every version of every body.
+class MetricsCache {
+ public:
+  /// Loads the cache from the file. A missing or outdated file (e.g. one
+  /// written by a different version of clang) yields an empty cache.
+  explicit MetricsCache(std::string Path) : Path(std::move(Path)) {
+    auto Buffer = llvm::MemoryBuffer::getFile(this->Path);
+    if (!Buffer) return;
+
+    llvm::SmallVector<llvm::StringRef, 8> Lines;
+    (*Buffer)->getBuffer().split(Lines, '\n', -1, /*KeepEmpty=*/false);
+    if (Lines.empty() || Lines.front() != getHeader()) return;
+
+    llvm::SmallVector<llvm::StringRef, 8> Fields;
+    for (const auto Line : llvm::makeArrayRef(Lines).drop_front()) {
+      Fields.clear();
+      Line.split(Fields, ' ');
+      if (Fields.size() != 8) continue;
+
+      uint64_t Key;
+      Entry Loaded;
+      auto& Cached = Loaded.Cached;
+      if (Fields[0].getAsInteger(16, Key) ||
+          Fields[1].getAsInteger(10, Cached.Cyclomatic) ||
+          Fields[2].getAsInteger(10, Cached.NPath) ||
+          Fields[3].getAsInteger(10, Cached.MaximumNesting) ||
+          Fields[4].getAsInteger(10, Cached.Cognitive) ||
+          Fields[5].getAsInteger(10, Cached.Blocks) ||
+          Fields[6].getAsInteger(10, Cached.Statements) ||
+          Fields[7].getAsInteger(10, Loaded.Age)) {
+        continue;
+      }
+
+      Entries[Key] = Loaded;
+    }
+  }
+
+  /// Returns the cached metrics for the body, if any.
+  llvm::Optional<Metrics> lookup(uint64_t Key) {
+    const auto Iterator = Entries.find(Key);
+    if (Iterator == Entries.end()) {
+      Misses += 1;
+      return llvm::None;
+    }
+
+    Hits += 1;
+    Buffers.getLocal().Used.push_back(Key);
+    return Iterator->second.Cached;
+  }
+
+  /// Remembers the metrics for the body, for the next run.
+  void insert(uint64_t Key, const Metrics& Measured) {
+    Buffers.getLocal().Inserted.emplace_back(Key, Measured);
+  }
+
+  /// Writes the entries used or added by this run and the recently used old
+  /// ones back to the file. Must only be called once no thread is looking up
+  /// or inserting anymore.
+  bool save() {
+    for (auto& Known : Entries) Known.second.Age += 1;
+    for (auto& Buffer : Buffers.getAll()) {
+      for (const auto Key : Buffer->Used) Entries[Key].Age = 0;
+      for (const auto& Inserted : Buffer->Inserted) {
+        Entries[Inserted.first] = Entry{Inserted.second, 0};
+      }
+      Buffer->Used.clear();
+      Buffer->Inserted.clear();
+    }
+
+    std::string Data;
+    llvm::raw_string_ostream Stream(Data);
+    Stream << getHeader() << '\n';
+    for (const auto& Known : Entries) {
+      if (Known.second.Age > MaximumAge) continue;
+
+      const auto& Cached = Known.second.Cached;
+      Stream << llvm::utohexstr(Known.first) << ' ' << Cached.Cyclomatic << ' '
+             << Cached.NPath << ' ' << Cached.MaximumNesting << ' '
+             << Cached.Cognitive << ' ' << Cached.Blocks << ' '
+             << Cached.Statements << ' ' << Known.second.Age << '\n';
+    }
+
+    return StoreAtomically(Path, Stream.str());
+  }
+
+  /// How many lookups found an entry.
+  unsigned getHits() const noexcept {
+    return Hits;
+  }
+
+  /// How many lookups found nothing.
+  unsigned getMisses() const noexcept {
+    return Misses;
+  }
+
+  /// Hashes the tokens of the function's body, ignoring whitespace and
+  /// comments.
+  ///
+  /// The tokens are taken as written, so a body that uses a macro could keep
+  /// its key while the definition of the macro changes. Such bodies are not
+  /// cached at all; any identifier that was ever defined as a macro in the
+  /// translation unit counts as a use.
+  ///
+  /// \param Seed Distinguishes bodies analyzed in different ways or compiled
+  /// with different flags.
+  /// \returns None if the body is not written out in a single file, like one
+  /// expanded from a macro, or uses a macro.
+  static llvm::Optional<uint64_t> hashBody(const clang::Stmt& Body,
+                                           const clang::SourceManager& Sources,
+                                           const clang::ASTContext& Context,
+                                           llvm::StringRef Seed) {
+    const auto Begin = Body.getLocStart();
+    const auto End = Body.getLocEnd();
+    if (Begin.isMacroID() || End.isMacroID()) return llvm::None;
+
+    const auto First = Sources.getDecomposedLoc(Begin);
+    const auto Last = Sources.getDecomposedLoc(End);
+    if (First.first != Last.first) return llvm::None;
+
+    bool Invalid = false;
+    const auto Buffer = Sources.getBufferData(First.first, &Invalid);
+    if (Invalid) return llvm::None;
+
+    clang::Lexer Lexer(Sources.getLocForStartOfFile(First.first),
+                       Context.getLangOpts(),
+                       Buffer.begin(),
+                       Buffer.begin() + First.second,
+                       Buffer.end());
+
+    auto Hash = StableHash(Seed);
+    clang::Token Token;
+    do {
+      Lexer.LexFromRawLexer(Token);
+
+      // Every identifier of the body was seen by the preprocessor, so this
+      // finds the existing entry rather than adding one.
+      if (Token.is(clang::tok::raw_identifier) &&
+          Context.Idents.get(Token.getRawIdentifier()).hadMacroDefinition()) {
+        return llvm::None;
+      }
+
+      const auto Offset = Sources.getFileOffset(Token.getLocation());
+      Hash = StableHash(Buffer.substr(Offset, Token.getLength()), Hash);
+      Hash = StableHash(" ", Hash);
+      if (Offset >= Last.second) break;
+    } while (Token.isNot(clang::tok::eof));
+
+    // The DenseMap reserves the two largest keys.
+    return Hash >> 1;
+  }
+
+ private:
+  /// How many runs in a row may not use an entry before it is dropped.
+  static constexpr unsigned MaximumAge = 16;
+
+  /// The metrics of a body.
+  struct Entry {
+    Metrics Cached;
+
+    /// How many runs in a row did not use the entry.
+    unsigned Age = 0;
+  };
+
+  /// What a thread did with the cache.
+  struct Changes {
+    /// The keys of the entries it found.
+    std::vector<uint64_t> Used;
+
+    /// The entries it added.
+    std::vector<std::pair<uint64_t, Metrics>> Inserted;
+  };
+
+  /// The first line of the file, which must match for the file to be used.
+  static std::string getHeader() {
+    return "mccabe-cache 2 " + clang::getClangFullVersion();
+  }
+
+  /// The file the cache is stored in.
+  std::string Path;
+
+  /// The entries loaded from the file.
+  llvm::DenseMap<uint64_t, Entry> Entries;
+
+  /// The changes of each thread.
+  ToolSupport::PerThread<Changes> Buffers;
+
+  /// Lookup statistics.
+  std::atomic<unsigned> Hits{0};
+  std::atomic<unsigned> Misses{0};
+};
+
+constexpr unsigned MetricsCache::MaximumAge;
+
+namespace {
+/// Returns the value of a scalar node, or an empty string for other nodes.
+llvm::StringRef GetScalar(llvm::yaml::Node* Node,
+                          llvm::SmallVectorImpl<char>& Storage) {
+  const auto* Scalar = llvm::dyn_cast_or_null<llvm::yaml::ScalarNode>(Node);
+  return Scalar ? Scalar->getValue(Storage) : llvm::StringRef();
+}
+
+/// Reads a function of a JSON report.
+Row ParseRow(llvm::yaml::MappingNode& Object) {
+  Row Parsed;
+  for (auto& Field : Object) {
+    llvm::SmallString<16> KeyStorage;
+    llvm::SmallString<128> ValueStorage;
+    const auto Key = GetScalar(Field.getKey(), KeyStorage);
+    const auto Value = GetScalar(Field.getValue(), ValueStorage);
+
+    if (Key == "name") {
+      Parsed.Name = Value;
+    } else if (Key == "file") {
+      Parsed.File = Value;
+    } else if (Key == "usr") {
+      Parsed.USR = Value;
+    } else if (Key == "unit") {
+      Parsed.Unit = Value;
+    } else if (Key == "line") {
+      Value.getAsInteger(10, Parsed.Line);
+    } else if (Key == "body_lines") {
+      Value.getAsInteger(10, Parsed.BodyLines);
+    } else if (Key == "cyclomatic") {
+      Value.getAsInteger(10, Parsed.Measured.Cyclomatic);
+    } else if (Key == "npath") {
+      Value.getAsInteger(10, Parsed.Measured.NPath);
+    } else if (Key == "nesting") {
+      Value.getAsInteger(10, Parsed.Measured.MaximumNesting);
+    } else if (Key == "cognitive") {
+      Value.getAsInteger(10, Parsed.Measured.Cognitive);
+    } else if (Key == "blocks") {
+      Value.getAsInteger(10, Parsed.Measured.Blocks);
+    } else if (Key == "statements") {
+      Value.getAsInteger(10, Parsed.Measured.Statements);
+    }
+  }
+  return Parsed;
+}
+
+/// Reads a translation unit of a JSON report.
+Unit ParseUnit(llvm::yaml::MappingNode& Object) {
+  Unit Parsed;
+  for (auto& Field : Object) {
+    llvm::SmallString<16> KeyStorage;
+    const auto Key = GetScalar(Field.getKey(), KeyStorage);
+
+    llvm::SmallString<128> ValueStorage;
+    if (Key == "file") {
+      Parsed.File = GetScalar(Field.getValue(), ValueStorage);
+    } else if (Key == "command") {
+      GetScalar(Field.getValue(), ValueStorage)
+          .getAsInteger(16, Parsed.Command);
+    } else if (Key == "inputs") {
+      auto* Inputs =
+          llvm::dyn_cast_or_null<llvm::yaml::SequenceNode>(Field.getValue());
+      if (!Inputs) continue;
+
+      for (auto& Item : *Inputs) {
+        auto* InputObject = llvm::dyn_cast<llvm::yaml::MappingNode>(&Item);
+        if (!InputObject) continue;
+
+        std::pair<std::string, uint64_t> Input{};
+        for (auto& InputField : *InputObject) {
+          llvm::SmallString<16> InputKeyStorage;
+          llvm::SmallString<128> InputValueStorage;
+          const auto InputKey = GetScalar(InputField.getKey(), InputKeyStorage);
+          const auto InputValue =
+              GetScalar(InputField.getValue(), InputValueStorage);
+          if (InputKey == "file") {
+            Input.first = InputValue;
+          } else if (InputKey == "hash") {
+            InputValue.getAsInteger(16, Input.second);
+          }
+        }
+        Parsed.Inputs.push_back(std::move(Input));
+      }
+    }
+  }
+  return Parsed;
+}
+}  // namespace
+
+/// A report of a previous run, to compare the current one against.
+///
+/// Functions are matched by USR, so that they are found again after moving.
+/// The report also lists every file each translation unit read, with a hash
+/// of its contents. A translation unit whose compile command and inputs are
+/// all unchanged cannot contain a regression, so it is not parsed at all, and
+/// its rows are carried over from the baseline.
+class BaselineReport {
+ public:
+  /// Loads a report written with -report-format=json.
+  ///
+  /// \returns Null (after printing an error) if the file could not be read.
+  static std::unique_ptr<BaselineReport> load(llvm::StringRef Path) {
+    auto Buffer = llvm::MemoryBuffer::getFile(Path);
+    if (!Buffer) {
+      llvm::errs() << "Could not read " << Path << '\n';
+      return nullptr;
+    }
+
+    llvm::SourceMgr Sources;
+    llvm::yaml::Stream Stream((*Buffer)->getBuffer(), Sources);
+    auto Document = Stream.begin();
+    auto* Root =
+        (Document == Stream.end())
+            ? nullptr
+            : llvm::dyn_cast_or_null<llvm::yaml::MappingNode>(
+                  Document->getRoot());
+    if (!Root) {
+      llvm::errs() << Path << " is not a JSON report\n";
+      return nullptr;
+    }
+
+    auto Baseline = std::make_unique<BaselineReport>();
+    for (auto& Entry : *Root) {
+      llvm::SmallString<16> KeyStorage;
+      const auto Key = GetScalar(Entry.getKey(), KeyStorage);
+      auto* Items =
+          llvm::dyn_cast_or_null<llvm::yaml::SequenceNode>(Entry.getValue());
+      if (!Items) continue;
+
+      for (auto& Item : *Items) {
+        auto* Object = llvm::dyn_cast<llvm::yaml::MappingNode>(&Item);
+        if (!Object) continue;
+        if (Key == "functions") {
+          Baseline->Rows.push_back(ParseRow(*Object));
+        } else if (Key == "units") {
+          auto Parsed = ParseUnit(*Object);
+          const auto File = Parsed.File;
+          Baseline->Units[File] = std::move(Parsed);
+        }
+      }
+    }
+
+    if (Stream.failed()) {
+      llvm::errs() << Path << " is not a JSON report\n";
+      return nullptr;
+    }
+
+    // Group the rows by unit, so that a skipped unit can take its rows along.
+    auto& Rows = Baseline->Rows;
+    std::stable_sort(Rows.begin(), Rows.end(), [](const Row& A, const Row& B) {
+      return A.Unit < B.Unit;
+    });
+    for (size_t Index = 0; Index < Rows.size(); ++Index) {
+      if (!Rows[Index].USR.empty()) Baseline->ByUSR[Rows[Index].USR] = Index;
+
+      auto& Range = Baseline->RowsByUnit[Rows[Index].Unit];
+      if (Range.second == 0) Range.first = Index;
+      Range.second += 1;
+    }
+
+    return Baseline;
+  }
+
+  /// Returns the metrics the function had in the baseline, or null if it is
+  /// new.
+  const Metrics* lookup(llvm::StringRef USR) const {
+    const auto Iterator = ByUSR.find(USR);
+    if (Iterator == ByUSR.end()) return nullptr;
+    return &Rows[Iterator->second].Measured;
+  }
+
+  /// Returns the baseline's record of the translation unit if neither its
+  /// compile command nor any file it read has changed since, else null.
+  const Unit* findUnchanged(llvm::StringRef File, uint64_t Command) {
+    const auto Iterator = Units.find(File);
+    if (Iterator == Units.end()) return nullptr;
+
+    const auto& Previous = Iterator->second;
+    if (Previous.Command != Command) return nullptr;
+    for (const auto& Input : Previous.Inputs) {
+      const auto Hash = hashFile(Input.first);
+      if (!Hash || *Hash != Input.second) return nullptr;
+    }
+
+    return &Previous;
+  }
+
+  /// Returns the rows the translation unit produced in the baseline.
+  llvm::ArrayRef<Row> getRows(llvm::StringRef File) const {
+    const auto Iterator = RowsByUnit.find(File);
+    if (Iterator == RowsByUnit.end()) return {};
+
+    const auto& Range = Iterator->second;
+    return llvm::makeArrayRef(Rows).slice(Range.first, Range.second);
+  }
+
+  /// Notes that a warning about a new or regressed function was emitted.
+  void addRegression() {
+    Regressions += 1;
+  }
+
+  /// The number of warnings about new or regressed functions.
+  unsigned getRegressions() const noexcept {
+    return Regressions;
+  }
+
+ private:
+  /// Hashes the current contents of the file, once per run. Many translation
+  /// units share their headers, so this is memoized.
+  llvm::Optional<uint64_t> hashFile(const std::string& Path) {
+    {
+      std::lock_guard<std::mutex> Lock(Mutex);
+      const auto Iterator = FileHashes.find(Path);
+      if (Iterator != FileHashes.end()) return Iterator->second;
+    }
+
+    llvm::Optional<uint64_t> Hash;
+    auto Buffer = llvm::MemoryBuffer::getFile(Path,
+                                              /*FileSize=*/-1,
+                                              /*RequiresNullTerminator=*/false);
+    if (Buffer) Hash = StableHash((*Buffer)->getBuffer());
+
+    std::lock_guard<std::mutex> Lock(Mutex);
+    FileHashes[Path] = Hash;
+    return Hash;
+  }
+
+  /// The functions of the baseline, grouped by unit.
+  std::vector<Row> Rows;
+
+  /// The index of each function in `Rows`, by USR.
+  llvm::StringMap<size_t> ByUSR;
+
+  /// The first index and number of the rows of each unit.
+  llvm::StringMap<std::pair<size_t, size_t>> RowsByUnit;
+
+  /// The translation units of the baseline, by main file.
+  llvm::StringMap<Unit> Units;
+
+  /// Guards `FileHashes`.
+  std::mutex Mutex;
+
+  /// The hashes of the files checked so far, or None if unreadable.
+  llvm::StringMap<llvm::Optional<uint64_t>> FileHashes;
+
+  /// The number of warnings about new or regressed functions.
+  std::atomic<unsigned> Regressions{0};
+};
+
+/// A KLL sketch (Karnin, Lang and Liberty, "Optimal Quantile Approximation in
+/// Streams", 2016) of a stream of values, which answers quantile queries with
+/// a rank error of about 1.5% at `K = 200`, in constant memory.
+///
+/// Items are kept in compactors, one per level. An item on level `h` stands
+/// for `2^h` items of the stream. When the sketch is full, the lowest level
+/// at its capacity is sorted and every other item (starting at a random
+/// offset) is promoted to the next level, while the rest is dropped. Higher
+/// levels have larger capacities, shrinking by 2/3 per level downwards.
+/// Two sketches merge by concatenating their levels and compacting again.
+class QuantileSketch {
+ public:
+  explicit QuantileSketch(unsigned K = 200) : K(K) {
+    grow();
+  }
+
+  /// Adds a value to the stream.
+  void add(uint64_t Value) {
+    Count += 1;
+    Maximum = std::max(Maximum, Value);
+
+    Levels.front().push_back(Value);
+    Size += 1;
+    if (Size >= MaximumSize) compress();
+  }
+
+  /// Adds all values of another sketch's stream.
+  void merge(const QuantileSketch& Other) {
+    Count += Other.Count;
+    Maximum = std::max(Maximum, Other.Maximum);
+
+    while (Levels.size() < Other.Levels.size()) grow();
+    for (size_t Level = 0; Level < Other.Levels.size(); ++Level) {
+      Levels[Level].insert(Levels[Level].end(),
+                           Other.Levels[Level].begin(),
+                           Other.Levels[Level].end());
+    }
+
+    Size = 0;
+    for (const auto& Compactor : Levels) Size += Compactor.size();
+    while (Size >= MaximumSize) compress();
+  }
+
+  /// Returns an approximation of the value at the quantile (in [0, 1]).
+  uint64_t getQuantile(double Quantile) const {
+    std::vector<std::pair<uint64_t, uint64_t>> Weighted;
+    Weighted.reserve(Size);
+    for (size_t Level = 0; Level < Levels.size(); ++Level) {
+      for (const auto Value : Levels[Level]) {
+        Weighted.emplace_back(Value, uint64_t(1) << Level);
+      }
+    }
+    if (Weighted.empty()) return 0;
+
+    std::sort(Weighted.begin(), Weighted.end());
+
+    uint64_t Total = 0;
+    for (const auto& Entry : Weighted) Total += Entry.second;
+
+    const auto Rank = static_cast<uint64_t>(Quantile * Total);
+    uint64_t Seen = 0;
+    for (const auto& Entry : Weighted) {
+      Seen += Entry.second;
+      if (Seen > Rank) return Entry.first;
+    }
+
+    return Weighted.back().first;
+  }
+
+  /// The exact number of values in the stream.
+  uint64_t getCount() const noexcept {
+    return Count;
+  }
+
+  /// The exact largest value in the stream.
+  uint64_t getMaximum() const noexcept {
+    return Maximum;
+  }
+
+ private:
+  /// How many items the level may hold before it is compacted.
+  size_t getCapacity(size_t Level) const {
+    const auto Depth = Levels.size() - Level - 1;
+    const auto Capacity = std::ceil(K * std::pow(2.0 / 3.0, Depth));
+    return std::max<size_t>(2, static_cast<size_t>(Capacity));
+  }
+
+  /// Adds a level on top.
+  void grow() {
+    Levels.emplace_back();
+    MaximumSize = 0;
+    for (size_t Level = 0; Level < Levels.size(); ++Level) {
+      MaximumSize += getCapacity(Level);
+    }
+  }
+
+  /// Compacts the lowest level that is at its capacity.
+  void compress() {
+    for (size_t Level = 0; Level < Levels.size(); ++Level) {
+      if (Levels[Level].size() < getCapacity(Level)) continue;
+      if (Level + 1 == Levels.size()) grow();
+
+      auto& Compactor = Levels[Level];
+      auto& Next = Levels[Level + 1];
+      std::sort(Compactor.begin(), Compactor.end());
+
+      // With an odd number of items, the largest one stays behind.
+      const bool Odd = Compactor.size() % 2 == 1;
+      const auto Kept = Odd ? Compactor.back() : 0;
+      const auto End = Compactor.size() - (Odd ? 1 : 0);
+      for (auto Index = getRandomBit(); Index < End; Index += 2) {
+        Next.push_back(Compactor[Index]);
+      }
+
+      Size -= End - End / 2;
+      Compactor.clear();
+      if (Odd) Compactor.push_back(Kept);
+      return;
+    }
+  }
+
+  /// Returns 0 or 1 at random, from a xorshift generator.
+  size_t getRandomBit() {
+    Random ^= Random << 13;
+    Random ^= Random >> 7;
+    Random ^= Random << 17;
+    return Random & 1;
+  }
+
+  /// The size parameter, trading memory for accuracy.
+  unsigned K;
+
+  /// The compactors, lowest level first.
+  std::vector<std::vector<uint64_t>> Levels;
+
+  /// The number of items in all levels.
+  size_t Size = 0;
+
+  /// The sum of all capacities.
+  size_t MaximumSize = 0;
+
+  /// The exact number of values added.
+  uint64_t Count = 0;
+
+  /// The exact largest value added.
+  uint64_t Maximum = 0;
+
+  /// The state of the random number generator.
+  uint64_t Random = 0x9e3779b97f4a7c15ULL;
+};
+
+/// Summarizes the distribution of complexities per directory.
+///
+/// Every function's complexity is added to the sketch of each prefix of its
+/// directory, up to a maximum depth, and to a sketch for the whole run. Like
+/// the `RowCollector`, each thread adds to its own sketches, which are merged
+/// once all workers have finished, so memory stays constant in the number of
+/// functions and workers never contend.
+class DistributionSummary {
+ public:
+  /// Constructor.
+  ///
+  /// \param Base The directory that prefixes are relative to, if the file is
+  /// below it.
+  /// \param Depth How many directory levels to summarize.
+  DistributionSummary(std::string Base, unsigned Depth)
+  : Base(std::move(Base)), Depth(Depth) {}
+
+  /// Adds the complexity of a function in the (absolute) file.
+  void add(llvm::StringRef File, uint64_t Complexity) {
+    auto& Sketches = Threads.getLocal();
+    Sketches[Total].add(Complexity);
+
+    auto Directory = llvm::sys::path::parent_path(File);
+    if (Directory.startswith(Base)) {
+      const auto Relative = Directory.drop_front(Base.size());
+      if (Relative.empty() || llvm::sys::path::is_separator(Relative[0])) {
+        Directory = Relative.ltrim("/\\");
+      }
+    }
+
+    // Walk the components to find the end of each prefix.
+    unsigned Level = 0;
+    for (auto Component = llvm::sys::path::begin(Directory),
+              End = llvm::sys::path::end(Directory);
+         Component != End && Level < Depth;
+         ++Component) {
+      // An absolute path starts with its root, which is no level of its own.
+      if (llvm::sys::path::is_separator((*Component)[0])) continue;
+
+      const auto Length = Component->end() - Directory.begin();
+      Sketches[Directory.substr(0, Length)].add(Complexity);
+      Level += 1;
+    }
+  }
+
+  /// Merges the sketches of all threads and prints a table of quantiles per
+  /// directory. Must only be called once no thread is adding anymore.
+  void print(llvm::raw_ostream& Stream) {
+    auto& Sketches = Threads.getAll();
+    if (Sketches.empty()) return;
+
+    auto& Merged = *Sketches.front();
+    for (size_t Index = 1; Index < Sketches.size(); ++Index) {
+      for (const auto& Entry : *Sketches[Index]) {
+        Merged[Entry.getKey()].merge(Entry.getValue());
+      }
+      Sketches[Index]->clear();
+    }
+
+    std::vector<llvm::StringRef> Directories;
+    for (const auto& Entry : Merged) Directories.push_back(Entry.getKey());
+    std::sort(Directories.begin(), Directories.end());
+
+    size_t Width = 9;
+    for (const auto Directory : Directories) {
+      Width = std::max(Width, Directory.size());
+    }
+
+    Stream << "Directory";
+    Stream.indent(Width - 9)
+        << "  Functions     p50     p90     p99     max\n";
+    for (const auto Directory : Directories) {
+      const auto& Sketch = Merged[Directory];
+      Stream << Directory;
+      Stream.indent(Width - Directory.size())
+          << llvm::format(" %10llu %7llu %7llu %7llu %7llu\n",
+                          static_cast<unsigned long long>(Sketch.getCount()),
+                          static_cast<unsigned long long>(
+                              Sketch.getQuantile(0.5)),
+                          static_cast<unsigned long long>(
+                              Sketch.getQuantile(0.9)),
+                          static_cast<unsigned long long>(
+                              Sketch.getQuantile(0.99)),
+                          static_cast<unsigned long long>(
+                              Sketch.getMaximum()));
+    }
+  }
+
+ private:
+  using SketchMap = llvm::StringMap<QuantileSketch>;
+
+  /// The key of the sketch for the whole run, which sorts first.
+  static constexpr const char* Total = "(all)";
+
+  /// The directory that prefixes are relative to.
+  std::string Base;
+
+  /// How many directory levels to summarize.
+  unsigned Depth;
+
+  /// The sketches of each thread.
+  ToolSupport::PerThread<SketchMap> Threads;
+};
+
+constexpr const char* DistributionSummary::Total;
+
+/// How long the analysis of one function took, and how large its CFG was.
+struct Timing {
+  using Clock = std::chrono::steady_clock;
+
+  /// When to abandon the analysis.
+  Clock::time_point Deadline = Clock::time_point::max();
+
+  /// The time spent building the CFG.
+  Clock::duration Build{0};
+
+  /// The time spent computing the metrics from the CFG or the AST.
+  Clock::duration Analysis{0};
+
+  /// The size of the CFG, or zero if none was built.
+  unsigned Blocks = 0;
+  unsigned Edges = 0;
+
+  /// The number of statements in the body, if they were counted to predict
+  /// the time to build the CFG.
+  unsigned Statements = 0;
+
+  /// Whether the analysis was abandoned at the deadline.
+  bool Exceeded = false;
+
+  Clock::duration getTotal() const noexcept {
+    return Build + Analysis;
+  }
+};
+
+/// Predicts how long building the CFG of a function takes from the number of
+/// statements in its body, at the rate measured over the CFGs built so far.
+///
+/// Building a CFG cannot be interrupted, so this is how functions whose CFG
+/// would blow the time budget are skipped before building it.
+class BuildCostModel {
+ public:
+  /// Records that building the CFG of a body with that many statements took
+  /// that long.
+  void record(unsigned Statements, Timing::Clock::duration Build) {
+    Counted += Statements;
+    Nanoseconds +=
+        std::chrono::duration_cast<std::chrono::nanoseconds>(Build).count();
+  }
+
+  /// The predicted time to build the CFG of a body with that many
+  /// statements, or zero until enough CFGs were built to tell.
+  Timing::Clock::duration predict(unsigned Statements) const {
+    const auto Measured = Counted.load();
+    if (Measured < MinimumStatements) return Timing::Clock::duration::zero();
+
+    const std::chrono::duration<double, std::nano> Predicted(
+        static_cast<double>(Nanoseconds.load()) / Measured * Statements);
+    return std::chrono::duration_cast<Timing::Clock::duration>(Predicted);
+  }
+
+ private:
+  /// How many statements the rate must be measured over before it is used,
+  /// so that the first few functions do not skew it.
+  static constexpr uint64_t MinimumStatements = 10000;
+
+  /// The statements in all bodies whose CFG was built.
+  std::atomic<uint64_t> Counted{0};
+
+  /// The time it took to build them.
+  std::atomic<uint64_t> Nanoseconds{0};
+};
+
+constexpr uint64_t BuildCostModel::MinimumStatements;
+
+/// Keeps the functions that took longest to analyze, and all that exceeded
+/// the time budget.
+///
+/// Each thread keeps its slowest functions in a heap of bounded size, so
+/// memory does not grow with the number of functions. The heaps are merged
+/// once all workers have finished.
+class Profiler {
+ public:
+  struct Sample {
+    std::string Name;
+    std::string File;
+    unsigned Line = 0;
+    Timing Spent;
+  };
+
+  /// Constructor.
+  ///
+  /// \param Count How many of the slowest functions to keep.
+  explicit Profiler(size_t Count) : Count(Count) {}
+
+  /// Whether `add` would keep a function that took this long, so that
+  /// callers can skip building a sample otherwise.
+  bool accepts(const Timing& Spent) {
+    if (Spent.Exceeded) return true;
+    if (Count == 0) return false;
+
+    const auto& Slowest = Threads.getLocal().Slowest;
+    return Slowest.size() < Count ||
+           Spent.getTotal() > Slowest.front().Spent.getTotal();
+  }
+
+  void add(Sample NewSample) {
+    auto& Local = Threads.getLocal();
+    if (NewSample.Spent.Exceeded) Local.Exceeded.push_back(NewSample);
+    if (Count == 0) return;
+
+    auto& Slowest = Local.Slowest;
+    if (Slowest.size() == Count) {
+      if (NewSample.Spent.getTotal() <= Slowest.front().Spent.getTotal()) {
+        return;
+      }
+      std::pop_heap(Slowest.begin(), Slowest.end(), isSlower);
+      Slowest.pop_back();
+    }
 
-namespace McCabe {
+    Slowest.push_back(std::move(NewSample));
+    std::push_heap(Slowest.begin(), Slowest.end(), isSlower);
+  }
+
+  /// Prints the slowest functions, then those that exceeded the budget. Must
+  /// only be called once no thread is adding anymore.
+  void print(llvm::raw_ostream& Stream) {
+    std::vector<Sample> Slowest;
+    std::vector<Sample> Exceeded;
+    for (auto& Thread : Threads.getAll()) {
+      std::move(Thread->Slowest.begin(),
+                Thread->Slowest.end(),
+                std::back_inserter(Slowest));
+      std::move(Thread->Exceeded.begin(),
+                Thread->Exceeded.end(),
+                std::back_inserter(Exceeded));
+      Thread->Slowest.clear();
+      Thread->Exceeded.clear();
+    }
+
+    using Milliseconds = std::chrono::duration<double, std::milli>;
+    if (Count > 0) {
+      std::sort(Slowest.begin(), Slowest.end(), isSlower);
+      if (Slowest.size() > Count) Slowest.resize(Count);
+
+      Stream << "  Total ms    CFG ms  Analysis ms  Blocks   Edges\n";
+      for (const auto& Entry : Slowest) {
+        const auto& Spent = Entry.Spent;
+        Stream << llvm::format("%10.3f%10.3f%13.3f%8u%8u  ",
+                               Milliseconds(Spent.getTotal()).count(),
+                               Milliseconds(Spent.Build).count(),
+                               Milliseconds(Spent.Analysis).count(),
+                               Spent.Blocks,
+                               Spent.Edges)
+               << Entry.Name << "  " << Entry.File << ':' << Entry.Line
+               << '\n';
+      }
+    }
+
+    if (Exceeded.empty()) return;
+    std::sort(Exceeded.begin(),
+              Exceeded.end(),
+              [](const Sample& A, const Sample& B) {
+                return std::tie(A.File, A.Line, A.Name) <
+                       std::tie(B.File, B.Line, B.Name);
+              });
+
+    Stream << Exceeded.size()
+           << " functions exceeded the time budget and were skipped:\n";
+    for (const auto& Entry : Exceeded) {
+      Stream << "  " << Entry.Name << "  " << Entry.File << ':' << Entry.Line;
+      if (Entry.Spent.Blocks == 0) {
+        Stream << " (" << Entry.Spent.Statements
+               << " statements, CFG not built)\n";
+        continue;
+      }
+
+      Stream << " (" << Entry.Spent.Blocks << " blocks, "
+             << llvm::format("%.3f", Milliseconds(Entry.Spent.Build).count())
+             << " ms to build the CFG)\n";
+    }
+  }
+
+ private:
+  struct Samples {
+    /// A heap with the fastest of the slowest functions at the front.
+    std::vector<Sample> Slowest;
+
+    /// The functions that exceeded the budget.
+    std::vector<Sample> Exceeded;
+  };
+
+  static bool isSlower(const Sample& A, const Sample& B) {
+    return A.Spent.getTotal() > B.Spent.getTotal();
+  }
+
+  /// How many of the slowest functions to keep.
+  size_t Count;
+
+  /// The samples of each thread.
+  ToolSupport::PerThread<Samples> Threads;
+};
+
+/// The functions outside main files that some translation unit analyzes.
+///
+/// Functions defined in headers are seen by every translation unit that
+/// includes them, on any thread, but only the first to claim one analyzes it.
+/// A `FileID` only means something within its translation unit, so the file is
+/// identified by its device and inode instead, which also holds if different
+/// translation units reach it by different paths.
+class ClaimSet {
+ public:
+  /// Returns true if this is the first call for the location during the run.
+  ///
+  /// \param Variant Tells apart functions at the same location, like the
+  /// instantiations of a template.
+  bool claim(const llvm::sys::fs::UniqueID& File,
+             unsigned Offset,
+             uint64_t Variant = 0) {
+    return Keys.insert(
+        Key{{File.getDevice(), File.getFile()}, {Offset, Variant}});
+  }
+
+ private:
+  using Key = std::pair<std::pair<uint64_t, uint64_t>,
+                        std::pair<unsigned, uint64_t>>;
+
+  /// The claimed locations.
+  ToolSupport::ShardedSet<llvm::DenseSet<Key>> Keys;
+};
+
+/// How to analyze functions, shared by all translation units.
+struct Configuration {
+  /// The values above which we warn.
+  Thresholds Limits;
+
+  /// How to compute the cyclomatic complexity.
+  Engine SelectedEngine = Engine::CFG;
+
+  /// Whether to also analyze every instantiation of a template on its own.
+  bool Instantiations = false;
+
+  /// Where to collect a row for every function, or null.
+  RowCollector* Rows = nullptr;
+
+  /// The metrics of previous runs, or null.
+  MetricsCache* Cache = nullptr;
+
+  /// Where to summarize the distribution of complexities, or null.
+  DistributionSummary* Summary = nullptr;
+
+  /// The report to compare against, or null to report every function.
+  BaselineReport* Baseline = nullptr;
+
+  /// Where to record how long functions take to analyze, or null.
+  Profiler* Profile = nullptr;
+
+  /// What predicts the time to build a CFG, or null if there is no budget.
+  BuildCostModel* Costs = nullptr;
+
+  /// Where to count the functions the engines disagree on, or null.
+  std::atomic<unsigned>* Disagreements = nullptr;
+
+  /// How long the CFG analysis of a function may take, or zero for no limit.
+  std::chrono::milliseconds Budget{0};
+
+  /// The functions in headers claimed by some translation unit, or null to
+  /// analyze them in every translation unit.
+  ClaimSet* Claims = nullptr;
+};
+
+namespace {
+/// The qualified name of the function, with the template arguments of
+/// instantiations (e.g. `std::max<int>`).
+std::string GetDisplayName(const clang::FunctionDecl& Function) {
+  std::string Name;
+  llvm::raw_string_ostream Stream(Name);
+
+  // Clang would call it `f()::(lambda at /path/to/file.cpp:3:7)::operator()`.
+  // The line is reported anyway, but the column tells apart the lambdas of one
+  // line, like `lambda at column 7 in f`.
+  const auto* Method = llvm::dyn_cast<clang::CXXMethodDecl>(&Function);
+  if (Method && Method->getParent()->isLambda()) {
+    const auto& SourceManager = Function.getASTContext().getSourceManager();
+    Stream << "lambda at column "
+           << SourceManager.getExpansionColumnNumber(
+                  Method->getParent()->getLocation());
+    const auto* Context = Method->getParent()->getDeclContext();
+    if (const auto* Enclosing = llvm::dyn_cast<clang::FunctionDecl>(Context)) {
+      Stream << " in " << GetDisplayName(*Enclosing);
+    }
+    return Stream.str();
+  }
+
+  Function.getNameForDiagnostic(Stream,
+                                Function.getASTContext().getPrintingPolicy(),
+                                /*Qualified=*/true);
+  return Stream.str();
+}
+
+/// Returns the USR of the function, or an empty string if it has none.
+std::string GetUSR(const clang::FunctionDecl& Function) {
+  llvm::SmallString<128> USR;
+  if (clang::index::generateUSRForDecl(&Function, USR)) return {};
+  return USR.str();
+}
+
+/// Returns the baseline's value of a metric, if the function is in it.
+template <typename T>
+llvm::Optional<uint64_t> GetPrevious(const Metrics* Before,
+                                     T Metrics::*Metric) {
+  if (!Before) return llvm::None;
+  return Before->*Metric;
+}
+
+/// Returns the absolute name of the file the location is in, or an empty
+/// string for buffers that are not files.
+std::string GetAbsoluteFilename(const clang::SourceManager& SourceManager,
+                                clang::SourceLocation Location) {
+  const auto* Entry =
+      SourceManager.getFileEntryForID(SourceManager.getFileID(Location));
+  if (!Entry) return {};
+
+  llvm::SmallString<256> Filename(Entry->getName());
+  llvm::sys::fs::make_absolute(Filename);
+  llvm::sys::path::remove_dots(Filename, /*remove_dot_dot=*/true);
+
+  return Filename.str();
+}
+
+/// Whether the child of a control structure is nested inside it, in the sense
+/// of cognitive complexity: bodies and branches are, conditions are not, and
+/// an `else if` stays at the level of its `if`.
+bool IsNestedIn(const clang::Stmt* Child, const clang::Stmt* Parent) {
+  if (const auto* If = llvm::dyn_cast<clang::IfStmt>(Parent)) {
+    if (Child == If->getThen()) return true;
+    return Child == If->getElse() && !llvm::isa<clang::IfStmt>(Child);
+  }
+  if (const auto* Loop = llvm::dyn_cast<clang::ForStmt>(Parent)) {
+    return Child == Loop->getBody();
+  }
+  if (const auto* Loop = llvm::dyn_cast<clang::CXXForRangeStmt>(Parent)) {
+    return Child == Loop->getBody();
+  }
+  if (const auto* Loop = llvm::dyn_cast<clang::WhileStmt>(Parent)) {
+    return Child == Loop->getBody();
+  }
+  if (const auto* Loop = llvm::dyn_cast<clang::DoStmt>(Parent)) {
+    return Child == Loop->getBody();
+  }
+  if (const auto* Switch = llvm::dyn_cast<clang::SwitchStmt>(Parent)) {
+    return Child == Switch->getBody();
+  }
+  if (const auto* Conditional =
+          llvm::dyn_cast<clang::AbstractConditionalOperator>(Parent)) {
+    return Child != Conditional->getCond();
+  }
+  return llvm::isa<clang::CXXCatchStmt>(Parent);
+}
+
+/// The number of control structures the statement is nested in.
+unsigned GetNesting(const clang::Stmt* Statement,
+                    const clang::ParentMap& Parents) {
+  unsigned Nesting = 0;
+  for (const auto* Parent = Parents.getParent(Statement); Parent;
+       Statement = Parent, Parent = Parents.getParent(Parent)) {
+    if (IsNestedIn(Statement, Parent)) Nesting += 1;
+  }
+  return Nesting;
+}
+
+/// Adds what a block's terminator contributes to the cognitive complexity and
+/// the nesting depth.
+void MeasureTerminator(const clang::Stmt* Terminator,
+                       const clang::ParentMap& Parents,
+                       Metrics& Measured) {
+  // A control structure counts one, plus one for each level it is nested in.
+  const auto countNested = [&Parents, &Measured](const clang::Stmt* Statement,
+                                                  unsigned Extra) {
+    const auto Nesting = GetNesting(Statement, Parents);
+    Measured.Cognitive += 1 + Nesting + Extra;
+    Measured.MaximumNesting = std::max(Measured.MaximumNesting, Nesting + 1);
+  };
+
+  if (const auto* If = llvm::dyn_cast<clang::IfStmt>(Terminator)) {
+    const auto* Else = If->getElse();
+    const unsigned ForElse = (Else && !llvm::isa<clang::IfStmt>(Else)) ? 1 : 0;
+
+    const auto* Parent = llvm::dyn_cast_or_null<clang::IfStmt>(
+        Parents.getParent(Terminator));
+    if (Parent && Parent->getElse() == Terminator) {
+      // An `else if` is not nested any further than its `if`.
+      Measured.Cognitive += 1 + ForElse;
+    } else {
+      countNested(If, ForElse);
+    }
+  } else if (const auto* Try = llvm::dyn_cast<clang::CXXTryStmt>(Terminator)) {
+    for (unsigned Handler = 0; Handler < Try->getNumHandlers(); ++Handler) {
+      countNested(Try, 0);
+    }
+  } else if (const auto* Operator =
+                 llvm::dyn_cast<clang::BinaryOperator>(Terminator)) {
+    // Only the first operator in a sequence of like operators counts.
+    const auto* Parent = llvm::dyn_cast_or_null<clang::BinaryOperator>(
+        Parents.getParentIgnoreParens(const_cast<clang::Stmt*>(Terminator)));
+    if (!Parent || Parent->getOpcode() != Operator->getOpcode()) {
+      Measured.Cognitive += 1;
+    }
+  } else if (llvm::isa<clang::GotoStmt>(Terminator) ||
+             llvm::isa<clang::IndirectGotoStmt>(Terminator)) {
+    Measured.Cognitive += 1;
+  } else if (llvm::isa<clang::ForStmt>(Terminator) ||
+             llvm::isa<clang::CXXForRangeStmt>(Terminator) ||
+             llvm::isa<clang::WhileStmt>(Terminator) ||
+             llvm::isa<clang::DoStmt>(Terminator) ||
+             llvm::isa<clang::SwitchStmt>(Terminator) ||
+             llvm::isa<clang::AbstractConditionalOperator>(Terminator)) {
+    countNested(Terminator, 0);
+  }
+}
+
+/// The number of statements and expressions in the body, which the time to
+/// build its CFG grows with.
+unsigned CountStatements(const clang::Stmt& Body) {
+  unsigned Count = 0;
+  llvm::SmallVector<const clang::Stmt*, 64> Stack{&Body};
+  while (!Stack.empty()) {
+    const auto* Statement = Stack.pop_back_val();
+    Count += 1;
+    for (const auto* Child : Statement->children()) {
+      if (Child) Stack.push_back(Child);
+    }
+  }
+  return Count;
+}
+
+/// Computes all metrics from the function's CFG.
+///
+/// The blocks are visited in a single depth-first traversal. On the way down
+/// we count blocks, edges and statements and score each terminator. On the
+/// way up, the number of acyclic paths to the exit of a block is the sum over
+/// its successors, ignoring back edges (a block whose edges all loop back ends
+/// one path). Blocks not reachable from the entry, like exception handlers,
+/// start their own traversals so that every block is counted once.
+///
+/// Building the CFG cannot be interrupted, so functions whose CFG is not
+/// predicted to be built before the deadline are skipped up front. Else the
+/// deadline is checked once the CFG is built, and then every few blocks of
+/// the traversal.
+///
+/// \param Spent Records the time taken and the size of the CFG.
+/// \param Costs Predicts the time to build the CFG, or null.
+/// \returns None if no CFG could be built or the deadline passed.
+llvm::Optional<Metrics> ComputeWithCFG(const clang::FunctionDecl& Function,
+                                       clang::ASTContext& Context,
+                                       Timing& Spent,
+                                       BuildCostModel* Costs) {
+  using Clock = Timing::Clock;
+
+  const auto Start = Clock::now();
+  if (Costs) {
+    Spent.Statements = CountStatements(*Function.getBody());
+    if (Start + Costs->predict(Spent.Statements) >= Spent.Deadline) {
+      Spent.Exceeded = true;
+      return llvm::None;
+    }
+  }
+
+  const auto CFG = clang::CFG::buildCFG(&Function,
+                                        Function.getBody(),
+                                        &Context,
+                                        clang::CFG::BuildOptions());
+  const auto Built = Clock::now();
+  Spent.Build = Built - Start;
+  if (!CFG) return llvm::None;
+  if (Costs) Costs->record(Spent.Statements, Spent.Build);
+
+  int numberOfEdges = 0;
+  for (const auto* Block : *CFG) numberOfEdges += Block->succ_size();
+  Spent.Blocks = CFG->size();
+  Spent.Edges = numberOfEdges;
+
+  if (Built >= Spent.Deadline) {
+    Spent.Exceeded = true;
+    return llvm::None;
+  }
+
+  const clang::ParentMap Parents(Function.getBody());
+  Metrics Measured;
+
+  enum class State : uint8_t { New, Active, Done };
+  std::vector<State> States(CFG->getNumBlockIDs(), State::New);
+  std::vector<uint64_t> Paths(CFG->getNumBlockIDs(), 0);
+
+  const auto* Exit = &CFG->getExit();
+
+  // Reading the clock for every block would cost more than visiting it.
+  unsigned Visited = 0;
+  const auto expired = [&Visited, &Spent] {
+    return (++Visited % 256) == 0 && Clock::now() >= Spent.Deadline;
+  };
+
+  // Each entry is a block and the index of the next successor to visit.
+  llvm::SmallVector<std::pair<const clang::CFGBlock*, unsigned>, 32> Stack;
+  const auto visit = [&](const clang::CFGBlock* Block) {
+    States[Block->getBlockID()] = State::Active;
+    Stack.emplace_back(Block, 0);
+    if (expired()) Spent.Exceeded = true;
+
+    for (const auto& Element : *Block) {
+      if (Element.getAs<clang::CFGStmt>()) Measured.Statements += 1;
+    }
+    if (const auto* Terminator = Block->getTerminator().getStmt()) {
+      MeasureTerminator(Terminator, Parents, Measured);
+    }
+  };
+
+  const auto traverse = [&](const clang::CFGBlock* Root) {
+    visit(Root);
+    while (!Stack.empty() && !Spent.Exceeded) {
+      auto& Top = Stack.back();
+      const auto* Block = Top.first;
+
+      if (Top.second < Block->succ_size()) {
+        const clang::CFGBlock* Successor =
+            *(Block->succ_begin() + Top.second++);
+        if (Successor && States[Successor->getBlockID()] == State::New) {
+          visit(Successor);
+        }
+        continue;
+      }
+
+      // All successors are done, except those we reach over back edges.
+      uint64_t Sum = 0;
+      bool HasForwardEdge = false;
+      for (const clang::CFGBlock* Successor : Block->succs()) {
+        if (!Successor) continue;
+        if (States[Successor->getBlockID()] == State::Active) continue;
+        HasForwardEdge = true;
+        Sum = llvm::SaturatingAdd(Sum, Paths[Successor->getBlockID()]);
+      }
+
+      Paths[Block->getBlockID()] = (Block == Exit || !HasForwardEdge) ? 1 : Sum;
+      States[Block->getBlockID()] = State::Done;
+      Stack.pop_back();
+    }
+  };
+
+  traverse(&CFG->getEntry());
+  Measured.NPath = Paths[CFG->getEntry().getBlockID()];
+  for (const auto* Block : *CFG) {
+    if (Spent.Exceeded) break;
+    if (States[Block->getBlockID()] == State::New) traverse(Block);
+  }
+
+  Spent.Analysis = Clock::now() - Built;
+  if (Spent.Exceeded) return llvm::None;
+
+  // -1 for entry and -1 for exit block.
+  const int numberOfNodes = CFG->size() - 2;
+  numberOfEdges -= 2;
+  Measured.Blocks = numberOfNodes;
+
+  // E - V + 2 * P
+  // 2 * 1 = 2 * numberOfComponents.
+  Measured.Cyclomatic = numberOfEdges - numberOfNodes + (2 * 1);
+
+  return Measured;
+}
+
+/// Computes the cyclomatic complexity by counting decision points in the AST.
+unsigned ComputeWithAST(const clang::FunctionDecl& Function) {
+  DecisionCounter Counter;
+  Counter.TraverseStmt(Function.getBody());
+  return Counter.getDecisions() + 1;
+}
+}  // namespace
+
+/// How the engines fared on one translation unit, when running both.
+struct EngineStatistics {
+  std::chrono::nanoseconds CFGTime{0};
+  std::chrono::nanoseconds ASTTime{0};
+  unsigned Functions = 0;
+  unsigned Disagreements = 0;
+};
 
 class MatchHandler : public clang::ast_matchers::MatchFinder::MatchCallback {
  public:
   using MatchResult = clang::ast_matchers::MatchFinder::MatchResult;
 
-  explicit MatchHandler(unsigned Threshold) : Threshold(Threshold) {}
+  /// Constructor.
+  ///
+  /// \param Flags Identifies the flags that affect how the translation unit
+  /// is parsed, for the keys of the cache.
+  MatchHandler(const Configuration& Settings,
+               EngineStatistics& Statistics,
+               std::string Flags)
+  : Limits(Settings.Limits)
+  , Budget(Settings.Budget)
+  , SelectedEngine(Settings.SelectedEngine)
+  , Rows(Settings.Rows)
+  , Cache(Settings.Cache)
+  , Summary(Settings.Summary)
+  , Baseline(Settings.Baseline)
+  , Profile(Settings.Profile)
+  , Costs(Settings.Costs)
+  , Claims(Settings.Claims)
+  , Statistics(Statistics)
+  , Flags(std::move(Flags)) {}
 
   void run(const MatchResult& Result) {
+    // A lambda is analyzed as its call operator, apart from the function it
+    // is written in.
     const auto* Function = Result.Nodes.getNodeAs<clang::FunctionDecl>("fn");
-    const auto CFG = clang::CFG::buildCFG(Function,
-                                          Function->getBody(),
-                                          Result.Context,
-                                          clang::CFG::BuildOptions());
-
-    // -1 for entry and -1 for exit block.
-    const int numberOfNodes = CFG->size() - 2;
-    int numberOfEdges = -2;
-    for (const auto* Block : *CFG) {
-      numberOfEdges += Block->succ_size();
+    if (const auto* Lambda =
+            Result.Nodes.getNodeAs<clang::LambdaExpr>("lambda")) {
+      Function = Lambda->getCallOperator();
     }
 
-    // E - V + 2 * P
-    // 2 * 1 = 2 * numberOfComponents.
-    const unsigned Complexity = numberOfEdges - numberOfNodes + (2 * 1);
-    if (Complexity <= Threshold) return;
+    // Deleted and defaulted functions count as definitions, but have no body
+    // written by the user. Templates parsed late may not have one yet either.
+    if (Function->isDeleted() || Function->isDefaulted()) return;
+    if (!Function->getBody()) return;
+
+    // Only one declaration of a function is a definition, so this only ever
+    // rejects something if a matcher fires twice for the same node.
+    if (!Analyzed.insert(Function->getCanonicalDecl()).second) return;
+    if (Claims && !claim(*Function, *Result.SourceManager)) return;
+
+    const auto Measurement = measure(*Function, Result);
+    if (!Measurement) return;
+    const auto& Measured = *Measurement;
+
+    // With a baseline, only functions that are new or got worse are reported.
+    const auto USR = (Rows || Baseline) ? GetUSR(*Function) : std::string();
+    const auto* Before = Baseline ? Baseline->lookup(USR) : nullptr;
+
+    if (Rows) collect(*Function, *Result.SourceManager, Measured, USR);
+    if (Summary) {
+      const auto& SourceManager = *Result.SourceManager;
+      const auto Location =
+          SourceManager.getExpansionLoc(Function->getLocation());
+      Summary->add(GetAbsoluteFilename(SourceManager, Location),
+                   Measured.Cyclomatic);
+    }
 
     auto& Diagnostics = Result.Context->getDiagnostics();
-    const auto ID =
-        Diagnostics.getCustomDiagID(clang::DiagnosticsEngine::Warning,
-                                    "Function '%0' is too complex (%1)");
+    if (Measured.Cyclomatic > Limits.Cyclomatic &&
+        (!Before || Measured.Cyclomatic > Before->Cyclomatic)) {
+      if (Baseline) Baseline->addRegression();
+
+      const auto ID = Diagnostics.getCustomDiagID(
+          clang::DiagnosticsEngine::Warning,
+          Before ? "Function '%0' is too complex (%1, was %2)"
+                 : "Function '%0' is too complex (%1)");
 
-    auto Builder = Diagnostics.Report(Function->getLocation(), ID);
-    Builder.AddString(Function->getQualifiedNameAsString());
-    Builder.AddTaggedVal(Complexity,
-                         clang::DiagnosticsEngine::ArgumentKind::ak_uint);
+      auto Builder = Diagnostics.Report(Function->getLocation(), ID);
+      Builder.AddString(GetDisplayName(*Function));
+      Builder.AddTaggedVal(Measured.Cyclomatic,
+                           clang::DiagnosticsEngine::ArgumentKind::ak_uint);
+      if (Before) {
+        Builder.AddTaggedVal(Before->Cyclomatic,
+                             clang::DiagnosticsEngine::ArgumentKind::ak_uint);
+      }
+    }
+
+    check(*Function,
+          Diagnostics,
+          "NPath complexity",
+          Measured.NPath,
+          Limits.NPath,
+          GetPrevious(Before, &Metrics::NPath));
+    check(*Function,
+          Diagnostics,
+          "nesting depth",
+          Measured.MaximumNesting,
+          Limits.MaximumNesting,
+          GetPrevious(Before, &Metrics::MaximumNesting));
+    check(*Function,
+          Diagnostics,
+          "cognitive complexity",
+          Measured.Cognitive,
+          Limits.Cognitive,
+          GetPrevious(Before, &Metrics::Cognitive));
+    check(*Function,
+          Diagnostics,
+          "number of basic blocks",
+          Measured.Blocks,
+          Limits.Blocks,
+          GetPrevious(Before, &Metrics::Blocks));
+    check(*Function,
+          Diagnostics,
+          "number of statements",
+          Measured.Statements,
+          Limits.Statements,
+          GetPrevious(Before, &Metrics::Statements));
   }
 
  private:
-  unsigned Threshold;
+  /// Computes the metrics of the function with the selected engine, or takes
+  /// them from the cache.
+  ///
+  /// \returns None if no CFG could be built or its analysis took too long.
+  llvm::Optional<Metrics> measure(const clang::FunctionDecl& Function,
+                                  const MatchResult& Result) {
+    Timing Spent;
+    if (Budget.count() > 0) Spent.Deadline = Timing::Clock::now() + Budget;
+
+    // Comparing engines is pointless unless both run.
+    if (SelectedEngine == Engine::Both) {
+      const auto Measured = compareEngines(Function, *Result.Context, Spent);
+      account(Function, Result, Spent);
+      return Measured;
+    }
+
+    // The AST engine only knows the cyclomatic complexity. Any other metric
+    // needs the CFG, and then we get the cyclomatic complexity for free.
+    const bool OnlyCyclomatic =
+        SelectedEngine == Engine::AST && !Limits.needCFG();
+
+    // Instantiations share the tokens of their template, but not its types.
+    llvm::Optional<uint64_t> Key;
+    if (Cache && !Function.isTemplateInstantiation()) {
+      Key = MetricsCache::hashBody(*Function.getBody(),
+                                   *Result.SourceManager,
+                                   *Result.Context,
+                                   (OnlyCyclomatic ? "ast " : "cfg ") + Flags);
+      if (Key) {
+        if (const auto Cached = Cache->lookup(*Key)) return Cached;
+      }
+    }
+
+    llvm::Optional<Metrics> Measured;
+    if (OnlyCyclomatic) {
+      const auto Start = Timing::Clock::now();
+      Measured.emplace();
+      Measured->Cyclomatic = ComputeWithAST(Function);
+      Spent.Analysis = Timing::Clock::now() - Start;
+    } else {
+      Measured = ComputeWithCFG(Function, *Result.Context, Spent, Costs);
+    }
+
+    account(Function, Result, Spent);
+    if (Key && Measured) Cache->insert(*Key, *Measured);
+    return Measured;
+  }
+
+  /// Records the time the function took to analyze, and warns if that
+  /// exceeded the budget.
+  void account(const clang::FunctionDecl& Function,
+               const MatchResult& Result,
+               const Timing& Spent) {
+    if (Spent.Exceeded) {
+      // Without blocks, the CFG was predicted to take too long to build.
+      const auto Predicted = Spent.Blocks == 0;
+      auto& Diagnostics = Result.Context->getDiagnostics();
+      const auto ID =
+          Predicted
+              ? Diagnostics.getCustomDiagID(
+                    clang::DiagnosticsEngine::Warning,
+                    "Skipped '%0': building its CFG would exceed the time "
+                    "budget (%1 statements)")
+              : Diagnostics.getCustomDiagID(
+                    clang::DiagnosticsEngine::Warning,
+                    "Skipped '%0': its analysis exceeded the time budget "
+                    "(%1 blocks)");
+
+      auto Builder = Diagnostics.Report(Function.getLocation(), ID);
+      Builder.AddString(GetDisplayName(Function));
+      Builder.AddTaggedVal(Predicted ? Spent.Statements : Spent.Blocks,
+                           clang::DiagnosticsEngine::ArgumentKind::ak_uint);
+    }
+
+    if (!Profile || !Profile->accepts(Spent)) return;
+
+    const auto& SourceManager = *Result.SourceManager;
+    const auto Location = SourceManager.getExpansionLoc(Function.getLocation());
+
+    Profiler::Sample NewSample;
+    NewSample.Name = GetDisplayName(Function);
+    NewSample.File = GetAbsoluteFilename(SourceManager, Location);
+    NewSample.Line = SourceManager.getExpansionLineNumber(Location);
+    NewSample.Spent = Spent;
+    Profile->add(std::move(NewSample));
+  }
+
+  /// Claims a function outside the main file for this translation unit.
+  ///
+  /// \returns False if another translation unit analyzes the function.
+  bool claim(const clang::FunctionDecl& Function,
+             const clang::SourceManager& SourceManager) {
+    const auto Location = SourceManager.getExpansionLoc(Function.getLocation());
+    const auto Decomposed = SourceManager.getDecomposedLoc(Location);
+    if (Decomposed.first == SourceManager.getMainFileID()) return true;
+
+    const auto* Entry = SourceManager.getFileEntryForID(Decomposed.first);
+    if (!Entry) return true;
+
+    // Instantiations in different translation units may have different
+    // arguments, so each is claimed by name.
+    const auto Variant = Function.isTemplateInstantiation()
+                             ? StableHash(GetDisplayName(Function))
+                             : 0;
+    return Claims->claim(Entry->getUniqueID(), Decomposed.second, Variant);
+  }
+
+  /// Adds a row for the function to the report.
+  void collect(const clang::FunctionDecl& Function,
+               const clang::SourceManager& SourceManager,
+               const Metrics& Measured,
+               const std::string& USR) {
+    const auto Location = SourceManager.getExpansionLoc(Function.getLocation());
+    const auto* Body = Function.getBody();
+
+    Row NewRow;
+    NewRow.Name = GetDisplayName(Function);
+    NewRow.File = GetAbsoluteFilename(SourceManager, Location);
+    NewRow.Line = SourceManager.getExpansionLineNumber(Location);
+    NewRow.BodyLines =
+        SourceManager.getExpansionLineNumber(Body->getLocEnd()) -
+        SourceManager.getExpansionLineNumber(Body->getLocStart()) + 1;
+    NewRow.Measured = Measured;
+    NewRow.USR = USR;
+    NewRow.Unit = GetAbsoluteFilename(
+        SourceManager,
+        SourceManager.getLocForStartOfFile(SourceManager.getMainFileID()));
+
+    Rows->add(std::move(NewRow));
+  }
+
+  /// Warns if the metric is checked and above its threshold, and the
+  /// function is new or got worse since the baseline.
+  void check(const clang::FunctionDecl& Function,
+             clang::DiagnosticsEngine& Diagnostics,
+             llvm::StringRef Metric,
+             uint64_t Value,
+             uint64_t Threshold,
+             llvm::Optional<uint64_t> Previous) {
+    if (Threshold == 0 || Value <= Threshold) return;
+    if (Previous && Value <= *Previous) return;
+    if (Baseline) Baseline->addRegression();
+
+    const auto ID = Diagnostics.getCustomDiagID(
+        clang::DiagnosticsEngine::Warning,
+        "The %0 of function '%1' is too high (%2, threshold: %3)");
+
+    // Passed as strings, since NPath complexities easily exceed 32 bits.
+    auto Builder = Diagnostics.Report(Function.getLocation(), ID);
+    Builder.AddString(Metric);
+    Builder.AddString(GetDisplayName(Function));
+    Builder.AddString(llvm::utostr(Value));
+    Builder.AddString(llvm::utostr(Threshold));
+  }
+
+  /// Runs both engines, timing each, and warns if they disagree.
+  ///
+  /// \returns The metrics according to the CFG engine.
+  llvm::Optional<Metrics> compareEngines(const clang::FunctionDecl& Function,
+                                         clang::ASTContext& Context,
+                                         Timing& Spent) {
+    using Clock = std::chrono::steady_clock;
+
+    const auto CFGStart = Clock::now();
+    const auto FromCFG = ComputeWithCFG(Function, Context, Spent, Costs);
+    const auto ASTStart = Clock::now();
+    const auto FromAST = ComputeWithAST(Function);
+    const auto End = Clock::now();
+
+    Statistics.CFGTime += ASTStart - CFGStart;
+    Statistics.ASTTime += End - ASTStart;
+    Statistics.Functions += 1;
+
+    if (FromCFG && FromCFG->Cyclomatic != FromAST) {
+      Statistics.Disagreements += 1;
+
+      auto& Diagnostics = Context.getDiagnostics();
+      const auto ID = Diagnostics.getCustomDiagID(
+          clang::DiagnosticsEngine::Warning,
+          "Engines disagree on '%0' (CFG: %1, AST: %2)");
+
+      auto Builder = Diagnostics.Report(Function.getLocation(), ID);
+      Builder.AddString(GetDisplayName(Function));
+      Builder.AddTaggedVal(FromCFG->Cyclomatic,
+                           clang::DiagnosticsEngine::ArgumentKind::ak_uint);
+      Builder.AddTaggedVal(FromAST,
+                           clang::DiagnosticsEngine::ArgumentKind::ak_uint);
+    }
+
+    return FromCFG;
+  }
+
+  Thresholds Limits;
+  std::chrono::milliseconds Budget;
+  Engine SelectedEngine;
+  RowCollector* Rows;
+  MetricsCache* Cache;
+  DistributionSummary* Summary;
+  BaselineReport* Baseline;
+  Profiler* Profile;
+  BuildCostModel* Costs;
+  ClaimSet* Claims;
+  EngineStatistics& Statistics;
+  std::string Flags;
+
+  /// The canonical declarations of the functions analyzed so far.
+  llvm::DenseSet<const clang::FunctionDecl*> Analyzed;
 };
 
 class Consumer : public clang::ASTConsumer {
  public:
-  template <typename... Args>
-  explicit Consumer(Args&&... args) : Handler(std::forward<Args>(args)...) {
+  Consumer(const Configuration& Settings,
+           EngineStatistics& Statistics,
+           std::string Flags)
+  : Handler(Settings, Statistics, std::move(Flags)) {
     using namespace clang::ast_matchers;
-    const auto Matcher = functionDecl(isExpansionInMainFile()).bind("fn");
+
+    // Declarations without a body would make us analyze the definition once
+    // per redeclaration. Implicit functions (like implicit constructors) have
+    // no code of their own. Instantiations share the code of their template,
+    // which we analyze in its uninstantiated form, unless asked not to.
+    // Functions in headers are claimed by one translation unit per run.
+    const auto Matcher =
+        Settings.Instantiations
+            ? functionDecl(unless(isExpansionInSystemHeader()),
+                           isDefinition(),
+                           unless(isImplicit()))
+                  .bind("fn")
+            : functionDecl(unless(isExpansionInSystemHeader()),
+                           isDefinition(),
+                           unless(isImplicit()),
+                           unless(isTemplateInstantiation()))
+                  .bind("fn");
     Finder.addMatcher(Matcher, &Handler);
+
+    // The body of a lambda is not part of the CFG of the function it is
+    // written in, so it is analyzed on its own. A template's lambdas are
+    // recreated in each of its instantiations.
+    const auto LambdaMatcher =
+        Settings.Instantiations
+            ? lambdaExpr(unless(isExpansionInSystemHeader())).bind("lambda")
+            : lambdaExpr(unless(isExpansionInSystemHeader()),
+                         unless(hasAncestor(
+                             functionDecl(isTemplateInstantiation()))))
+                  .bind("lambda");
+    Finder.addMatcher(LambdaMatcher, &Handler);
   }
 
   void HandleTranslationUnit(clang::ASTContext& Context) {
@@ -80,16 +1955,27 @@ class Action : public clang::ASTFrontendAction {
  public:
   using ASTConsumerPointer = std::unique_ptr<clang::ASTConsumer>;
 
-  explicit Action(unsigned Threshold) : Threshold(Threshold) {}
+  /// Constructor.
+  ///
+  /// \param Record Where to record the files the translation unit reads, or
+  /// null.
+  Action(const Configuration& Settings, Unit* Record)
+  : Settings(Settings), Record(Record) {}
 
   ASTConsumerPointer
-  CreateASTConsumer(clang::CompilerInstance&, llvm::StringRef) override {
-    return std::make_unique<Consumer>(Threshold);
+  CreateASTConsumer(clang::CompilerInstance& Compiler,
+                    llvm::StringRef) override {
+    // The module hash covers the language, target and preprocessor options,
+    // like -std and -D, but not the name of the file.
+    std::string Flags;
+    if (Settings.Cache) Flags = Compiler.getInvocation().getModuleHash();
+    return std::make_unique<Consumer>(Settings, Statistics, std::move(Flags));
   }
 
   bool BeginSourceFileAction(clang::CompilerInstance& Compiler,
                              llvm::StringRef Filename) override {
     const auto& Language = Compiler.getLangOpts();
+    std::lock_guard<std::mutex> Lock(OutputMutex);
 
     // clang-format off
     llvm::outs() << "Processing '" << Filename
@@ -101,12 +1987,179 @@ class Action : public clang::ASTFrontendAction {
   }
 
   void EndSourceFileAction() override {
+    if (Record) recordInputs(getCompilerInstance().getSourceManager());
+
+    if (Settings.Disagreements) {
+      *Settings.Disagreements += Statistics.Disagreements;
+    }
+
+    std::lock_guard<std::mutex> Lock(OutputMutex);
+    if (Settings.SelectedEngine == Engine::Both) {
+      using Milliseconds = std::chrono::duration<double, std::milli>;
+      const auto CFGTime = Milliseconds(Statistics.CFGTime).count();
+      const auto ASTTime = Milliseconds(Statistics.ASTTime).count();
+
+      llvm::outs() << Statistics.Functions << " functions, "
+                   << Statistics.Disagreements << " disagreements. CFG: "
+                   << llvm::format("%.3f", CFGTime)
+                   << " ms, AST: " << llvm::format("%.3f", ASTTime)
+                   << " ms\n";
+    }
+
     llvm::outs() << "\033[1mDone \033[91m<3\033[0m" << '\n';
   }
 
  private:
-  unsigned Threshold;
+  /// Records every file the translation unit read, with a hash of its
+  /// contents, so that the next run can tell whether anything changed.
+  void recordInputs(clang::SourceManager& SourceManager) {
+    for (auto Entry = SourceManager.fileinfo_begin();
+         Entry != SourceManager.fileinfo_end();
+         ++Entry) {
+      bool Invalid = false;
+      const auto* Buffer =
+          SourceManager.getMemoryBufferForFile(Entry->first, &Invalid);
+      if (Invalid || !Buffer) continue;
+
+      llvm::SmallString<256> Path(Entry->first->getName());
+      llvm::sys::fs::make_absolute(Path);
+      llvm::sys::path::remove_dots(Path, /*remove_dot_dot=*/true);
+      Record->Inputs.emplace_back(Path.str(), StableHash(Buffer->getBuffer()));
+    }
+  }
+
+  /// Keeps the output of actions on different threads apart.
+  static std::mutex OutputMutex;
+
+  const Configuration& Settings;
+  Unit* Record;
+  EngineStatistics Statistics;
 };
+
+std::mutex Action::OutputMutex;
+
+/// The formats a report can be written in.
+enum class ReportFormat { CSV, JSON };
+
+namespace {
+/// Writes the string as a CSV field, quoting it if necessary.
+void WriteCSVField(llvm::raw_ostream& Stream, llvm::StringRef Field) {
+  if (Field.find_first_of(",\"\n") == llvm::StringRef::npos) {
+    Stream << Field;
+    return;
+  }
+
+  Stream << '"';
+  for (const auto Character : Field) {
+    if (Character == '"') Stream << '"';
+    Stream << Character;
+  }
+  Stream << '"';
+}
+}  // namespace
+
+/// Writes one row per function. JSON reports also list the files each
+/// translation unit read, so that they can serve as a -baseline.
+void WriteReport(llvm::raw_ostream& Stream,
+                 llvm::ArrayRef<Row> Rows,
+                 llvm::ArrayRef<Unit> Units,
+                 ReportFormat Format) {
+  if (Format == ReportFormat::CSV) {
+    Stream << "name,file,line,cyclomatic,npath,nesting,cognitive,blocks,"
+              "statements,body_lines,usr\n";
+    for (const auto& Entry : Rows) {
+      WriteCSVField(Stream, Entry.Name);
+      Stream << ',';
+      WriteCSVField(Stream, Entry.File);
+      Stream << ',' << Entry.Line << ',' << Entry.Measured.Cyclomatic << ','
+             << Entry.Measured.NPath << ',' << Entry.Measured.MaximumNesting
+             << ',' << Entry.Measured.Cognitive << ','
+             << Entry.Measured.Blocks << ',' << Entry.Measured.Statements
+             << ',' << Entry.BodyLines << ',';
+      WriteCSVField(Stream, Entry.USR);
+      Stream << '\n';
+    }
+    return;
+  }
+
+  Stream << "{\n  \"functions\": [\n";
+  for (size_t Index = 0; Index < Rows.size(); ++Index) {
+    const auto& Entry = Rows[Index];
+    Stream << "    {\"name\": ";
+    WriteJSONString(Stream, Entry.Name);
+    Stream << ", \"file\": ";
+    WriteJSONString(Stream, Entry.File);
+    Stream << ", \"line\": " << Entry.Line
+           << ", \"cyclomatic\": " << Entry.Measured.Cyclomatic
+           << ", \"npath\": " << Entry.Measured.NPath
+           << ", \"nesting\": " << Entry.Measured.MaximumNesting
+           << ", \"cognitive\": " << Entry.Measured.Cognitive
+           << ", \"blocks\": " << Entry.Measured.Blocks
+           << ", \"statements\": " << Entry.Measured.Statements
+           << ", \"body_lines\": " << Entry.BodyLines << ", \"usr\": ";
+    WriteJSONString(Stream, Entry.USR);
+    Stream << ", \"unit\": ";
+    WriteJSONString(Stream, Entry.Unit);
+    Stream << '}' << (Index + 1 < Rows.size() ? "," : "") << '\n';
+  }
+  Stream << "  ],\n  \"units\": [\n";
+  for (size_t Index = 0; Index < Units.size(); ++Index) {
+    const auto& Entry = Units[Index];
+    Stream << "    {\"file\": ";
+    WriteJSONString(Stream, Entry.File);
+    Stream << ", \"command\": \"" << llvm::utohexstr(Entry.Command)
+           << "\", \"inputs\": [\n";
+    for (size_t Input = 0; Input < Entry.Inputs.size(); ++Input) {
+      Stream << "      {\"file\": ";
+      WriteJSONString(Stream, Entry.Inputs[Input].first);
+      Stream << ", \"hash\": \"" << llvm::utohexstr(Entry.Inputs[Input].second)
+             << "\"}" << (Input + 1 < Entry.Inputs.size() ? "," : "") << '\n';
+    }
+    Stream << "    ]}" << (Index + 1 < Units.size() ? "," : "") << '\n';
+  }
+  Stream << "  ]\n}\n";
+}
+
+/// Prints the most complex functions, most complex first.
+void PrintTop(llvm::raw_ostream& Stream,
+              llvm::ArrayRef<Row> Rows,
+              size_t Count) {
+  std::vector<const Row*> Sorted;
+  Sorted.reserve(Rows.size());
+  for (const auto& Entry : Rows) Sorted.push_back(&Entry);
+
+  Count = std::min(Count, Sorted.size());
+  std::partial_sort(Sorted.begin(),
+                    Sorted.begin() + Count,
+                    Sorted.end(),
+                    [](const Row* A, const Row* B) {
+                      if (A->Measured.Cyclomatic != B->Measured.Cyclomatic) {
+                        return A->Measured.Cyclomatic > B->Measured.Cyclomatic;
+                      }
+                      return A < B;
+                    });
+
+  for (size_t Index = 0; Index < Count; ++Index) {
+    const auto& Entry = *Sorted[Index];
+    Stream << llvm::format("%6u  ", Entry.Measured.Cyclomatic) << Entry.Name
+           << "  " << Entry.File << ':' << Entry.Line << '\n';
+  }
+}
+
+/// Hashes the compile commands of the file, to notice changed flags.
+uint64_t HashCommands(const clang::tooling::CompilationDatabase& Compilations,
+                      llvm::StringRef File) {
+  auto Hash = StableHash("");
+  for (const auto& Command : Compilations.getCompileCommands(File)) {
+    Hash = StableHash(Command.Directory, Hash);
+    for (const auto& Argument : Command.CommandLine) {
+      Hash = StableHash(Argument, Hash);
+      Hash = StableHash(llvm::StringRef("\0", 1), Hash);
+    }
+  }
+  return Hash;
+}
+
 }  // namespace McCabe
 
 namespace {
@@ -115,6 +2168,11 @@ llvm::cl::OptionCategory McCabeCategory("McCabe Options");
 llvm::cl::extrahelp McCabeCategoryHelp(R"(
     Computes the McCabe (Cyclomatic) Complexity for each function in the given
     source files and emits a warning if the complexity is beyond a threshold.
+    The NPath complexity, maximum nesting depth, cognitive complexity and the
+    number of basic blocks and statements are computed from the same CFG and
+    can be checked against thresholds of their own. Lambdas are analyzed
+    apart from the function they are written in, and functions defined in
+    (non-system) headers once per run.
 )");
 
 llvm::cl::opt<unsigned>
@@ -126,20 +2184,294 @@ llvm::cl::alias ShortThresholdOption("t",
                                      llvm::cl::desc("Alias for -threshold"),
                                      llvm::cl::aliasopt(ThresholdOption));
 
+llvm::cl::opt<unsigned long long> NPathThresholdOption(
+    "npath-threshold",
+    llvm::cl::init(0),
+    llvm::cl::desc("The NPath complexity above which to warn (0 to disable)"),
+    llvm::cl::cat(McCabeCategory));
+
+llvm::cl::opt<unsigned> NestingThresholdOption(
+    "nesting-threshold",
+    llvm::cl::init(0),
+    llvm::cl::desc("The nesting depth above which to warn (0 to disable)"),
+    llvm::cl::cat(McCabeCategory));
+
+llvm::cl::opt<unsigned> CognitiveThresholdOption(
+    "cognitive-threshold",
+    llvm::cl::init(0),
+    llvm::cl::desc("The cognitive complexity above which to warn "
+                   "(0 to disable)"),
+    llvm::cl::cat(McCabeCategory));
+
+llvm::cl::opt<unsigned> BlocksThresholdOption(
+    "blocks-threshold",
+    llvm::cl::init(0),
+    llvm::cl::desc("The number of basic blocks above which to warn "
+                   "(0 to disable)"),
+    llvm::cl::cat(McCabeCategory));
+
+llvm::cl::opt<unsigned> StatementsThresholdOption(
+    "statements-threshold",
+    llvm::cl::init(0),
+    llvm::cl::desc("The number of statements above which to warn "
+                   "(0 to disable)"),
+    llvm::cl::cat(McCabeCategory));
+
+llvm::cl::opt<bool> InstantiationsOption(
+    "instantiations",
+    llvm::cl::desc("Also analyze and report each template instantiation on "
+                   "its own, besides the template itself"),
+    llvm::cl::cat(McCabeCategory));
+
+llvm::cl::opt<std::string> ReportOption(
+    "report",
+    llvm::cl::desc("Write a row for every function to the given file "
+                   "('-' for stdout)"),
+    llvm::cl::value_desc("filename"),
+    llvm::cl::cat(McCabeCategory));
+
+llvm::cl::opt<McCabe::ReportFormat> ReportFormatOption(
+    "report-format",
+    llvm::cl::desc("The format of the -report file"),
+    llvm::cl::init(McCabe::ReportFormat::CSV),
+    llvm::cl::values(clEnumValN(McCabe::ReportFormat::CSV, "csv", "CSV"),
+                     clEnumValN(McCabe::ReportFormat::JSON, "json", "JSON")),
+    llvm::cl::cat(McCabeCategory));
+
+llvm::cl::opt<unsigned>
+    TopOption("top",
+              llvm::cl::init(0),
+              llvm::cl::desc("Print the given number of most complex "
+                             "functions at the end of the run"),
+              llvm::cl::cat(McCabeCategory));
+
+llvm::cl::opt<bool> SummaryOption(
+    "summary",
+    llvm::cl::desc("Print the p50, p90 and p99 complexity per directory at the "
+                   "end of the run, using constant memory"),
+    llvm::cl::cat(McCabeCategory));
+
+llvm::cl::opt<unsigned> SummaryDepthOption(
+    "summary-depth",
+    llvm::cl::init(2),
+    llvm::cl::desc("How many directory levels -summary breaks down into"),
+    llvm::cl::cat(McCabeCategory));
+
+llvm::cl::opt<std::string> BaselineOption(
+    "baseline",
+    llvm::cl::desc("Only warn about functions that are new or got more complex "
+                   "since the given JSON report, and skip translation units "
+                   "whose inputs did not change. Fails if there is any "
+                   "warning"),
+    llvm::cl::value_desc("report.json"),
+    llvm::cl::cat(McCabeCategory));
+
+llvm::cl::opt<bool> ProfileOption(
+    "profile",
+    llvm::cl::desc("Time the CFG construction and analysis of every function "
+                   "and print the slowest ones at the end of the run"),
+    llvm::cl::cat(McCabeCategory));
+
+llvm::cl::opt<unsigned> ProfileTopOption(
+    "profile-top",
+    llvm::cl::init(20),
+    llvm::cl::desc("How many of the slowest functions -profile prints"),
+    llvm::cl::cat(McCabeCategory));
+
+llvm::cl::opt<unsigned> TimeBudgetOption(
+    "time-budget",
+    llvm::cl::init(0),
+    llvm::cl::desc("Skip functions whose CFG takes longer than this many "
+                   "milliseconds to build and analyze (0 for no limit)"),
+    llvm::cl::value_desc("ms"),
+    llvm::cl::cat(McCabeCategory));
+
+llvm::cl::opt<std::string> CacheOption(
+    "cache",
+    llvm::cl::desc("Reuse the metrics of unchanged function bodies from the "
+                   "given file, and store the new ones there"),
+    llvm::cl::value_desc("filename"),
+    llvm::cl::cat(McCabeCategory));
+
+llvm::cl::opt<unsigned>
+    JobsOption("jobs",
+               llvm::cl::init(0),
+               llvm::cl::desc("The number of files to process in parallel "
+                              "(0 for one per hardware thread)"),
+               llvm::cl::cat(McCabeCategory));
+llvm::cl::alias ShortJobsOption("j",
+                                llvm::cl::desc("Alias for -jobs"),
+                                llvm::cl::aliasopt(JobsOption));
+
+llvm::cl::opt<McCabe::Engine> EngineOption(
+    "engine",
+    llvm::cl::desc("How to compute the complexity"),
+    llvm::cl::init(McCabe::Engine::CFG),
+    llvm::cl::values(
+        clEnumValN(McCabe::Engine::CFG,
+                   "cfg",
+                   "Count nodes and edges of the control flow graph"),
+        clEnumValN(McCabe::Engine::AST,
+                   "ast",
+                   "Count decision points in one pass over the AST (faster)"),
+        clEnumValN(McCabe::Engine::Both,
+                   "both",
+                   "Run both, report disagreements and time each engine. "
+                   "Any disagreement fails the run")),
+    llvm::cl::cat(McCabeCategory));
+
 }  // namespace
 
 struct ToolFactory : public clang::tooling::FrontendActionFactory {
+  ToolFactory(const McCabe::Configuration& Settings, McCabe::Unit* Record)
+  : Settings(Settings), Record(Record) {}
+
   clang::FrontendAction* create() override {
-    return new McCabe::Action(ThresholdOption);
+    return new McCabe::Action(Settings, Record);
   }
+
+  const McCabe::Configuration& Settings;
+  McCabe::Unit* Record;
 };
 
 auto main(int argc, const char* argv[]) -> int {
   using namespace clang::tooling;
 
   CommonOptionsParser OptionsParser(argc, argv, McCabeCategory);
-  ClangTool Tool(OptionsParser.getCompilations(),
-                 OptionsParser.getSourcePathList());
 
-  return Tool.run(new ToolFactory());
+  McCabe::Configuration Settings;
+  Settings.Limits.Cyclomatic = ThresholdOption;
+  Settings.Limits.NPath = NPathThresholdOption;
+  Settings.Limits.MaximumNesting = NestingThresholdOption;
+  Settings.Limits.Cognitive = CognitiveThresholdOption;
+  Settings.Limits.Blocks = BlocksThresholdOption;
+  Settings.Limits.Statements = StatementsThresholdOption;
+  Settings.SelectedEngine = EngineOption;
+  Settings.Instantiations = InstantiationsOption;
+  Settings.Budget = std::chrono::milliseconds(TimeBudgetOption);
+
+  McCabe::RowCollector Rows;
+  const bool Collecting = !ReportOption.empty() || TopOption > 0;
+  if (Collecting) Settings.Rows = &Rows;
+
+  // Directories are summarized relative to where we were started from.
+  llvm::SmallString<256> WorkingDirectory;
+  llvm::sys::fs::current_path(WorkingDirectory);
+  McCabe::DistributionSummary Summary(WorkingDirectory.str(),
+                                      SummaryDepthOption);
+  if (SummaryOption) Settings.Summary = &Summary;
+
+  std::unique_ptr<McCabe::MetricsCache> Cache;
+  if (!CacheOption.empty()) {
+    Cache = std::make_unique<McCabe::MetricsCache>(CacheOption);
+    Settings.Cache = Cache.get();
+  }
+
+  McCabe::ClaimSet Claims;
+  Settings.Claims = &Claims;
+
+  // Functions over budget are listed even without -profile.
+  McCabe::Profiler Profile(ProfileOption ? ProfileTopOption : 0);
+  if (ProfileOption || TimeBudgetOption > 0) Settings.Profile = &Profile;
+
+  McCabe::BuildCostModel Costs;
+  if (TimeBudgetOption > 0) Settings.Costs = &Costs;
+
+  std::atomic<unsigned> Disagreements(0);
+  if (EngineOption == McCabe::Engine::Both) {
+    Settings.Disagreements = &Disagreements;
+  }
+
+  std::unique_ptr<McCabe::BaselineReport> Baseline;
+  if (!BaselineOption.empty()) {
+    Baseline = McCabe::BaselineReport::load(BaselineOption);
+    if (!Baseline) return 1;
+    Settings.Baseline = Baseline.get();
+  }
+
+  // The sources reach the task as absolute paths, which also identify units
+  // in the report.
+  const auto& Compilations = OptionsParser.getCompilations();
+  std::atomic<unsigned> Skipped(0);
+  const auto Status = ToolSupport::RunToolsInParallel(
+      Compilations,
+      OptionsParser.getSourcePathList(),
+      JobsOption,
+      [&](ClangTool& Tool, const std::string& Source, const std::string&) {
+        McCabe::Unit Record;
+        Record.File = Source;
+        Record.Command = McCabe::HashCommands(Compilations, Source);
+
+        // Nothing in an unchanged unit can have regressed. Carry its rows
+        // over, so that the report stays complete.
+        if (Baseline) {
+          const auto* Previous =
+              Baseline->findUnchanged(Record.File, Record.Command);
+          if (Previous) {
+            for (const auto& Entry : Baseline->getRows(Record.File)) {
+              if (Collecting) Rows.add(Entry);
+              if (SummaryOption) {
+                Summary.add(Entry.File, Entry.Measured.Cyclomatic);
+              }
+            }
+            if (Collecting) Rows.addUnit(*Previous);
+            Skipped += 1;
+            return true;
+          }
+        }
+
+        ToolFactory Factory(Settings, Collecting ? &Record : nullptr);
+        if (Tool.run(&Factory) != 0) return false;
+
+        if (Collecting) Rows.addUnit(std::move(Record));
+        return true;
+      });
+
+  if (Baseline) {
+    llvm::errs() << "Skipped " << Skipped << " unchanged translation units, "
+                 << Baseline->getRegressions()
+                 << " warnings about new or regressed functions\n";
+  }
+
+  if (Cache) {
+    llvm::errs() << "Reused " << Cache->getHits() << " of "
+                 << (Cache->getHits() + Cache->getMisses())
+                 << " functions from the cache\n";
+    if (!Cache->save()) {
+      llvm::errs() << "Could not write " << CacheOption << '\n';
+    }
+  }
+
+  if (Settings.Disagreements && Disagreements > 0) {
+    llvm::errs() << "The engines disagree on " << Disagreements
+                 << " functions\n";
+  }
+
+  // With a baseline, any warning is a regression that should fail the run.
+  // Comparing the engines is meant to catch their disagreements, so those
+  // fail it as well.
+  const int Result = (Status || (Baseline && Baseline->getRegressions() > 0) ||
+                      Disagreements > 0)
+                         ? 1
+                         : 0;
+
+  if (SummaryOption) Summary.print(llvm::outs());
+  if (Settings.Profile) Profile.print(llvm::outs());
+  if (!Collecting) return Result;
+
+  const auto Merged = Rows.merge();
+  if (!ReportOption.empty()) {
+    std::error_code Error;
+    llvm::raw_fd_ostream Stream(ReportOption, Error, llvm::sys::fs::F_Text);
+    if (Error) {
+      llvm::errs() << "Could not write " << ReportOption << ": "
+                   << Error.message() << '\n';
+      return 1;
+    }
+    McCabe::WriteReport(Stream, Merged, Rows.takeUnits(), ReportFormatOption);
+  }
+
+  if (TopOption > 0) McCabe::PrintTop(llvm::outs(), Merged, TopOption);
+
+  return Result;
 }
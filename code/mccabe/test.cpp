@@ -25,3 +25,58 @@ int h(int x) {
   }
   return x;
 }
+
+int loops(int x) {
+  int sum = 0;
+  for (int i = 0; i < x; ++i) {
+    sum += i;
+  }
+  while (sum > 100) {
+    sum /= 2;
+  }
+  do {
+    --sum;
+  } while (sum > 50);
+  int values[] = {1, 2, 3};
+  for (auto value : values) {
+    sum += value;
+  }
+  return sum;
+}
+
+int branches(int x, int y) {
+  switch (x) {
+    case 0: return 1;
+    case 1:
+    case 2: return y;
+    default: break;
+  }
+  if (x > 0 && y > 0) return x;
+  if (x < 0 || (y < 0 && x != y)) return y;
+  return x > y ? x : y;
+}
+
+int handlers(int x) {
+  try {
+    if (x < 0) throw x;
+  } catch (int) {
+    return 0;
+  } catch (...) {
+    return 1;
+  }
+  auto lambda = [](int y) { return y > 0 ? y : -y; };
+  return lambda(x);
+}
+
+int declared(int x);
+
+template <typename T>
+T clamp(T value, T low, T high) {
+  if (value < low) return low;
+  if (value > high) return high;
+  return value;
+}
+
+int declared(int x) {
+  return clamp(x, 0, 10) + static_cast<int>(clamp<long>(x, 0, 10));
+}